@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_HEX_H
+#define ATTENTIVE_AT_HEX_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The block decoder uses SSE2 or NEON when the compiler targets them. Define
+ * ATTENTIVE_HEX_SCALAR to force the portable implementation.
+ */
+
+/**
+ * Return the value of a single hex digit.
+ *
+ * @param c Character to convert; both upper and lower case are accepted.
+ * @returns Digit value (0-15), or -1 if c is not a hex digit.
+ */
+int at_hex_value(char c);
+
+/**
+ * Decode a block of hex digit pairs.
+ *
+ * Decoding stops at the first pair that contains a non-hex character, so the
+ * caller can deal with separators and resume after them.
+ *
+ * @param dst Output buffer, at least len/2 bytes long.
+ * @param src Hex digits.
+ * @param len Number of characters available in src.
+ * @returns Number of bytes written to dst. Exactly twice as many characters
+ *          were consumed from src.
+ */
+size_t at_hex_decode(void *dst, const char *src, size_t len);
+
+/**
+ * Encode binary data as upper case hex digits.
+ *
+ * @param dst Output buffer, at least 2*len characters long. No terminating
+ *            NUL is written.
+ * @param src Data to encode.
+ * @param len Data size in bytes.
+ * @returns Number of characters written (2*len).
+ */
+size_t at_hex_encode(char *dst, const void *src, size_t len);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,144 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_TOKENIZER_H
+#define ATTENTIVE_AT_TOKENIZER_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Response line tokenizer.
+ *
+ * Walks a single response line left to right without copying or allocating.
+ * Errors are sticky: once a call fails, all following calls fail too and
+ * leave their outputs untouched, so a whole line can be picked apart with a
+ * sequence of calls and checked once with at_tok_ok().
+ *
+ * Value fields are separated by commas; a comma following a value is
+ * consumed along with it. Other separators (e.g. the dots in an IP address)
+ * are matched with at_tok_char().
+ */
+struct at_tok {
+    const char *line;   /**< Start of the line. */
+    const char *pos;    /**< Current position. */
+    const char *end;    /**< End of the line. */
+    const char *error;  /**< Position of the first error, or NULL. */
+};
+
+/**
+ * Start tokenizing a line.
+ *
+ * Tokenizing stops at the first newline, so a multi-line response can be
+ * passed as a whole to parse its first line.
+ *
+ * @param tok Tokenizer instance.
+ * @param line Line to tokenize.
+ * @param len Line length in bytes.
+ */
+void at_tok_init(struct at_tok *tok, const char *line, size_t len);
+
+/**
+ * Match literal text at the current position.
+ *
+ * @param tok Tokenizer instance.
+ * @param prefix Text to match, e.g. "+CSQ: ".
+ * @returns True if the text matched and was consumed.
+ */
+bool at_tok_prefix(struct at_tok *tok, const char *prefix);
+
+/**
+ * Match a single separator character at the current position.
+ *
+ * @param tok Tokenizer instance.
+ * @param c Character to match.
+ * @returns True if the character matched and was consumed.
+ */
+bool at_tok_char(struct at_tok *tok, char c);
+
+/**
+ * Extract a decimal integer. Leading spaces and a sign are accepted.
+ *
+ * @param tok Tokenizer instance.
+ * @param value Set to the parsed value; may be NULL to skip the field.
+ * @returns True on success, false if there are no digits or the value
+ *          doesn't fit in an int.
+ */
+bool at_tok_int(struct at_tok *tok, int *value);
+
+/**
+ * Extract a decimal number with an optional fractional part.
+ *
+ * @param tok Tokenizer instance.
+ * @param value Set to the parsed value; may be NULL to skip the field.
+ * @returns True on success, false if there are no digits.
+ */
+bool at_tok_float(struct at_tok *tok, float *value);
+
+/**
+ * Extract a string field.
+ *
+ * A quoted field runs up to the closing quote, which must be present. A
+ * bare field runs up to the next comma or the end of the line. The result
+ * points into the line and is not NUL-terminated.
+ *
+ * @param tok Tokenizer instance.
+ * @param str Set to the start of the string, without quotes; may be NULL.
+ * @param len Set to the string length; may be NULL.
+ * @returns True on success.
+ */
+bool at_tok_string(struct at_tok *tok, const char **str, size_t *len);
+
+/**
+ * Copy a run of decimal digits, e.g. an IMEI or ICCID.
+ *
+ * @param tok Tokenizer instance.
+ * @param buf Output buffer; always NUL-terminated on success. Excess digits
+ *            are consumed but not copied.
+ * @param size Output buffer size in bytes.
+ * @returns True on success, false if there are no digits.
+ */
+bool at_tok_digits(struct at_tok *tok, char *buf, size_t size);
+
+/**
+ * Skip a single field of any type.
+ *
+ * @param tok Tokenizer instance.
+ * @returns True on success.
+ */
+bool at_tok_skip(struct at_tok *tok);
+
+/**
+ * Check if tokenizing succeeded so far.
+ *
+ * @param tok Tokenizer instance.
+ * @returns True if no call has failed.
+ */
+bool at_tok_ok(const struct at_tok *tok);
+
+/**
+ * Locate the first error.
+ *
+ * @param tok Tokenizer instance.
+ * @returns Offset of the first error from the start of the line, or -1 if
+ *          there was none.
+ */
+int at_tok_error_pos(const struct at_tok *tok);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,113 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_AT_TRACE_H
+#define ATTENTIVE_AT_TRACE_H
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Binary wire trace: a ring of fixed-size records of what went over the
+ * wire, cheap enough to stay enabled in production and dumped after the
+ * fact. Recording is lock-free and safe from any number of threads; it
+ * needs the GCC/Clang __atomic builtins.
+ */
+
+#ifndef AT_TRACE_DATA_MAX
+/** Bytes of each line or command kept in a trace record. */
+#define AT_TRACE_DATA_MAX 40
+#endif
+
+/** Clock used to timestamp records. Any monotonic unit will do; may wrap. */
+typedef uint32_t (*at_trace_clock_t)(void);
+
+enum at_trace_event {
+    AT_TRACE_COMMAND,       /**< Sent: command line, without the trailing CR. */
+    AT_TRACE_RAW,           /**< Sent: raw data. */
+    AT_TRACE_LINE,          /**< Received: response or URC line. */
+    AT_TRACE_TIMEOUT,       /**< Command timed out. */
+};
+
+struct at_trace_record {
+    uint32_t seq;           /**< @internal Sequence number + 1; 0 while being written. */
+    uint32_t timestamp;     /**< Clock value when the record was made. */
+    uint8_t event;          /**< One of enum at_trace_event. */
+    int8_t type;            /**< Line type (enum at_response_type) for AT_TRACE_LINE. */
+    uint16_t length;        /**< Original length, saturated at UINT16_MAX. */
+    char data[AT_TRACE_DATA_MAX];   /**< First bytes of the line or command. */
+};
+
+struct at_trace {
+    struct at_trace_record *records;
+    uint32_t mask;
+    uint32_t head;          /**< Sequence number of the next record. */
+    at_trace_clock_t clock;
+};
+
+/**
+ * Initialize a trace ring.
+ *
+ * @param trace Trace instance.
+ * @param records Record storage; NULL disables the trace.
+ * @param count Number of records. Must be a power of two no larger than 2^31.
+ * @param clock Timestamp clock, or NULL for zero timestamps.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_trace_init(struct at_trace *trace, struct at_trace_record *records, size_t count,
+                  at_trace_clock_t clock);
+
+/**
+ * Append a record, overwriting the oldest one when the ring is full.
+ *
+ * Lock-free; may be called from several threads at once and concurrently
+ * with at_trace_snapshot() and at_trace_dump().
+ *
+ * @param trace Trace instance, or NULL.
+ * @param event What happened.
+ * @param type Line type for AT_TRACE_LINE, zero otherwise.
+ * @param data Line or data; only AT_TRACE_DATA_MAX bytes are kept.
+ * @param len Data length.
+ */
+void at_trace_record(struct at_trace *trace, enum at_trace_event event, int type,
+                     const void *data, size_t len);
+
+/**
+ * Copy the most recent records out of the ring, oldest first.
+ *
+ * Records overwritten or still being written while they're copied are
+ * skipped, so every returned record is consistent.
+ *
+ * @param trace Trace instance.
+ * @param out Output records.
+ * @param count Maximum number of records to copy.
+ * @returns Number of records copied.
+ */
+size_t at_trace_snapshot(struct at_trace *trace, struct at_trace_record *out, size_t count);
+
+/**
+ * Print the trace in a human readable form, oldest record first.
+ *
+ * @param trace Trace instance.
+ * @param stream Output stream.
+ */
+void at_trace_dump(struct at_trace *trace, FILE *stream);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
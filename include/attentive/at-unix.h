@@ -13,18 +13,242 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <termios.h>
+#include <time.h>
 
 #include <attentive/at.h>
 
+#ifndef AT_UNIX_BUFFER_SIZE
+/** Response buffer size used by at_alloc_unix(). */
+#define AT_UNIX_BUFFER_SIZE 256
+#endif
+
+#ifndef AT_UNIX_READ_SIZE
+/** Reader thread buffer size; the largest chunk read from the port at once. */
+#define AT_UNIX_READ_SIZE 256
+#endif
+
+#ifndef AT_UNIX_TRACE_RECORDS
+/** Wire trace records kept per channel. Must be a power of two. */
+#define AT_UNIX_TRACE_RECORDS 64
+#endif
+
+#ifndef AT_UNIX_COMMAND_LENGTH
+/** Longest command line sent by at_command(), including the trailing CR. */
+#define AT_UNIX_COMMAND_LENGTH 80
+#endif
+
+#ifndef AT_UNIX_REQUESTS_MAX
+/** Commands queued on a channel at the same time, including the one sent. */
+#define AT_UNIX_REQUESTS_MAX 4
+#endif
+
+struct at_reactor;
+
+/*
+ * Queued command. Only the oldest one has been sent: the next one goes out
+ * once it completes.
+ */
+struct at_unix_request {
+    at_command_cb_t cb;
+    void *arg;
+    struct at_parser_command command;           /**< Parser settings. */
+    at_line_scanner_t scanner;                  /**< Command line scanner. */
+    at_character_handler_t character_handler;
+    at_span_handler_t span_handler;
+    const void *data;       /**< Command to send. */
+    size_t size;
+    size_t written;         /**< Bytes of data written so far. */
+    long timeout;           /**< Timeout in milliseconds, from starting to send. */
+    struct timespec deadline;
+    bool sent;              /**< Queued in the parser; being written or out. */
+    bool timed;             /**< The deadline applies. */
+    char line[AT_UNIX_COMMAND_LENGTH];          /**< Copy of the command, if made. */
+};
+
+/*
+ * AT channel instance. Exposed only so that it can be allocated by the
+ * caller (see at_init_unix()); all fields are private.
+ */
+struct at_unix {
+    struct at at;
+    struct at_parser parser;    /**< Parser, unless allocated separately. */
+
+    const char *devpath;    /**< Serial port device path. */
+    speed_t baudrate;       /**< Serial port baudate. */
+
+    long timeout;           /**< Command timeout in milliseconds. */
+    const char *response;   /**< Last response returned by at_command(). */
+    struct at_response_line response_lines[AT_RESPONSE_LINES_MAX];  /**< Its line index. */
+    size_t response_line_count;
+    size_t response_sink_used;  /**< Sink bytes written by its command. */
+    at_character_handler_t character_handler;   /**< For the next command. */
+    at_span_handler_t span_handler;             /**< For the next command. */
+
+    pthread_t thread;       /**< Reader thread, unless served by a reactor. */
+    struct at_reactor *reactor;     /**< Reactor serving the port, or NULL. */
+    int reactor_slot;       /**< Channel slot in the reactor. */
+    pthread_mutex_t mutex;  /**< Protects variables below and the parser. Recursive. */
+    pthread_cond_t cond;    /**< For signalling open/busy release and completions. */
+
+    int fd;                 /**< Serial port file descriptor. */
+    int wake[2];            /**< Pipe waking the reader thread up from poll(). */
+    int timerfd;            /**< Reactor timer for the next deadline. */
+    size_t read_chunk;      /**< Bytes asked for per read(). */
+    cc_t read_vmin;         /**< VMIN set by at_open(). */
+    cc_t read_vtime;        /**< VTIME set by at_open(). */
+    char read_buf[AT_UNIX_READ_SIZE];   /**< Reader thread's chunk buffer. */
+    bool reader : 1;        /**< Reader thread was started. */
+    bool running : 1;       /**< Reader thread should be running. */
+    bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
+    bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
+    bool allocated : 1;     /**< Instance was allocated by at_alloc_unix(). */
+    bool completing : 1;    /**< An asynchronous command's callback is running. */
+    int urc_match;          /**< Registered URC found by the line scanner, or -1. */
+
+    struct at_unix_request requests[AT_UNIX_REQUESTS_MAX];
+    size_t request_head;    /**< Oldest request, whose response is being collected. */
+    size_t request_count;
+
+    struct at_trace trace;  /**< Wire trace. */
+    struct at_trace_record trace_records[AT_UNIX_TRACE_RECORDS];
+    FILE *trace_dump;       /**< Where to dump the trace on timeouts. */
+
+    pthread_mutex_t urc_mutex;  /**< Protects the URC queue. Taken after mutex. */
+    pthread_cond_t urc_cond;    /**< For signalling queued URCs and dispatch end. */
+    pthread_t urc_thread;       /**< URC dispatcher thread. */
+    pthread_t urc_owner;        /**< Thread running the URC handler. */
+    char *urc_slots;            /**< URC queue slots, urc_slot_size+1 bytes each. */
+    size_t *urc_lengths;        /**< Line length in each slot. */
+    char *urc_line;             /**< Copy of the URC being handled. */
+    size_t urc_slot_count;
+    size_t urc_slot_size;
+    size_t urc_head;            /**< Slot of the oldest queued URC. */
+    size_t urc_count;           /**< Number of queued URCs. */
+    enum at_urc_drop_policy urc_policy;
+    uint32_t urc_dropped;       /**< URCs dropped because the queue was full. */
+    bool urc_owned;             /**< Queue storage was allocated by at_set_urc_queue(). */
+    bool urc_dispatcher;        /**< Dispatcher thread is running. */
+    bool urc_stopping;          /**< Dispatcher thread should exit. */
+    bool urc_dispatching;       /**< URC handler is running. */
+};
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Create an AT channel instance.
  *
+ * The response buffer is AT_UNIX_BUFFER_SIZE bytes long; it can be allowed
+ * to grow with at_set_buffer_limit().
+ *
  * @param devpath Device path.
  * @param baudrate If non-zero, sets device baudrate (see termios.h).
  * @returns Instance pointer on success, NULL and sets errno on failure.
  */
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate);
+#endif
+
+/**
+ * Initialize an AT channel instance in caller-provided storage.
+ *
+ * Same as at_alloc_unix(), but doesn't allocate any memory. at_free() shuts
+ * the channel down without freeing the instance or the buffer, which must
+ * outlive it.
+ *
+ * @param priv Instance storage.
+ * @param devpath Device path.
+ * @param baudrate If non-zero, sets device baudrate (see termios.h).
+ * @param buf Response buffer. Must be at least bufsize bytes long.
+ * @param bufsize Response buffer size in bytes.
+ * @returns Instance pointer on success, NULL and sets errno on failure.
+ */
+struct at *at_init_unix(struct at_unix *priv, const char *devpath, speed_t baudrate,
+                        void *buf, size_t bufsize);
+
+/**
+ * Tune how the reader thread reads from the serial port.
+ *
+ * The reader takes up to chunk bytes per read() and feeds them all to the
+ * parser under a single lock. In non-canonical mode, VMIN and VTIME (see
+ * termios(3)) decide when read() returns: the defaults of 1 and 0 return as
+ * soon as anything arrives, while a larger VMIN with a non-zero VTIME saves
+ * wakeups on bulk transfers at the cost of latency. A VMIN above 1 needs a
+ * non-zero VTIME, which bounds how long at_close() may wait for the reader.
+ * The chunk size applies from the next read, VMIN and VTIME from the next
+ * at_open().
+ *
+ * @param at AT channel instance.
+ * @param chunk Bytes per read(), from 1 to AT_UNIX_READ_SIZE.
+ * @param vmin Minimum number of bytes for read() to return.
+ * @param vtime Inter-byte timeout in tenths of a second; non-zero if vmin > 1.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_read_unix(struct at *at, size_t chunk, cc_t vmin, cc_t vtime);
+
+#if defined(__linux__)
+#ifndef AT_REACTOR_CHANNELS_MAX
+/** Channels a reactor can serve at once. */
+#define AT_REACTOR_CHANNELS_MAX 64
+#endif
+
+#ifndef AT_REACTOR_THREADS_MAX
+/** Size limit of a reactor's thread pool. */
+#define AT_REACTOR_THREADS_MAX 4
+#endif
+
+/*
+ * Reactor: a small pool of threads reading all its channels with epoll, in
+ * place of a reader thread per channel. Exposed only so that it can be
+ * allocated by the caller; all fields are private.
+ */
+struct at_reactor {
+    int epfd;               /**< epoll instance. */
+    int stopfd;             /**< eventfd, readable once the pool should exit. */
+    pthread_t threads[AT_REACTOR_THREADS_MAX];
+    size_t thread_count;
+    pthread_mutex_t mutex;  /**< Protects the channel table. Taken after a channel's mutex. */
+    pthread_cond_t cond;    /**< For signalling the end of a channel read. */
+    struct at_unix *channels[AT_REACTOR_CHANNELS_MAX];
+    uint32_t generations[AT_REACTOR_CHANNELS_MAX];  /**< Bumped on every (un)registration. */
+    unsigned busy[AT_REACTOR_CHANNELS_MAX];         /**< Threads reading each channel. */
+    bool writing[AT_REACTOR_CHANNELS_MAX];          /**< Channel waits for room to write. */
+};
+
+/**
+ * Start a reactor.
+ *
+ * @param reactor Reactor storage.
+ * @param threads Thread pool size, from 1 to AT_REACTOR_THREADS_MAX.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_reactor_start(struct at_reactor *reactor, size_t threads);
+
+/**
+ * Stop a reactor and wait for its threads to exit.
+ *
+ * All channels using the reactor must be closed first.
+ *
+ * @param reactor Reactor instance.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_reactor_stop(struct at_reactor *reactor);
+
+/**
+ * Serve a channel from a reactor instead of its own reader thread.
+ *
+ * Must be called before the channel is first opened. From then on the
+ * channel is registered with the reactor by at_open() and unregistered by
+ * at_close(); the port is switched to non-blocking mode. Commands are
+ * issued the same way as with a reader thread.
+ *
+ * @param at AT channel instance.
+ * @param reactor Running reactor, or NULL to go back to a reader thread.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_reactor_unix(struct at *at, struct at_reactor *reactor);
+#endif
 
 #if defined(__cplusplus)
 }
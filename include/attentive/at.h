@@ -14,6 +14,31 @@ extern "C" {
 #endif
 
 #include <attentive/parser.h>
+#include <attentive/at-tokenizer.h>
+
+#ifndef AT_URC_HANDLERS_MAX
+/** Maximum number of URC handlers registered on a channel. */
+#define AT_URC_HANDLERS_MAX 32
+#endif
+
+/**
+ * Handler of a registered URC.
+ *
+ * @param line URC line.
+ * @param len Line length.
+ * @param tok Tokenizer positioned right after the prefix.
+ * @param arg Argument given at registration.
+ */
+typedef void (*at_urc_handler_t)(const char *line, size_t len, struct at_tok *tok, void *arg);
+
+/** URC handlers keyed by prefix. See at_register_urc(). */
+struct at_urc_registry {
+    const char *prefixes[AT_URC_HANDLERS_MAX+1];    /**< NULL-terminated. */
+    at_urc_handler_t handlers[AT_URC_HANDLERS_MAX];
+    void *args[AT_URC_HANDLERS_MAX];
+    size_t count;
+    struct at_prefix_matcher matcher;               /**< Compiled prefixes. */
+};
 
 /*
  * Publicly accessible fields. Platform-specific implementations may add private
@@ -24,13 +49,32 @@ struct at {
     const struct at_callbacks *cbs;
     void *arg;
     at_line_scanner_t command_scanner;
+    struct at_urc_registry urcs;
 };
 
+/**
+ * Completion callback of an asynchronous command. See at_command_async().
+ *
+ * @param at AT channel instance.
+ * @param response Response, valid only during the callback, or NULL on failure.
+ * @param error Zero on success, or an errno value as set by at_command() on
+ *              failure; ENODEV means the channel was closed.
+ * @param arg Argument given to at_command_async().
+ */
+typedef void (*at_command_cb_t)(struct at *at, const char *response, int error, void *arg);
+
 struct at_callbacks {
     at_line_scanner_t scan_line;
     at_response_handler_t handle_urc;
 };
 
+/** What to do with a URC that arrives while the URC queue is full. */
+enum at_urc_drop_policy {
+    AT_URC_DROP_NEWEST,     /**< Discard the URC that just arrived. */
+    AT_URC_DROP_OLDEST,     /**< Discard the oldest queued URC to make room. */
+};
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Create an AT channel instance.
  *
@@ -40,6 +84,7 @@ struct at_callbacks {
  * @returns Instance pointer on success, NULL and sets errno on failure.
  */
 struct at *at_alloc(void);
+#endif
 
 /**
  * Open the AT channel.
@@ -60,6 +105,8 @@ int at_close(struct at *at);
 /**
  * Close and free an AT channel instance.
  *
+ * Instances set up in caller-provided storage are shut down, but not freed.
+ *
  * @param at AT channel instance.
  */
 void at_free(struct at *at);
@@ -73,6 +120,109 @@ void at_free(struct at *at);
  */
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg);
 
+/** Size in bytes of the slot storage passed to at_init_urc_queue(). */
+#define AT_URC_QUEUE_STORAGE(slots, slot_size) \
+    (((slots) + 1) * ((slot_size) + 1))
+
+#if !defined(ATTENTIVE_NO_MALLOC)
+/**
+ * Deliver URCs through a bounded queue.
+ *
+ * By default, the URC handler is called right from the reader, which can't
+ * receive anything else until the handler returns. With a queue, each URC
+ * line is copied into one of a fixed number of preallocated slots instead,
+ * and the handler runs later: either on a dedicated dispatcher thread or
+ * from at_urc_drain(). The line scanner still runs in the reader.
+ *
+ * URCs longer than the slot size are truncated. When all slots are taken,
+ * a URC is dropped according to the policy and counted; see at_urc_dropped().
+ *
+ * Must not be called from a URC handler; waits for one that at_urc_drain()
+ * runs in another thread to return.
+ * Replacing a queue discards any URCs still queued in it.
+ *
+ * @param at AT channel instance.
+ * @param slots Number of queued URCs, or zero to deliver URCs directly again.
+ * @param slot_size Maximum URC length in bytes.
+ * @param policy Which URC to drop when the queue is full.
+ * @param dispatcher Start a dispatcher thread; otherwise the application
+ *                   calls at_urc_drain().
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_urc_queue(struct at *at, size_t slots, size_t slot_size,
+                     enum at_urc_drop_policy policy, bool dispatcher);
+#endif
+
+/**
+ * Deliver URCs through a bounded queue kept in caller-provided storage.
+ *
+ * Same as at_set_urc_queue(), but doesn't allocate any memory. The storage
+ * must stay valid until the queue is replaced or the channel is freed.
+ *
+ * @param at AT channel instance.
+ * @param storage Slot storage, AT_URC_QUEUE_STORAGE(slots, slot_size) bytes.
+ * @param lengths Array of slots line lengths.
+ * @param slots Number of queued URCs, or zero to deliver URCs directly again.
+ * @param slot_size Maximum URC length in bytes.
+ * @param policy Which URC to drop when the queue is full.
+ * @param dispatcher Start a dispatcher thread; otherwise the application
+ *                   calls at_urc_drain().
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_init_urc_queue(struct at *at, char *storage, size_t *lengths,
+                      size_t slots, size_t slot_size,
+                      enum at_urc_drop_policy policy, bool dispatcher);
+
+/**
+ * Run the URC handler on queued URCs from the caller's context.
+ *
+ * Returns immediately if another thread is dispatching URCs at the time.
+ *
+ * @param at AT channel instance.
+ * @returns Number of URCs handled.
+ */
+int at_urc_drain(struct at *at);
+
+/**
+ * Get the number of URCs dropped because the URC queue was full.
+ *
+ * @param at AT channel instance.
+ * @returns Number of dropped URCs since the queue was set up.
+ */
+uint32_t at_urc_dropped(struct at *at);
+
+/**
+ * Register a URC handler.
+ *
+ * Lines starting with the prefix are taken for URCs and passed to the
+ * handler instead of the URC callback set with at_set_callbacks(). Finding
+ * the handler is a single lookup in a compiled prefix table, done once per
+ * line. Only a per-command line scanner takes precedence.
+ *
+ * Registering a prefix again replaces its handler. When several prefixes
+ * match a line, the one registered first wins. Must not be called from a
+ * URC handler.
+ *
+ * @param at AT channel instance.
+ * @param prefix URC prefix, e.g. "+CREG: ". Not copied.
+ * @param handler URC handler.
+ * @param arg Argument passed to the handler.
+ * @returns Zero on success, -1 and sets errno to ENOBUFS if
+ *          AT_URC_HANDLERS_MAX handlers are already registered, or EINVAL
+ *          if the prefix can't be compiled (see at_prefix_matcher_init()).
+ */
+int at_register_urc(struct at *at, const char *prefix, at_urc_handler_t handler, void *arg);
+
+/**
+ * Unregister a URC handler.
+ *
+ * @param at AT channel instance.
+ * @param prefix URC prefix the handler was registered with.
+ * @returns Zero on success, -1 and sets errno to ENOENT if no handler is
+ *          registered for the prefix.
+ */
+int at_unregister_urc(struct at *at, const char *prefix);
+
 /**
  * Set custom per-command line scanner for the next command.
  *
@@ -89,6 +239,16 @@ void at_set_command_scanner(struct at *at, at_line_scanner_t scanner);
  */
 void at_set_character_handler(struct at *at, at_character_handler_t handler);
 
+/**
+ * Set custom span handler for the next command.
+ *
+ * See at_parser_set_span_handler() for details.
+ *
+ * @param at AT channel instance.
+ * @param handler Span handler.
+ */
+void at_set_span_handler(struct at *at, at_span_handler_t handler);
+
 /**
  * Expect "> " dataprompt as a response for the next command.
  *
@@ -96,6 +256,37 @@ void at_set_character_handler(struct at *at, at_character_handler_t handler);
  */
 void at_expect_dataprompt(struct at *at);
 
+/**
+ * Let the response buffer grow up to the given size.
+ *
+ * See at_parser_set_buffer_limit() for details.
+ *
+ * @param at AT channel instance.
+ * @param limit Maximum buffer size in bytes, or zero to keep it fixed.
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+int at_set_buffer_limit(struct at *at, size_t limit);
+
+/**
+ * Deliver raw data of the next command straight into a caller buffer.
+ *
+ * See at_parser_set_data_sink() for details.
+ *
+ * @param at AT channel instance.
+ * @param buf Sink buffer. Must stay valid until the command completes.
+ * @param size Sink buffer size in bytes.
+ */
+void at_set_data_sink(struct at *at, void *buf, size_t size);
+
+/**
+ * Get the number of raw data bytes written to the sink by the last command
+ * sent with at_command(), or by the command whose callback is running.
+ *
+ * @param at AT channel instance.
+ * @returns Number of bytes stored in the sink.
+ */
+size_t at_data_sink_used(struct at *at);
+
 /**
  * Set command timeout.
  *
@@ -104,19 +295,59 @@ void at_expect_dataprompt(struct at *at);
  */
 void at_set_timeout(struct at *at, int timeout);
 
+/**
+ * Set command timeout in milliseconds.
+ *
+ * Timeouts run on a monotonic clock where the platform has one, so setting
+ * the system time doesn't affect them. Waiting for a flow-controlled port to
+ * take the command counts against the timeout.
+ *
+ * @param at AT channel instance.
+ * @param timeout Timeout in milliseconds (zero to disable).
+ */
+void at_set_timeout_ms(struct at *at, long timeout);
+
 /**
  * Send an AT command and receive a response. Accepts printf-compatible
  * format and arguments.
  *
+ * If the modem has local echo enabled, the echoed command is dropped (see
+ * at_parser_expect_echo()). The same goes for at_command_raw().
+ *
  * @param at AT channel instance.
  * @param format printf-comaptible format.
  * @returns Pointer to response (valid until next at_command) or NULL
- *          if a timeout occurs. Response is newline-delimited and does
- *          not include the final "OK".
+ *          and sets errno on failure: ETIMEDOUT if a timeout occurs,
+ *          ENOBUFS if the response didn't fit in the buffer. Response is
+ *          newline-delimited and does not include the final "OK".
  */
 __attribute__ ((format (printf, 2, 3)))
 const char *at_command(struct at *at, const char *format, ...);
 
+/**
+ * Queue an AT command and return right away; cb is called once it completes,
+ * fails or times out. Accepts printf-compatible format and arguments.
+ *
+ * Commands are sent one at a time, each once the previous one completes, and
+ * complete in the order they were queued; a platform-defined number of them
+ * (AT_UNIX_REQUESTS_MAX on Unix) may be outstanding, blocking at_command()
+ * calls included. Per-command settings (timeout, line scanner, handlers, data
+ * sink, dataprompt) apply as they are when the command is queued, and the
+ * timeout runs from when its sending starts. The callback runs on the channel's reader (or
+ * at_close() for ENODEV) with the channel locked: it may queue more commands,
+ * but must not wait for one with at_command().
+ *
+ * @param at AT channel instance.
+ * @param cb Completion callback.
+ * @param arg Passed to cb.
+ * @param format printf-comaptible format.
+ * @returns Zero on success, -1 and sets errno on failure, in which case cb is
+ *          never called: ENODEV if the channel isn't open, ENOBUFS if too many
+ *          commands are outstanding, ENOMEM if the command is too long.
+ */
+__attribute__ ((format (printf, 4, 5)))
+int at_command_async(struct at *at, at_command_cb_t cb, void *arg, const char *format, ...);
+
 /**
  * Send raw data over the AT channel.
  *
@@ -128,6 +359,69 @@ const char *at_command(struct at *at, const char *format, ...);
  */
 const char *at_command_raw(struct at *at, const void *data, size_t size);
 
+/**
+ * Get the line index of the last response.
+ *
+ * See at_parser_response_lines() for details.
+ *
+ * @param at AT channel instance.
+ * @param count Set to the number of indexed lines.
+ * @returns Array of line locations (valid until next at_command), relative
+ *          to the response returned by at_command(). Called from a command
+ *          callback, the lines of that command's response instead.
+ */
+const struct at_response_line *at_response_lines(struct at *at, size_t *count);
+
+/**
+ * Get a single line of the last response returned by at_command().
+ *
+ * @param at AT channel instance.
+ * @param n Line number, starting at zero.
+ * @param len Set to the line length in bytes.
+ * @returns Pointer to the start of the line (valid until next at_command;
+ *          terminated by a newline, or NUL for the last line), or NULL if
+ *          the line wasn't indexed.
+ */
+const char *at_response_line(struct at *at, size_t n, size_t *len);
+
+/**
+ * Get statistics of the underlying parser.
+ *
+ * See at_parser_get_stats() for details. Callback time is measured in
+ * microseconds.
+ *
+ * @param at AT channel instance.
+ * @param stats Filled with the current counter values.
+ */
+void at_get_stats(struct at *at, struct at_parser_stats *stats);
+
+/**
+ * Reset statistics of the underlying parser to zero.
+ *
+ * @param at AT channel instance.
+ */
+void at_reset_stats(struct at *at);
+
+/**
+ * Get the wire trace of the channel.
+ *
+ * The trace keeps the most recent commands, received lines and timeouts.
+ * It can be dumped with at_trace_dump() at any time and from any thread,
+ * without stopping the channel. Timestamps are in microseconds.
+ *
+ * @param at AT channel instance.
+ * @returns Trace ring of the channel.
+ */
+struct at_trace *at_get_trace(struct at *at);
+
+/**
+ * Dump the wire trace whenever a command times out.
+ *
+ * @param at AT channel instance.
+ * @param stream Output stream, or NULL to stop dumping.
+ */
+void at_set_trace_dump(struct at *at, FILE *stream);
+
 /**
  * Send an AT command and return -1 if it doesn't return OK.
  */
@@ -156,6 +450,27 @@ const char *at_command_raw(struct at *at, const void *data, size_t size);
         }                                                                   \
     } while (0)
 
+/**
+ * Start tokenizing the first line of a response; return -1 if there is none.
+ */
+#define at_simple_tok_init(_tok, _response)                                 \
+    do {                                                                    \
+        if (!_response)                                                     \
+            return -1; /* timeout */                                        \
+        at_tok_init(_tok, _response, strlen(_response));                    \
+    } while (0)
+
+/**
+ * Return -1 if tokenizing a response failed.
+ */
+#define at_simple_tok_check(_tok)                                           \
+    do {                                                                    \
+        if (!at_tok_ok(_tok)) {                                             \
+            errno = EINVAL;                                                 \
+            return -1;                                                      \
+        }                                                                   \
+    } while (0)
+
 /**
  * Count macro arguments. Source:
  * http://stackoverflow.com/questions/2124339/c-preprocessor-va-args-number-of-arguments
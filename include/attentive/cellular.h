@@ -87,6 +87,7 @@ struct cellular_ops {
 };
 
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Allocate a cellular modem instance.
  *
@@ -96,6 +97,7 @@ struct cellular_ops {
  * @returns Instance pointer on success, NULL and sets errno on failure.
  */
 struct cellular *cellular_alloc(void);
+#endif
 
 /**
  * Attach cellular modem instance to an AT channel.
@@ -115,16 +117,23 @@ int cellular_attach(struct cellular *modem, struct at *at, const char *apn);
  */
 int cellular_detach(struct cellular *modem);
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Free a cellular modem instance.
  *
  * @param Modem instance allocated with cellular_alloc().
  */
 void cellular_free(struct cellular *modem);
+#endif
 
 
-/* Modem-specific variants below. */
+/*
+ * Modem-specific variants below. To provide the instance storage yourself,
+ * include the modem header (e.g. <attentive/modem/sim800.h>) and call the
+ * matching cellular_*_init() function instead.
+ */
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct cellular *cellular_generic_alloc(void);
 void cellular_generic_free(struct cellular *modem);
 
@@ -133,6 +142,7 @@ void cellular_telit2_free(struct cellular *modem);
 
 struct cellular *cellular_sim800_alloc(void);
 void cellular_sim800_free(struct cellular *modem);
+#endif
 
 #if defined(__cplusplus)
 }
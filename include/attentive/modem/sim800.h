@@ -0,0 +1,51 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_MODEM_SIM800_H
+#define ATTENTIVE_MODEM_SIM800_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <attentive/cellular.h>
+
+#define SIM800_NSOCKETS 6
+
+enum sim800_socket_status {
+    SIM800_SOCKET_STATUS_ERROR = -1,
+    SIM800_SOCKET_STATUS_UNKNOWN = 0,
+    SIM800_SOCKET_STATUS_CONNECTED = 1,
+};
+
+/*
+ * SIM800 modem instance. Exposed only so that it can be allocated by the
+ * caller (see cellular_sim800_init()); all fields are private.
+ */
+struct cellular_sim800 {
+    struct cellular dev;
+
+    int ftpget1_status;
+    enum sim800_socket_status socket_status[SIM800_NSOCKETS];
+};
+
+/**
+ * Initialize a SIM800 modem instance in caller-provided storage.
+ *
+ * @param modem Instance storage. No cleanup is needed when done.
+ * @returns Cellular modem instance.
+ */
+struct cellular *cellular_sim800_init(struct cellular_sim800 *modem);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
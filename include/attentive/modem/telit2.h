@@ -0,0 +1,43 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef ATTENTIVE_MODEM_TELIT2_H
+#define ATTENTIVE_MODEM_TELIT2_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include <attentive/cellular.h>
+
+/*
+ * Telit modem instance. Exposed only so that it can be allocated by the
+ * caller (see cellular_telit2_init()); all fields are private.
+ */
+struct cellular_telit2 {
+    struct cellular dev;
+
+    int locate_status;
+    float latitude, longitude, altitude;
+};
+
+/**
+ * Initialize a Telit modem instance in caller-provided storage.
+ *
+ * @param modem Instance storage. No cleanup is needed when done.
+ * @returns Cellular modem instance.
+ */
+struct cellular *cellular_telit2_init(struct cellular_telit2 *modem);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
@@ -18,6 +18,8 @@ extern "C" {
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <attentive/at-trace.h>
+
 /**
  * AT response type.
  *
@@ -49,6 +51,24 @@ enum at_response_type {
 /** Per-character handler. */
 typedef char (*at_character_handler_t)(char ch, char *line, size_t len, void *priv);
 
+/**
+ * Span handler. Gets a run of received bytes before the parser does, and
+ * writes the bytes to parse in their place to an output buffer: it may drop,
+ * rewrite or pass through any of them. Only called while reading lines; a
+ * span never extends past a newline, and is a single byte while a dataprompt
+ * is expected.
+ *
+ * @param data Received bytes.
+ * @param len Number of received bytes.
+ * @param out Output buffer, len bytes long.
+ * @param line Line received so far, not including data.
+ * @param line_len Length of line.
+ * @param priv Private argument.
+ * @returns Number of bytes written to out, at most len.
+ */
+typedef size_t (*at_span_handler_t)(const char *data, size_t len, char *out,
+                                    const char *line, size_t line_len, void *priv);
+
 /** Line scanner. Should return one of the AT_RESPONSE_* values if the line is
  *  identified or AT_RESPONSE_UNKNOWN to fall back to the default scanner. */
 typedef enum at_response_type (*at_line_scanner_t)(const char *line, size_t len, void *priv);
@@ -56,6 +76,81 @@ typedef enum at_response_type (*at_line_scanner_t)(const char *line, size_t len,
 /** Response handler. */
 typedef void (*at_response_handler_t)(const char *line, size_t len, void *priv);
 
+#ifndef AT_PREFIX_MATCHER_MAX
+/** Maximum number of prefixes in a compiled prefix matcher. */
+#define AT_PREFIX_MATCHER_MAX 64
+#endif
+
+#if AT_PREFIX_MATCHER_MAX > 255
+#error "AT_PREFIX_MATCHER_MAX must fit the uint8_t indices in struct at_prefix_matcher"
+#endif
+
+/**
+ * Compiled prefix table. Lines are dispatched on their first byte, so lookup
+ * cost depends on the number of prefixes sharing that byte rather than on
+ * the size of the whole table. Within a bucket, candidates are rejected by
+ * comparing their first four bytes as a single word. See
+ * at_prefix_matcher_init().
+ */
+struct at_prefix_matcher {
+    const char *const *table;
+    int empty;                              /**< Lowest index of an empty prefix, or -1. */
+    uint8_t start[257];                     /**< Bucket of first byte b is order[start[b]..start[b+1]). */
+    uint8_t order[AT_PREFIX_MATCHER_MAX];   /**< Table indices grouped by first byte. */
+    uint8_t length[AT_PREFIX_MATCHER_MAX];  /**< Prefix lengths, by table index. */
+    uint32_t head[AT_PREFIX_MATCHER_MAX];   /**< First four bytes of each prefix, packed. */
+    uint32_t mask[AT_PREFIX_MATCHER_MAX];   /**< Significant bits of head[]. */
+};
+
+#ifndef AT_RESPONSE_LINES_MAX
+/** Maximum number of lines indexed per response. */
+#define AT_RESPONSE_LINES_MAX 16
+#endif
+
+/** Location of a single line within a response. */
+struct at_response_line {
+    uint16_t offset;    /**< Offset from the start of the response. */
+    uint16_t length;    /**< Length in bytes, not including the newline. */
+    bool data;          /**< Raw or hex data block rather than a text line. */
+};
+
+/** Clock used to time callbacks. Any monotonic unit will do; may wrap. */
+typedef uint32_t (*at_parser_clock_t)(void);
+
+/** Parser statistics. All counters wrap around on overflow. */
+struct at_parser_stats {
+    uint32_t bytes_fed;         /**< Bytes passed to at_parser_feed(). */
+    uint32_t bytes_dropped;     /**< Bytes lost because the buffer or data sink was full. */
+    uint32_t rawdata_bytes;     /**< Payload bytes of raw data blocks. */
+    uint32_t hexdata_bytes;     /**< Payload bytes decoded from hex data blocks. */
+    uint32_t lines;             /**< Non-empty lines received. */
+    uint32_t responses;         /**< Responses passed to the response handler. */
+    uint32_t urcs;              /**< Lines passed to the URC handler. */
+    uint32_t unexpected;        /**< Of those, lines not recognized as URCs. */
+    uint32_t callback_time;     /**< Time spent in response and URC handlers, in clock units. */
+    uint32_t echo_bytes;        /**< Bytes dropped as local echo of commands. */
+};
+
+#ifndef AT_PARSER_COMMANDS_MAX
+/** Maximum number of commands awaiting a response at the same time. */
+#define AT_PARSER_COMMANDS_MAX 4
+#endif
+
+/** Command awaiting a response. See at_parser_queue_command(). */
+struct at_parser_command {
+    at_line_scanner_t scan_line;        /**< Line scanner tried before the default one, or NULL. */
+    at_character_handler_t character_handler;   /**< Per-character handler, or NULL. */
+    at_span_handler_t span_handler;     /**< Span handler, or NULL. Takes precedence. */
+    at_response_handler_t handle_response;      /**< Completion callback, or NULL for the default one. */
+    void *arg;                          /**< Passed to handle_response instead of the parser's. */
+    char *sink;                         /**< Data sink (see at_parser_set_data_sink()), or NULL. */
+    size_t sink_size;                   /**< Data sink size in bytes. */
+    const char *echo;                   /**< Bytes sent, dropped if echoed (see at_parser_expect_echo()), or NULL. */
+    size_t echo_len;                    /**< Number of bytes in echo. */
+    bool dataprompt;                    /**< Expect a "> " dataprompt instead of a result code. */
+    bool hold;                          /**< Keep the response stable until released. */
+};
+
 enum at_parser_state {
     STATE_IDLE,
     STATE_READLINE,
@@ -68,17 +163,46 @@ enum at_parser_state {
 struct at_parser {
     const struct at_parser_callbacks *cbs;
     at_character_handler_t character_handler;
+    at_span_handler_t span_handler;
     void *priv;
 
     enum at_parser_state state;
-    bool expect_dataprompt;
     size_t data_left;
     int nibble;
+    bool overflow;
+    bool line_overflow;
+
+    struct at_response_line lines[AT_RESPONSE_LINES_MAX];
+    size_t line_count;
+
+    char *sink;
+    size_t sink_size;
+    size_t sink_used;
+
+    const char *echo;
+    size_t echo_len;
+    size_t echo_matched;
+    bool echo_skip;
+
+    struct at_prefix_matcher generic;
+
+    struct at_parser_command next;
+    struct at_parser_command commands[AT_PARSER_COMMANDS_MAX];
+    size_t command_head;
+    size_t command_count;
+    bool held;
+
+    at_parser_clock_t clock;
+    struct at_parser_stats stats;
+    struct at_trace *trace;
 
     char *buf;
+    size_t buf_start;
     size_t buf_used;
     size_t buf_size;
     size_t buf_current;
+    size_t buf_limit;
+    bool buf_owned;
 };
 
 struct at_parser_callbacks {
@@ -87,9 +211,13 @@ struct at_parser_callbacks {
     at_response_handler_t handle_urc;
 };
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Allocate a parser instance.
  *
+ * Not available when built with ATTENTIVE_NO_MALLOC; use at_parser_init()
+ * instead.
+ *
  * @param cbs Parser callbacks. Structure is not copied; must persist for
  *            the lifetime of the parser.
  * @param bufsize Response buffer size on bytes.
@@ -97,6 +225,7 @@ struct at_parser_callbacks {
  * @returns Parser instance pointer.
  */
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv);
+#endif
 
 /**
  * Initialize a parser instance.
@@ -120,13 +249,29 @@ void at_parser_init(struct at_parser *parser, const struct at_parser_callbacks *
 void at_parser_reset(struct at_parser *parser);
 
 /**
- * Make the parser handle each character received.
+ * Make the parser handle each character received for the next command.
+ *
+ * Character handlers see the line updated after every byte, so input is
+ * parsed one byte at a time while one is installed. Prefer a span handler
+ * where that isn't needed.
  *
  * @param parser Parser instance.
  * @param handler Character handler.
  */
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler);
 
+/**
+ * Filter input through a span handler for the next command.
+ *
+ * Unlike a character handler, a span handler gets whole runs of input, so
+ * the parser keeps processing lines in bulk. Takes precedence over a
+ * character handler.
+ *
+ * @param parser Parser instance.
+ * @param handler Span handler.
+ */
+void at_parser_set_span_handler(struct at_parser *parser, at_span_handler_t handler);
+
 /**
  * Make the parser expect a dataprompt for the next command.
  *
@@ -138,14 +283,186 @@ void at_parser_set_character_handler(struct at_parser *parser, at_character_hand
  */
 void at_parser_expect_dataprompt(struct at_parser *parser);
 
+/**
+ * Deliver raw data of the next command straight into a caller buffer.
+ *
+ * Payload announced with AT_RESPONSE_RAWDATA_FOLLOWS or
+ * AT_RESPONSE_HEXDATA_FOLLOWS is written to the sink instead of the response
+ * buffer, so the response only contains the text lines. Data that doesn't fit
+ * in the sink is dropped.
+ *
+ * @param parser Parser instance.
+ * @param buf Sink buffer. Must stay valid until the response arrives.
+ * @param size Sink buffer size in bytes.
+ */
+void at_parser_set_data_sink(struct at_parser *parser, void *buf, size_t size);
+
+/**
+ * Drop local echo of the next command.
+ *
+ * Modems with echo enabled (ATE1, the default after a reset) send every byte
+ * they receive back before responding. Given the bytes sent for the command,
+ * the parser drops them when they come back at the start of a line, so the
+ * echo doesn't show up as an intermediate response or URC. Matching is done
+ * byte by byte as data arrives; bytes that turn out not to be the echo after
+ * all are parsed as usual. This covers raw data sent after a dataprompt as
+ * well.
+ *
+ * @param parser Parser instance.
+ * @param data Bytes sent, including the terminating carriage return. Not
+ *             copied; must stay valid until the response arrives.
+ * @param len Number of bytes in data.
+ */
+void at_parser_expect_echo(struct at_parser *parser, const void *data, size_t len);
+
+/**
+ * Get the number of bytes written to the data sink by the last command.
+ *
+ * @param parser Parser instance.
+ * @returns Number of bytes stored in the sink.
+ */
+size_t at_parser_data_sink_used(const struct at_parser *parser);
+
+/**
+ * Let the response buffer grow on demand.
+ *
+ * The buffer is doubled whenever a response doesn't fit, up to the given
+ * limit. It never moves while a response is pending. Only available for
+ * parsers created with at_parser_alloc(), so never with ATTENTIVE_NO_MALLOC.
+ *
+ * @param parser Parser instance.
+ * @param limit Maximum buffer size in bytes, or zero to keep the buffer fixed.
+ * @returns Zero on success, -1 and sets errno to EINVAL if the buffer is
+ *          caller-provided or the limit is below the current size.
+ */
+int at_parser_set_buffer_limit(struct at_parser *parser, size_t limit);
+
+/**
+ * Check if the current response was truncated.
+ *
+ * Set when any part of the response, including raw data written to a data
+ * sink, had to be dropped for lack of space. Meant to be called from the
+ * response handler; stays valid until the response is released.
+ *
+ * @param parser Parser instance.
+ * @returns True if data was lost, false otherwise.
+ */
+bool at_parser_overflow(const struct at_parser *parser);
+
+/**
+ * Get the line index of the current response.
+ *
+ * Each line stored in the response is recorded as it is collected, so
+ * callers can jump to a given line or data block without rescanning the
+ * response text. Only the first AT_RESPONSE_LINES_MAX lines are indexed.
+ * Meant to be called from the response handler; stays valid until the
+ * response is released.
+ *
+ * @param parser Parser instance.
+ * @param count Set to the number of indexed lines.
+ * @returns Array of line locations.
+ */
+const struct at_response_line *at_parser_response_lines(const struct at_parser *parser, size_t *count);
+
+/**
+ * Set the clock used to measure time spent in callbacks.
+ *
+ * Without a clock, the callback_time counter stays at zero.
+ *
+ * @param parser Parser instance.
+ * @param clock Clock function, or NULL to stop timing callbacks.
+ */
+void at_parser_set_clock(struct at_parser *parser, at_parser_clock_t clock);
+
+/**
+ * Record received lines in a wire trace.
+ *
+ * @param parser Parser instance.
+ * @param trace Trace ring, or NULL to stop tracing.
+ */
+void at_parser_set_trace(struct at_parser *parser, struct at_trace *trace);
+
+/**
+ * Get parser statistics.
+ *
+ * Counters start at zero when the parser is initialized and are not affected
+ * by at_parser_reset().
+ *
+ * @param parser Parser instance.
+ * @param stats Filled with the current counter values.
+ */
+void at_parser_get_stats(const struct at_parser *parser, struct at_parser_stats *stats);
+
+/**
+ * Reset parser statistics to zero.
+ *
+ * @param parser Parser instance.
+ */
+void at_parser_reset_stats(struct at_parser *parser);
+
 /**
  * Inform the parser that a command will be invoked. Causes a response callback
  * at the next command completion.
  *
+ * The command picks up the dataprompt, character handler and data sink set
+ * up since the previous one, and its response is held until released. Any
+ * pending response is released first, and any other commands awaiting a
+ * response are forgotten.
+ *
  * @param parser Parser instance.
  */
 void at_parser_await_response(struct at_parser *parser);
 
+/**
+ * Take over the dataprompt, character and span handlers, data sink and echo
+ * set up since the previous command, e.g. to pass them to
+ * at_parser_queue_command(). The settings are cleared.
+ *
+ * @param parser Parser instance.
+ * @param command Set to the settings; the other fields are zeroed.
+ */
+void at_parser_take_next(struct at_parser *parser, struct at_parser_command *command);
+
+/**
+ * Queue a command whose response is expected after those already queued.
+ *
+ * Lets several commands be sent back to back without waiting for each
+ * response in turn: responses arrive in the order the commands were sent, so
+ * each final result code completes the oldest queued command. Each command
+ * has its own line scanner, dataprompt expectation, data sink and completion
+ * callback.
+ *
+ * A response that isn't held is only valid during the completion callback;
+ * the buffer is reused right after it returns. A held response stays put
+ * until at_parser_release_response(), and responses to later commands are
+ * collected after it meanwhile.
+ *
+ * @param parser Parser instance.
+ * @param command Command description. Copied.
+ * @returns Zero on success, -1 and sets errno to ENOBUFS if
+ *          AT_PARSER_COMMANDS_MAX commands are already queued.
+ */
+int at_parser_queue_command(struct at_parser *parser, const struct at_parser_command *command);
+
+/**
+ * Get the number of commands still awaiting a response.
+ *
+ * @param parser Parser instance.
+ * @returns Number of queued commands, including the one being collected.
+ */
+size_t at_parser_queued_commands(const struct at_parser *parser);
+
+/**
+ * Forget all commands awaiting a response, e.g. once one has timed out.
+ *
+ * The response being collected and any partially received line are dropped.
+ * Unlike at_parser_reset(), this leaves a held response in place until it's
+ * released, and keeps the settings made for the next command.
+ *
+ * @param parser Parser instance.
+ */
+void at_parser_cancel_commands(struct at_parser *parser);
+
 /**
  * Feed parser. Callbacks are always called from this function's context.
  *
@@ -155,12 +472,14 @@ void at_parser_await_response(struct at_parser *parser);
  */
 void at_parser_feed(struct at_parser *parser, const void *data, size_t len);
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 /**
  * Deallocate a parser instance.
  *
  * @param parser Parser instance allocated with at_parser_alloc.
  */
 void at_parser_free(struct at_parser *parser);
+#endif
 
 /**
  * Check if a response starts with one of the prefixes in a table.
@@ -171,13 +490,40 @@ void at_parser_free(struct at_parser *parser);
  */
 bool at_prefix_in_table(const char *line, const char *const table[]);
 
+/**
+ * Compile a prefix table for use with at_prefix_match().
+ *
+ * @param matcher Matcher instance.
+ * @param table NULL-terminated list of prefixes. Not copied; must persist for
+ *              the lifetime of the matcher.
+ * @returns Zero on success, -1 and sets errno to EINVAL if the table has more
+ *          than AT_PREFIX_MATCHER_MAX entries or a prefix longer than 255.
+ */
+int at_prefix_matcher_init(struct at_prefix_matcher *matcher, const char *const table[]);
+
+/**
+ * Find the table entry a line starts with.
+ *
+ * Equivalent to at_prefix_in_table(), but works on a compiled table and
+ * reports which entry matched.
+ *
+ * @param matcher Compiled prefix table.
+ * @param line AT response line.
+ * @param len Line length.
+ * @returns Index of the first matching table entry, -1 if none.
+ */
+int at_prefix_match(const struct at_prefix_matcher *matcher, const char *line, size_t len);
+
 /**
  * Release a pending response buffer.
  *
- * After a command completes, the parser enters STATE_RESPONSE_PENDING to keep
- * the response buffer stable while the caller processes it. URCs received
- * during this time are handled normally using buffer space after the response.
- * Call this function when done processing the response to reset the parser.
+ * After a command with a held response completes, the response buffer stays
+ * stable while the caller processes it; with no other command queued, the
+ * parser enters STATE_RESPONSE_PENDING. URCs and responses to later commands
+ * received during this time are handled normally using buffer space after
+ * the response. Call this function when done processing the response.
+ * Releasing is O(1): a partially received line or response is not moved; it
+ * only gets compacted once the buffer space behind it runs out.
  *
  * @param parser Parser instance.
  */
@@ -0,0 +1,169 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at-hex.h>
+
+#if !defined(ATTENTIVE_HEX_SCALAR)
+#if defined(__SSE2__)
+#define AT_HEX_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define AT_HEX_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+static const int8_t hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+int at_hex_value(char c)
+{
+    return hex_values[(uint8_t) c];
+}
+
+#if defined(AT_HEX_SSE2)
+
+/**
+ * Convert 16 hex characters to nibble values.
+ *
+ * @returns Nonzero if all characters were valid hex digits.
+ */
+static int hex_nibbles_sse2(__m128i c, __m128i *value)
+{
+    /* Bytes >= 0x80 compare as negative and fall out of both ranges. */
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0'-1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9'+1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a'-1)),
+                                  _mm_cmplt_epi8(lower, _mm_set1_epi8('f'+1)));
+
+    __m128i from_digit = _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+    __m128i from_alpha = _mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a'-10)));
+    *value = _mm_or_si128(from_digit, from_alpha);
+
+    return _mm_movemask_epi8(_mm_or_si128(digit, alpha)) == 0xffff;
+}
+
+/**
+ * Decode 32 characters into 16 bytes.
+ *
+ * @returns Nonzero on success; nothing is written if the block is invalid.
+ */
+static int hex_decode_block(uint8_t *dst, const char *src)
+{
+    __m128i v0, v1;
+    if (!hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) src), &v0) ||
+        !hex_nibbles_sse2(_mm_loadu_si128((const __m128i *) (src + 16)), &v1))
+        return 0;
+
+    /* Each 16-bit lane holds the high nibble in its low byte and vice versa. */
+    __m128i mask = _mm_set1_epi16(0x00ff);
+    __m128i w0 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v0, mask), 4),
+                              _mm_srli_epi16(v0, 8));
+    __m128i w1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v1, mask), 4),
+                              _mm_srli_epi16(v1, 8));
+    _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(w0, w1));
+
+    return 1;
+}
+
+#elif defined(AT_HEX_NEON)
+
+/**
+ * Convert 16 hex characters to nibble values.
+ *
+ * @returns All-ones lanes where the character was a valid hex digit.
+ */
+static uint8x16_t hex_nibbles_neon(uint8x16_t c, uint8x16_t *value)
+{
+    uint8x16_t from_digit = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t digit = vcleq_u8(from_digit, vdupq_n_u8(9));
+    uint8x16_t lower = vorrq_u8(c, vdupq_n_u8(0x20));
+    uint8x16_t alpha = vcleq_u8(vsubq_u8(lower, vdupq_n_u8('a')), vdupq_n_u8(5));
+    uint8x16_t from_alpha = vsubq_u8(lower, vdupq_n_u8('a'-10));
+
+    *value = vbslq_u8(digit, from_digit, from_alpha);
+    return vorrq_u8(digit, alpha);
+}
+
+/**
+ * Decode 32 characters into 16 bytes.
+ *
+ * @returns Nonzero on success; nothing is written if the block is invalid.
+ */
+static int hex_decode_block(uint8_t *dst, const char *src)
+{
+    /* De-interleave into high (even) and low (odd) nibble characters. */
+    uint8x16x2_t c = vld2q_u8((const uint8_t *) src);
+    uint8x16_t hi, lo;
+    uint8x16_t valid = vandq_u8(hex_nibbles_neon(c.val[0], &hi),
+                                hex_nibbles_neon(c.val[1], &lo));
+
+    uint64x2_t valid64 = vreinterpretq_u64_u8(valid);
+    if ((vgetq_lane_u64(valid64, 0) & vgetq_lane_u64(valid64, 1)) != UINT64_MAX)
+        return 0;
+
+    vst1q_u8(dst, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+    return 1;
+}
+
+#endif
+
+size_t at_hex_decode(void *dst, const char *src, size_t len)
+{
+    uint8_t *out = dst;
+    size_t count = len / 2;
+    size_t done = 0;
+
+#if defined(AT_HEX_SSE2) || defined(AT_HEX_NEON)
+    while (count - done >= 16 && hex_decode_block(out + done, src + 2*done))
+        done += 16;
+#endif
+
+    for (; done < count; done++) {
+        int hi = hex_values[(uint8_t) src[2*done]];
+        int lo = hex_values[(uint8_t) src[2*done+1]];
+        if ((hi | lo) < 0)
+            break;
+        out[done] = (hi << 4) | lo;
+    }
+
+    return done;
+}
+
+size_t at_hex_encode(char *dst, const void *src, size_t len)
+{
+    const uint8_t *in = src;
+
+    for (size_t i=0; i<len; i++) {
+        dst[2*i] = hex_digits[in[i] >> 4];
+        dst[2*i+1] = hex_digits[in[i] & 0x0f];
+    }
+
+    return 2*len;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,219 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at-tokenizer.h>
+
+#include <limits.h>
+#include <string.h>
+
+
+static bool tok_fail(struct at_tok *tok)
+{
+    if (!tok->error)
+        tok->error = tok->pos;
+    return false;
+}
+
+static bool is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static void tok_skip_spaces(struct at_tok *tok)
+{
+    while (tok->pos < tok->end && *tok->pos == ' ')
+        tok->pos++;
+}
+
+/**
+ * Consume the comma after a field, if any.
+ */
+static bool tok_end_field(struct at_tok *tok)
+{
+    if (tok->pos < tok->end && *tok->pos == ',')
+        tok->pos++;
+    return true;
+}
+
+void at_tok_init(struct at_tok *tok, const char *line, size_t len)
+{
+    const char *newline = memchr(line, '\n', len);
+
+    tok->line = line;
+    tok->pos = line;
+    tok->end = newline ? newline : line + len;
+    tok->error = NULL;
+}
+
+bool at_tok_prefix(struct at_tok *tok, const char *prefix)
+{
+    if (tok->error)
+        return false;
+
+    size_t len = strlen(prefix);
+    if ((size_t) (tok->end - tok->pos) < len || memcmp(tok->pos, prefix, len))
+        return tok_fail(tok);
+
+    tok->pos += len;
+    return true;
+}
+
+bool at_tok_char(struct at_tok *tok, char c)
+{
+    if (tok->error)
+        return false;
+
+    if (tok->pos == tok->end || *tok->pos != c)
+        return tok_fail(tok);
+
+    tok->pos++;
+    return true;
+}
+
+bool at_tok_int(struct at_tok *tok, int *value)
+{
+    if (tok->error)
+        return false;
+
+    const char *start = tok->pos;
+    tok_skip_spaces(tok);
+
+    bool negative = false;
+    if (tok->pos < tok->end && (*tok->pos == '-' || *tok->pos == '+'))
+        negative = (*tok->pos++ == '-');
+
+    if (tok->pos == tok->end || !is_digit(*tok->pos)) {
+        tok->pos = start;
+        return tok_fail(tok);
+    }
+
+    unsigned long limit = negative ? (unsigned long) INT_MAX + 1 : INT_MAX;
+    unsigned long result = 0;
+    while (tok->pos < tok->end && is_digit(*tok->pos)) {
+        result = result * 10 + (*tok->pos - '0');
+        if (result > limit) {
+            tok->pos = start;
+            return tok_fail(tok);
+        }
+        tok->pos++;
+    }
+
+    if (value)
+        *value = negative ? -(int) (result - 1) - 1 : (int) result;
+
+    return tok_end_field(tok);
+}
+
+bool at_tok_float(struct at_tok *tok, float *value)
+{
+    if (tok->error)
+        return false;
+
+    const char *start = tok->pos;
+    tok_skip_spaces(tok);
+
+    bool negative = false;
+    if (tok->pos < tok->end && (*tok->pos == '-' || *tok->pos == '+'))
+        negative = (*tok->pos++ == '-');
+
+    double result = 0;
+    int digits = 0;
+    while (tok->pos < tok->end && is_digit(*tok->pos)) {
+        result = result * 10 + (*tok->pos++ - '0');
+        digits++;
+    }
+
+    if (tok->pos < tok->end && *tok->pos == '.') {
+        tok->pos++;
+        double scale = 1;
+        while (tok->pos < tok->end && is_digit(*tok->pos)) {
+            result = result * 10 + (*tok->pos++ - '0');
+            scale *= 10;
+            digits++;
+        }
+        result /= scale;
+    }
+
+    if (digits == 0) {
+        tok->pos = start;
+        return tok_fail(tok);
+    }
+
+    if (value)
+        *value = negative ? -result : result;
+
+    return tok_end_field(tok);
+}
+
+bool at_tok_string(struct at_tok *tok, const char **str, size_t *len)
+{
+    if (tok->error)
+        return false;
+
+    const char *start, *stop;
+    if (tok->pos < tok->end && *tok->pos == '"') {
+        start = tok->pos + 1;
+        stop = memchr(start, '"', tok->end - start);
+        if (!stop)
+            return tok_fail(tok);
+        tok->pos = stop + 1;
+    } else {
+        start = tok->pos;
+        stop = memchr(start, ',', tok->end - start);
+        if (!stop)
+            stop = tok->end;
+        tok->pos = stop;
+    }
+
+    if (str)
+        *str = start;
+    if (len)
+        *len = stop - start;
+
+    return tok_end_field(tok);
+}
+
+bool at_tok_digits(struct at_tok *tok, char *buf, size_t size)
+{
+    if (tok->error)
+        return false;
+
+    const char *start = tok->pos;
+    while (tok->pos < tok->end && is_digit(*tok->pos))
+        tok->pos++;
+
+    size_t len = tok->pos - start;
+    if (len == 0 || size == 0) {
+        tok->pos = start;
+        return tok_fail(tok);
+    }
+
+    if (len > size - 1)
+        len = size - 1;
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+
+    return tok_end_field(tok);
+}
+
+bool at_tok_skip(struct at_tok *tok)
+{
+    return at_tok_string(tok, NULL, NULL);
+}
+
+bool at_tok_ok(const struct at_tok *tok)
+{
+    return tok->error == NULL;
+}
+
+int at_tok_error_pos(const struct at_tok *tok)
+{
+    return tok->error ? (int) (tok->error - tok->line) : -1;
+}
+
+/* vim: set ts=4 sw=4 et: */
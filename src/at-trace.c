@@ -0,0 +1,154 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <attentive/at-trace.h>
+#include <attentive/parser.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Each record is a tiny seqlock: the writer claims a sequence number, zeroes
+ * the record's seq, fills it in and publishes seq + 1. Readers copy the
+ * record and keep it only if seq was the expected value both before and
+ * after the copy. The record published as seq 0 is never read, which rules
+ * out mistaking unused records for real ones.
+ */
+
+int at_trace_init(struct at_trace *trace, struct at_trace_record *records, size_t count,
+                  at_trace_clock_t clock)
+{
+    if (records && (count == 0 || (count & (count - 1)) || (uint64_t) count > (uint64_t) 1 << 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (records)
+        memset(records, 0, count * sizeof(*records));
+
+    trace->records = records;
+    trace->mask = records ? count - 1 : 0;
+    trace->head = 0;
+    trace->clock = clock;
+    return 0;
+}
+
+void at_trace_record(struct at_trace *trace, enum at_trace_event event, int type,
+                     const void *data, size_t len)
+{
+    if (!trace || !trace->records)
+        return;
+
+    uint32_t seq = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    struct at_trace_record *record = &trace->records[seq & trace->mask];
+
+    __atomic_store_n(&record->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t copy = len < AT_TRACE_DATA_MAX ? len : AT_TRACE_DATA_MAX;
+    record->timestamp = trace->clock ? trace->clock() : 0;
+    record->event = event;
+    record->type = type;
+    record->length = len < UINT16_MAX ? len : UINT16_MAX;
+    if (copy)
+        memcpy(record->data, data, copy);
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy out a record if it still holds the given sequence number.
+ */
+static bool trace_read(struct at_trace *trace, uint32_t seq, struct at_trace_record *out)
+{
+    struct at_trace_record *record = &trace->records[seq & trace->mask];
+
+    if (seq + 1 == 0)
+        return false;
+    if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != seq + 1)
+        return false;
+    memcpy(out, record, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&record->seq, __ATOMIC_RELAXED) == seq + 1;
+}
+
+size_t at_trace_snapshot(struct at_trace *trace, struct at_trace_record *out, size_t count)
+{
+    if (!trace->records)
+        return 0;
+
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    size_t size = (size_t) trace->mask + 1;
+    if (count > size)
+        count = size;
+
+    size_t used = 0;
+    for (uint32_t seq = head - count; seq != head; seq++)
+        if (trace_read(trace, seq, &out[used]))
+            used++;
+
+    return used;
+}
+
+static const char *type_name(int type)
+{
+    switch (type) {
+        case AT_RESPONSE_UNEXPECTED: return "unexpected";
+        case AT_RESPONSE_INTERMEDIATE: return "intermediate";
+        case AT_RESPONSE_INTERMEDIATE_DISCARDED: return "discarded";
+        case AT_RESPONSE_FINAL_OK: return "final-ok";
+        case AT_RESPONSE_FINAL: return "final";
+        case AT_RESPONSE_URC: return "urc";
+        case _AT_RESPONSE_RAWDATA_FOLLOWS: return "rawdata";
+        case _AT_RESPONSE_HEXDATA_FOLLOWS: return "hexdata";
+        default: return "unknown";
+    }
+}
+
+static void dump_record(const struct at_trace_record *record, FILE *stream)
+{
+    fprintf(stream, "%10" PRIu32 " ", record->timestamp);
+
+    switch (record->event) {
+        case AT_TRACE_COMMAND: fprintf(stream, "> "); break;
+        case AT_TRACE_RAW: fprintf(stream, "> [%u bytes] ", record->length); break;
+        case AT_TRACE_LINE: fprintf(stream, "< %s ", type_name(record->type)); break;
+        case AT_TRACE_TIMEOUT: fprintf(stream, "! timeout\n"); return;
+        default: fprintf(stream, "? "); break;
+    }
+
+    fputc('\'', stream);
+    size_t copy = record->length < AT_TRACE_DATA_MAX ? record->length : AT_TRACE_DATA_MAX;
+    for (size_t i=0; i<copy; i++) {
+        uint8_t c = record->data[i];
+        if (c >= 0x20 && c < 0x7f && c != '\\' && c != '\'')
+            fputc(c, stream);
+        else
+            fprintf(stream, "\\x%02x", c);
+    }
+    fprintf(stream, "'%s\n", copy < record->length ? "..." : "");
+}
+
+void at_trace_dump(struct at_trace *trace, FILE *stream)
+{
+    if (!trace->records)
+        return;
+
+    uint32_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint32_t count = trace->mask + 1;
+
+    for (uint32_t seq = head - count; seq != head; seq++) {
+        struct at_trace_record record;
+        if (trace_read(trace, seq, &record))
+            dump_record(&record, stream);
+    }
+}
+
+/* vim: set ts=4 sw=4 et: */
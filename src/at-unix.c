@@ -7,91 +7,324 @@
  */
 
 #include <attentive/at.h>
+#include <attentive/at-unix.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
-#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
 #if _POSIX_TIMERS > 0
 #include <time.h>
 #else
 #include <sys/time.h>
 #endif
 
-// Remove once you refactor this out.
-#define AT_COMMAND_LENGTH 80
+void *at_reader_thread(void *arg);
+#if defined(__linux__)
+static int reactor_add(struct at_reactor *reactor, struct at_unix *priv);
+static void reactor_remove(struct at_reactor *reactor, struct at_unix *priv);
+static void reactor_watch(struct at_reactor *reactor, struct at_unix *priv, bool writing);
+#endif
+static void urc_push(struct at_unix *priv, const char *line, size_t len);
+static void request_schedule(struct at_unix *priv);
+static void request_send(struct at_unix *priv);
+static void reader_wake(struct at_unix *priv);
+
+/**
+ * Get the current time on the clock used for deadlines. Where available,
+ * that's the monotonic clock, so that setting the time doesn't stretch or
+ * cut short pending commands.
+ */
+static void now(struct timespec *ts)
+{
+#if _POSIX_TIMERS > 0
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#endif
+}
 
-struct at_unix {
-    struct at at;
+/**
+ * Compute an absolute pthread_cond_timedwait() deadline.
+ *
+ * @param ts Set to the deadline.
+ * @param ms Milliseconds from now.
+ */
+static void deadline(struct timespec *ts, long ms)
+{
+    now(ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
 
-    const char *devpath;    /**< Serial port device path. */
-    speed_t baudrate;       /**< Serial port baudate. */
+/**
+ * Get the time left until a deadline.
+ *
+ * @returns Milliseconds, rounded up; zero once the deadline has passed.
+ */
+static int remaining_ms(const struct timespec *ts)
+{
+    struct timespec current;
+    now(&current);
 
-    int timeout;            /**< Command timeout in seconds. */
-    const char *response;
+    long long ns = (long long) (ts->tv_sec - current.tv_sec) * 1000000000 +
+                   (ts->tv_nsec - current.tv_nsec);
+    if (ns <= 0)
+        return 0;
+    if (ns >= (long long) INT_MAX * 1000000)
+        return INT_MAX;
+    return (ns + 999999) / 1000000;
+}
 
-    pthread_t thread;       /**< Reader thread. */
-    pthread_mutex_t mutex;  /**< Protects variables below and the parser. */
-    pthread_cond_t cond;    /**< For signalling open/busy release. */
+/**
+ * Get the oldest request, whose response is being collected, if any.
+ */
+static struct at_unix_request *request_current(struct at_unix *priv)
+{
+    if (priv->request_count == 0)
+        return NULL;
+    return &priv->requests[priv->request_head];
+}
 
-    int fd;                 /**< Serial port file descriptor. */
-    bool running : 1;       /**< Reader thread should be running. */
-    bool open : 1;          /**< FD is valid. Set/cleared by open()/close(). */
-    bool busy : 1;          /**< FD is in use. Set/cleared by reader thread. */
-    bool waiting : 1;       /**< Waiting for response callback to arrive. */
-};
+/**
+ * Take the oldest request out of the queue, so that its callback may queue
+ * new ones.
+ */
+static struct at_unix_request request_pop(struct at_unix *priv)
+{
+    struct at_unix_request request = priv->requests[priv->request_head];
+    priv->request_head = (priv->request_head + 1) % AT_UNIX_REQUESTS_MAX;
+    priv->request_count--;
+    return request;
+}
 
-void *at_reader_thread(void *arg);
+/**
+ * Fail all outstanding requests, after the parser forgot about them.
+ */
+static void request_fail_all(struct at_unix *priv, int error)
+{
+    /* Requests queued by the callbacks are left alone. */
+    size_t count = priv->request_count;
+    for (size_t i=0; i<count; i++) {
+        struct at_unix_request request = request_pop(priv);
+        request.cb(&priv->at, NULL, error, request.arg);
+    }
+}
 
-static void handle_sigusr1(int signal)
+/**
+ * Fail all outstanding requests once nothing more can be read from the port.
+ */
+static void request_hangup(struct at_unix *priv)
+{
+    at_parser_cancel_commands(priv->at.parser);
+    request_fail_all(priv, EIO);
+}
+
+/**
+ * Time out the oldest request if its deadline has passed, and move on to
+ * the next one.
+ */
+static void request_expire(struct at_unix *priv)
 {
-    (void)signal;
+    struct at_unix_request *request = request_current(priv);
+    if (!request || !request->timed || remaining_ms(&request->deadline) > 0)
+        return;
+
+    /* Another thread may still be using the response it got last, or be
+     * setting up its next command; leave both alone. */
+    at_parser_cancel_commands(priv->at.parser);
+    at_trace_record(&priv->trace, AT_TRACE_TIMEOUT, 0, NULL, 0);
+    if (priv->trace_dump)
+        at_trace_dump(&priv->trace, priv->trace_dump);
+
+    struct at_unix_request expired = request_pop(priv);
+    request_send(priv);
+    expired.cb(&priv->at, NULL, ETIMEDOUT, expired.arg);
 }
 
 static void handle_response(const char *buf, size_t len, void *arg)
 {
     struct at_unix *priv = (struct at_unix *) arg;
-
-    /* The mutex is held by the reader thread; don't reacquire. */
-    priv->response = buf;
+    bool overflow = at_parser_overflow(priv->at.parser);
     (void) len;
-    priv->waiting = false;
-    pthread_cond_signal(&priv->cond);
+
+    /* The mutex is held by the reader thread. The parser only starts on the
+     * next command once this returns. */
+    struct at_unix_request request = request_pop(priv);
+    request_send(priv);
+
+    /* Keep what at_command() returns apart from the parser, which moves on
+     * to the next request right away. */
+    if (request.command.hold) {
+        size_t count;
+        const struct at_response_line *lines = at_parser_response_lines(priv->at.parser, &count);
+        memcpy(priv->response_lines, lines, count * sizeof(*lines));
+        priv->response_line_count = count;
+        priv->response_sink_used = at_parser_data_sink_used(priv->at.parser);
+    }
+
+    /* Asynchronous callbacks see their own command's results. */
+    priv->completing = !request.command.hold;
+    if (overflow)
+        request.cb(&priv->at, NULL, ENOBUFS, request.arg);
+    else
+        request.cb(&priv->at, buf, 0, request.arg);
+    priv->completing = false;
+}
+
+/**
+ * Pass a URC to a registered handler, with the prefix already tokenized.
+ */
+static void urc_call(at_urc_handler_t handler, void *arg, const char *prefix,
+                     const char *line, size_t len)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, line, len);
+    at_tok_prefix(&tok, prefix);
+    handler(line, len, &tok, arg);
 }
 
 static void handle_urc(const char *buf, size_t len, void *arg)
 {
+    struct at_unix *priv = (struct at_unix *) arg;
     struct at *at = (struct at *) arg;
 
+    /* With a URC queue, the handler runs outside the reader. */
+    if (priv->urc_slots) {
+        urc_push(priv, buf, len);
+        return;
+    }
+
+    /* Registered URCs were already looked up by the line scanner. */
+    if (priv->urc_match >= 0) {
+        int index = priv->urc_match;
+        urc_call(at->urcs.handlers[index], at->urcs.args[index],
+                 at->urcs.prefixes[index], buf, len);
+        return;
+    }
+
     /* Forward to caller's URC callback, if any. */
-    if (at->cbs->handle_urc)
+    if (at->cbs && at->cbs->handle_urc)
         at->cbs->handle_urc(buf, len, at->arg);
 }
 
 enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
+    struct at_unix *priv = (struct at_unix *) arg;
     struct at *at = (struct at *) arg;
 
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
-    if (at->command_scanner)
-        type = at->command_scanner(line, len, at->arg);
+    struct at_unix_request *request = request_current(priv);
+    priv->urc_match = -1;
+    if (request && request->scanner)
+        type = request->scanner(line, len, at->arg);
+    if (!type && at->urcs.count > 0) {
+        priv->urc_match = at_prefix_match(&at->urcs.matcher, line, len);
+        if (priv->urc_match >= 0)
+            type = AT_RESPONSE_URC;
+    }
     if (!type && at->cbs && at->cbs->scan_line)
         type = at->cbs->scan_line(line, len, at->arg);
     return type;
 }
 
+static char character_handler(char ch, char *line, size_t len, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) arg;
+
+    return request_current(priv)->character_handler(ch, line, len, priv->at.arg);
+}
+
+static size_t span_handler(const char *data, size_t len, char *out,
+                           const char *line, size_t line_len, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) arg;
+
+    return request_current(priv)->span_handler(data, len, out, line, line_len, priv->at.arg);
+}
+
+/**
+ * Microsecond clock for timing parser callbacks.
+ */
+static uint32_t clock_us(void)
+{
+#if _POSIX_TIMERS > 0
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint32_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 static const struct at_parser_callbacks parser_callbacks = {
     .handle_response = handle_response,
     .handle_urc = handle_urc,
     .scan_line = scan_line,
 };
 
+/**
+ * Set up an instance whose parser is already initialized.
+ */
+static struct at *at_setup_unix(struct at_unix *priv, const char *devpath, speed_t baudrate)
+{
+    at_parser_set_clock(priv->at.parser, clock_us);
+    at_trace_init(&priv->trace, priv->trace_records, AT_UNIX_TRACE_RECORDS, clock_us);
+    at_parser_set_trace(priv->at.parser, &priv->trace);
+    at_prefix_matcher_init(&priv->at.urcs.matcher, priv->at.urcs.prefixes);
+    priv->urc_match = -1;
+
+    /* copy over device parameters */
+    priv->devpath = devpath;
+    priv->baudrate = baudrate;
+    priv->read_chunk = AT_UNIX_READ_SIZE;
+    priv->read_vmin = 1;
+    priv->read_vtime = 0;
+
+    /* the reader thread is started by the first at_open() */
+    priv->running = true;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&priv->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+#if _POSIX_TIMERS > 0
+    /* Timed waits use deadlines from now(). */
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&priv->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    pthread_mutex_init(&priv->urc_mutex, NULL);
+    pthread_cond_init(&priv->urc_cond, NULL);
+
+    return (struct at *) priv;
+}
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
 {
     /* allocate instance */
@@ -101,31 +334,51 @@ struct at *at_alloc_unix(const char *devpath, speed_t baudrate)
         return NULL;
     }
     memset(priv, 0, sizeof(struct at_unix));
+    priv->allocated = true;
 
-    /* allocate underlying parser */
-    priv->at.parser = at_parser_alloc(&parser_callbacks, 256, (void *) priv);
+    /* allocate underlying parser; only this one can grow its buffer */
+    priv->at.parser = at_parser_alloc(&parser_callbacks, AT_UNIX_BUFFER_SIZE, (void *) priv);
     if (!priv->at.parser) {
         free(priv);
         return NULL;
     }
 
-    /* copy over device parameters */
-    priv->devpath = devpath;
-    priv->baudrate = baudrate;
+    return at_setup_unix(priv, devpath, baudrate);
+}
+#endif
 
-    /* install empty SIGUSR1 handler */
-    struct sigaction sa = {
-        .sa_handler = handle_sigusr1,
-    };
-    sigaction(SIGUSR1, &sa, NULL);
+struct at *at_init_unix(struct at_unix *priv, const char *devpath, speed_t baudrate,
+                        void *buf, size_t bufsize)
+{
+    memset(priv, 0, sizeof(struct at_unix));
 
-    /* initialize and start reader thread */
-    priv->running = true;
-    pthread_mutex_init(&priv->mutex, NULL);
-    pthread_cond_init(&priv->cond, NULL);
-    pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+    at_parser_init(&priv->parser, &parser_callbacks, buf, bufsize, (void *) priv);
+    priv->at.parser = &priv->parser;
 
-    return (struct at *) priv;
+    return at_setup_unix(priv, devpath, baudrate);
+}
+
+/**
+ * Start the reader thread, along with its wakeup pipe.
+ *
+ * @returns Zero on success, errno value on failure.
+ */
+static int reader_start(struct at_unix *priv)
+{
+    if (pipe(priv->wake) == -1)
+        return errno;
+    for (int i=0; i<2; i++)
+        fcntl(priv->wake[i], F_SETFL, fcntl(priv->wake[i], F_GETFL) | O_NONBLOCK);
+
+    int result = pthread_create(&priv->thread, NULL, at_reader_thread, (void *) priv);
+    if (result) {
+        close(priv->wake[0]);
+        close(priv->wake[1]);
+        return result;
+    }
+
+    priv->reader = true;
+    return 0;
 }
 
 int at_open(struct at *at)
@@ -144,14 +397,47 @@ int at_open(struct at *at)
         return -1;
     }
 
-    if (priv->baudrate) {
-        struct termios attr;
-        tcgetattr(priv->fd, &attr);
-        cfsetispeed(&attr, priv->baudrate);
-        cfsetospeed(&attr, priv->baudrate);
+    /* Not every port is a terminal; skip the settings for those that aren't. */
+    struct termios attr;
+    if (tcgetattr(priv->fd, &attr) == 0) {
+        if (priv->baudrate) {
+            cfsetispeed(&attr, priv->baudrate);
+            cfsetospeed(&attr, priv->baudrate);
+        }
+        /* VMIN and VTIME may share slots with VEOF and VEOL. */
+        if (!(attr.c_lflag & ICANON)) {
+            attr.c_cc[VMIN] = priv->read_vmin;
+            attr.c_cc[VTIME] = priv->read_vtime;
+        }
         tcsetattr(priv->fd, TCSANOW, &attr);
     }
 
+#if defined(__linux__)
+    if (priv->reactor) {
+        /* The reactor must never block in read(). */
+        int flags = fcntl(priv->fd, F_GETFL);
+        if (flags == -1 || fcntl(priv->fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+                reactor_add(priv->reactor, priv) == -1) {
+            int why = errno;
+            close(priv->fd);
+            priv->fd = -1;
+            pthread_mutex_unlock(&priv->mutex);
+            errno = why;
+            return -1;
+        }
+    } else
+#endif
+    if (!priv->reader) {
+        int result = reader_start(priv);
+        if (result) {
+            close(priv->fd);
+            priv->fd = -1;
+            pthread_mutex_unlock(&priv->mutex);
+            errno = result;
+            return -1;
+        }
+    }
+
     priv->open = true;
     pthread_cond_signal(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
@@ -159,6 +445,27 @@ int at_open(struct at *at)
     return 0;
 }
 
+int at_set_read_unix(struct at *at, size_t chunk, cc_t vmin, cc_t vtime)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* read() must return once poll() says there's data; see at_close(). */
+    if (chunk == 0 || chunk > AT_UNIX_READ_SIZE || (vmin > 1 && vtime == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->read_chunk = chunk;
+    priv->read_vmin = vmin;
+    priv->read_vtime = vtime;
+    /* Have the reader pick up the new chunk size right away. */
+    reader_wake(priv);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return 0;
+}
+
 int at_close(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
@@ -172,10 +479,20 @@ int at_close(struct at *at)
     /* Mark the port descriptor as invalid. */
     priv->open = false;
 
-    /* Interrupt read() in the reader thread. */
-    pthread_kill(priv->thread, SIGUSR1);
+#if defined(__linux__)
+    /* Let a reactor thread waiting for the mutex see that, then make sure
+     * the reactor is done with the port. */
+    if (priv->reactor) {
+        pthread_mutex_unlock(&priv->mutex);
+        reactor_remove(priv->reactor, priv);
+        pthread_mutex_lock(&priv->mutex);
+    }
+#endif
 
-    /* Wait for the read operation to complete. */
+    /* Wake the reader thread up and wait for it to let go of the port.
+     * The wakeup stays pending in the pipe, so it can't get lost. */
+    if (priv->busy)
+        reader_wake(priv);
     while (priv->busy)
         pthread_cond_wait(&priv->cond, &priv->mutex);
 
@@ -183,6 +500,10 @@ int at_close(struct at *at)
     close(priv->fd);
     priv->fd = -1;
 
+    /* Whatever was still outstanding won't get a response anymore. */
+    at_parser_cancel_commands(priv->at.parser);
+    request_fail_all(priv, ENODEV);
+
     pthread_mutex_unlock(&priv->mutex);
     return 0;
 }
@@ -194,202 +515,1140 @@ void at_free(struct at *at)
     /* make sure the channel is closed */
     at_close(at);
 
-    /* ask the reader thread to terminate */
+    /* ask the reader thread to terminate; it only waits on the cond now */
     pthread_mutex_lock(&priv->mutex);
     priv->running = false;
+    pthread_cond_broadcast(&priv->cond);
     pthread_mutex_unlock(&priv->mutex);
 
     /* wait for the reader thread to terminate */
-    pthread_kill(priv->thread, SIGUSR1);
-    pthread_join(priv->thread, NULL);
+    if (priv->reader) {
+        reader_wake(priv);
+        pthread_join(priv->thread, NULL);
+        close(priv->wake[0]);
+        close(priv->wake[1]);
+    }
+
+    /* stop URC dispatching */
+    at_init_urc_queue(at, NULL, NULL, 0, 0, AT_URC_DROP_NEWEST, false);
+
+    pthread_cond_destroy(&priv->urc_cond);
+    pthread_mutex_destroy(&priv->urc_mutex);
     pthread_cond_destroy(&priv->cond);
     pthread_mutex_destroy(&priv->mutex);
 
     /* free up resources */
-    free(priv->at.parser);
-    free(priv);
+#if !defined(ATTENTIVE_NO_MALLOC)
+    if (priv->allocated) {
+        at_parser_free(priv->at.parser);
+        free(priv);
+    }
+#endif
+}
+
+#if defined(__linux__)
+int at_set_reactor_unix(struct at *at, struct at_reactor *reactor)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->open || priv->reader) {
+        pthread_mutex_unlock(&priv->mutex);
+        errno = EBUSY;
+        return -1;
+    }
+    priv->reactor = reactor;
+    pthread_mutex_unlock(&priv->mutex);
+
+    return 0;
 }
+#endif
 
 void at_set_callbacks(struct at *at, const struct at_callbacks *cbs, void *arg)
 {
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Queued URCs are meant for the previous handler, which must not be
+     * running anymore once this returns (unless it's the caller). */
+    pthread_mutex_lock(&priv->urc_mutex);
+    while (priv->urc_dispatching && !pthread_equal(priv->urc_owner, pthread_self()))
+        pthread_cond_wait(&priv->urc_cond, &priv->urc_mutex);
+    priv->urc_head = 0;
+    priv->urc_count = 0;
+
     at->cbs = cbs;
     at->arg = arg;
+    pthread_mutex_unlock(&priv->urc_mutex);
 }
 
-void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+static char *urc_slot(struct at_unix *priv, size_t slot)
 {
-    at->command_scanner = scanner;
+    return priv->urc_slots + slot * (priv->urc_slot_size + 1);
 }
 
-void at_set_timeout(struct at *at, int timeout)
+/**
+ * Copy a URC line into the queue. Called by the reader; never waits for
+ * the URC handler.
+ */
+static void urc_push(struct at_unix *priv, const char *line, size_t len)
 {
-    struct at_unix *priv = (struct at_unix *) at;
+    pthread_mutex_lock(&priv->urc_mutex);
 
-    priv->timeout = timeout;
-}
+    if (priv->urc_count == priv->urc_slot_count) {
+        priv->urc_dropped++;
+        if (priv->urc_policy == AT_URC_DROP_NEWEST) {
+            pthread_mutex_unlock(&priv->urc_mutex);
+            return;
+        }
+        priv->urc_head = (priv->urc_head + 1) % priv->urc_slot_count;
+        priv->urc_count--;
+    }
 
-void at_expect_dataprompt(struct at *at)
-{
-    at_parser_expect_dataprompt(at->parser);
+    if (len > priv->urc_slot_size)
+        len = priv->urc_slot_size;
+
+    size_t slot = (priv->urc_head + priv->urc_count) % priv->urc_slot_count;
+    memcpy(urc_slot(priv, slot), line, len);
+    urc_slot(priv, slot)[len] = '\0';
+    priv->urc_lengths[slot] = len;
+    priv->urc_count++;
+
+    pthread_cond_broadcast(&priv->urc_cond);
+    pthread_mutex_unlock(&priv->urc_mutex);
 }
 
-static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+/**
+ * Run the URC handler on all queued URCs, unless some other thread is
+ * already doing it.
+ *
+ * @returns Number of URCs handled.
+ */
+static int urc_dispatch(struct at_unix *priv)
 {
-    pthread_mutex_lock(&priv->mutex);
+    int count = 0;
 
-    /* Bail out if the channel is closing or closed. */
-    if (!priv->open) {
-        pthread_mutex_unlock(&priv->mutex);
-        errno = ENODEV;
-        return NULL;
+    pthread_mutex_lock(&priv->urc_mutex);
+    if (priv->urc_dispatching) {
+        pthread_mutex_unlock(&priv->urc_mutex);
+        return 0;
+    }
+    priv->urc_dispatching = true;
+    priv->urc_owner = pthread_self();
+
+    while (priv->urc_count > 0) {
+        /* Take the line out of its slot, so the reader can reuse the slot
+         * while the handler runs. */
+        size_t len = priv->urc_lengths[priv->urc_head];
+        memcpy(priv->urc_line, urc_slot(priv, priv->urc_head), len+1);
+        priv->urc_head = (priv->urc_head + 1) % priv->urc_slot_count;
+        priv->urc_count--;
+
+        /* The registry can't change while the queue lock is held. */
+        const struct at_urc_registry *urcs = &priv->at.urcs;
+        int index = urcs->count > 0 ? at_prefix_match(&urcs->matcher, priv->urc_line, len) : -1;
+        at_urc_handler_t handler = index >= 0 ? urcs->handlers[index] : NULL;
+        void *handler_arg = index >= 0 ? urcs->args[index] : NULL;
+        const char *prefix = index >= 0 ? urcs->prefixes[index] : NULL;
+
+        const struct at_callbacks *cbs = priv->at.cbs;
+        void *arg = priv->at.arg;
+        pthread_mutex_unlock(&priv->urc_mutex);
+
+        if (handler)
+            urc_call(handler, handler_arg, prefix, priv->urc_line, len);
+        else if (cbs && cbs->handle_urc)
+            cbs->handle_urc(priv->urc_line, len, arg);
+        count++;
+
+        pthread_mutex_lock(&priv->urc_mutex);
     }
 
-    /* Prepare parser. */
-    at_parser_await_response(priv->at.parser);
+    priv->urc_dispatching = false;
+    pthread_cond_broadcast(&priv->urc_cond);
+    pthread_mutex_unlock(&priv->urc_mutex);
 
-    /* Send the command. */
-    // FIXME: handle interrupts, short writes, errors, etc.
-    write(priv->fd, data, size);
+    return count;
+}
 
-    /* Wait for the parser thread to collect a response. */
-    priv->waiting = true;
-    if (priv->timeout) {
-        struct timespec ts;
-#if _POSIX_TIMERS > 0
-        clock_gettime(CLOCK_REALTIME, &ts);
-#else
-        struct timeval tv;
-        gettimeofday(&tv, NULL);
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000;
-#endif
-        ts.tv_sec += priv->timeout;
+static void *at_urc_thread(void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) arg;
 
-        while (priv->open && priv->waiting)
-            if (pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts) == ETIMEDOUT)
-                break;
-    } else {
-        while (priv->open && priv->waiting)
-            pthread_cond_wait(&priv->cond, &priv->mutex);
+    pthread_mutex_lock(&priv->urc_mutex);
+    while (!priv->urc_stopping) {
+        if (priv->urc_count == 0 || priv->urc_dispatching) {
+            pthread_cond_wait(&priv->urc_cond, &priv->urc_mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&priv->urc_mutex);
+        urc_dispatch(priv);
+        pthread_mutex_lock(&priv->urc_mutex);
     }
+    pthread_mutex_unlock(&priv->urc_mutex);
 
-    const char *result;
-    if (!priv->open) {
-        /* The serial port was closed behind our back. */
-        errno = ENODEV;
-        result = NULL;
-    } else if (priv->waiting) {
-        /* Timed out waiting for a response. */
-        at_parser_reset(priv->at.parser);
-        errno = ETIMEDOUT;
-        result = NULL;
-    } else {
-        /* Response arrived. */
-        result = priv->response;
+    return NULL;
+}
+
+int at_init_urc_queue(struct at *at, char *storage, size_t *lengths,
+                      size_t slots, size_t slot_size,
+                      enum at_urc_drop_policy policy, bool dispatcher)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    if (slots > 0 && (!storage || !lengths || slot_size == 0)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    /* Reset per-command settings. */
-    priv->at.command_scanner = NULL;
+    /* Stop the dispatcher thread; it finishes the URC it's handling. */
+    if (priv->urc_dispatcher) {
+        pthread_mutex_lock(&priv->urc_mutex);
+        priv->urc_stopping = true;
+        pthread_cond_broadcast(&priv->urc_cond);
+        pthread_mutex_unlock(&priv->urc_mutex);
+
+        pthread_join(priv->urc_thread, NULL);
+        priv->urc_dispatcher = false;
+        priv->urc_stopping = false;
+    }
 
+    /* Swap the queues. The reader can't be queueing URCs meanwhile, and a
+     * handler run by at_urc_drain() must be done with the line it was given
+     * (unless it's the caller). The handler may need the channel mutex, so
+     * don't hold it while waiting. */
+    while (true) {
+        pthread_mutex_lock(&priv->mutex);
+        pthread_mutex_lock(&priv->urc_mutex);
+        if (!priv->urc_dispatching || pthread_equal(priv->urc_owner, pthread_self()))
+            break;
+        pthread_mutex_unlock(&priv->mutex);
+        pthread_cond_wait(&priv->urc_cond, &priv->urc_mutex);
+        pthread_mutex_unlock(&priv->urc_mutex);
+    }
+#if !defined(ATTENTIVE_NO_MALLOC)
+    if (priv->urc_owned) {
+        free(priv->urc_slots);
+        free(priv->urc_lengths);
+    }
+#endif
+    priv->urc_slots = slots > 0 ? storage : NULL;
+    priv->urc_lengths = slots > 0 ? lengths : NULL;
+    priv->urc_line = slots > 0 ? storage + slots * (slot_size+1) : NULL;
+    priv->urc_slot_count = slots;
+    priv->urc_slot_size = slot_size;
+    priv->urc_head = 0;
+    priv->urc_count = 0;
+    priv->urc_policy = policy;
+    priv->urc_dropped = 0;
+    priv->urc_owned = false;
+    pthread_mutex_unlock(&priv->urc_mutex);
     pthread_mutex_unlock(&priv->mutex);
 
-    return result;
+    if (slots > 0 && dispatcher) {
+        int result = pthread_create(&priv->urc_thread, NULL, at_urc_thread, (void *) priv);
+        if (result != 0) {
+            /* The queue stays usable with at_urc_drain(). */
+            errno = result;
+            return -1;
+        }
+        priv->urc_dispatcher = true;
+    }
+
+    return 0;
 }
 
-const char *at_command(struct at *at, const char *format, ...)
+#if !defined(ATTENTIVE_NO_MALLOC)
+int at_set_urc_queue(struct at *at, size_t slots, size_t slot_size,
+                     enum at_urc_drop_policy policy, bool dispatcher)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-    /* Build command string. */
-    va_list ap;
-    va_start(ap, format);
-    char line[AT_COMMAND_LENGTH];
-    int len = vsnprintf(line, sizeof(line)-1, format, ap);
-    va_end(ap);
+    /* Allocate the new queue, plus room for the line being handled. */
+    char *storage = NULL;
+    size_t *lengths = NULL;
+    if (slots > 0) {
+        if (slot_size == 0 || slot_size >= SIZE_MAX / (slots+1)) {
+            errno = EINVAL;
+            return -1;
+        }
+        storage = malloc(AT_URC_QUEUE_STORAGE(slots, slot_size));
+        lengths = malloc(slots * sizeof(*lengths));
+        if (!storage || !lengths) {
+            free(storage);
+            free(lengths);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
 
-    /* Bail out if we run out of space. */
-    if (len >= (int)(sizeof(line)-1)) {
-        errno = ENOMEM;
-        return NULL;
+    int result = at_init_urc_queue(at, storage, lengths, slots, slot_size, policy, dispatcher);
+
+    /* Even if the dispatcher failed to start, the queue is in place. */
+    if (slots > 0) {
+        pthread_mutex_lock(&priv->urc_mutex);
+        priv->urc_owned = true;
+        pthread_mutex_unlock(&priv->urc_mutex);
     }
 
-#if defined(ATTENTIVE_DEBUG)
-    printf("> %s\n", line);
+    return result;
+}
 #endif
 
-    /* Append modem-style newline. */
-    line[len++] = '\r';
-
-    /* Send the command. */
-    return _at_command(priv, line, len);
+int at_urc_drain(struct at *at)
+{
+    return urc_dispatch((struct at_unix *) at);
 }
 
-const char *at_command_raw(struct at *at, const void *data, size_t size)
+uint32_t at_urc_dropped(struct at *at)
 {
     struct at_unix *priv = (struct at_unix *) at;
 
-#if defined(ATTENTIVE_DEBUG)
-    printf("> [%zu bytes]\n", size);
-#endif
+    pthread_mutex_lock(&priv->urc_mutex);
+    uint32_t dropped = priv->urc_dropped;
+    pthread_mutex_unlock(&priv->urc_mutex);
 
-    return _at_command(priv, data, size);
+    return dropped;
 }
 
-void *at_reader_thread(void *arg)
+/**
+ * Find a registered prefix.
+ *
+ * @returns Registry index, or -1 if not registered.
+ */
+static int urc_find(const struct at_urc_registry *urcs, const char *prefix)
 {
-    struct at_unix *priv = (struct at_unix *)arg;
+    for (size_t i=0; i<urcs->count; i++)
+        if (!strcmp(urcs->prefixes[i], prefix))
+            return i;
+    return -1;
+}
 
-    printf("at_reader_thread[%s]: starting\n", priv->devpath);
+int at_register_urc(struct at *at, const char *prefix, at_urc_handler_t handler, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    struct at_urc_registry *urcs = &at->urcs;
+    int result = 0;
 
-    while (true) {
-        pthread_mutex_lock(&priv->mutex);
+    /* Keep both the reader and the URC dispatcher out. */
+    pthread_mutex_lock(&priv->mutex);
+    pthread_mutex_lock(&priv->urc_mutex);
+
+    int index = urc_find(urcs, prefix);
+    if (index >= 0) {
+        urcs->handlers[index] = handler;
+        urcs->args[index] = arg;
+    } else if (urcs->count == AT_URC_HANDLERS_MAX) {
+        errno = ENOBUFS;
+        result = -1;
+    } else {
+        urcs->prefixes[urcs->count] = prefix;
+        urcs->prefixes[urcs->count+1] = NULL;
+        urcs->handlers[urcs->count] = handler;
+        urcs->args[urcs->count] = arg;
+        if (at_prefix_matcher_init(&urcs->matcher, urcs->prefixes) == 0) {
+            urcs->count++;
+        } else {
+            urcs->prefixes[urcs->count] = NULL;
+            at_prefix_matcher_init(&urcs->matcher, urcs->prefixes);
+            result = -1;
+        }
+    }
 
-        /* Wait for the port descriptor to be valid. */
-        while (priv->running && !priv->open)
-            pthread_cond_wait(&priv->cond, &priv->mutex);
+    pthread_mutex_unlock(&priv->urc_mutex);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return result;
+}
+
+int at_unregister_urc(struct at *at, const char *prefix)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    struct at_urc_registry *urcs = &at->urcs;
+    int result = 0;
+
+    pthread_mutex_lock(&priv->mutex);
+    pthread_mutex_lock(&priv->urc_mutex);
+
+    int index = urc_find(urcs, prefix);
+    if (index >= 0) {
+        urcs->count--;
+        for (size_t i=index; i<urcs->count; i++) {
+            urcs->prefixes[i] = urcs->prefixes[i+1];
+            urcs->handlers[i] = urcs->handlers[i+1];
+            urcs->args[i] = urcs->args[i+1];
+        }
+        urcs->prefixes[urcs->count] = NULL;
+        at_prefix_matcher_init(&urcs->matcher, urcs->prefixes);
+    } else {
+        errno = ENOENT;
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&priv->urc_mutex);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return result;
+}
+
+void at_set_command_scanner(struct at *at, at_line_scanner_t scanner)
+{
+    at->command_scanner = scanner;
+}
+
+void at_set_character_handler(struct at *at, at_character_handler_t handler)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    priv->character_handler = handler;
+    at_parser_set_character_handler(at->parser, handler ? character_handler : NULL);
+}
+
+void at_set_span_handler(struct at *at, at_span_handler_t handler)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    priv->span_handler = handler;
+    at_parser_set_span_handler(at->parser, handler ? span_handler : NULL);
+}
+
+void at_set_timeout(struct at *at, int timeout)
+{
+    at_set_timeout_ms(at, timeout * 1000L);
+}
+
+void at_set_timeout_ms(struct at *at, long timeout)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->timeout = timeout;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_expect_dataprompt(struct at *at)
+{
+    at_parser_expect_dataprompt(at->parser);
+}
+
+int at_set_buffer_limit(struct at *at, size_t limit)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    int result = at_parser_set_buffer_limit(at->parser, limit);
+    pthread_mutex_unlock(&priv->mutex);
+
+    return result;
+}
+
+void at_set_data_sink(struct at *at, void *buf, size_t size)
+{
+    at_parser_set_data_sink(at->parser, buf, size);
+}
+
+size_t at_data_sink_used(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    size_t used = priv->completing ? at_parser_data_sink_used(at->parser)
+                                   : priv->response_sink_used;
+    pthread_mutex_unlock(&priv->mutex);
+
+    return used;
+}
+
+void at_get_stats(struct at *at, struct at_parser_stats *stats)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    at_parser_get_stats(at->parser, stats);
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+void at_reset_stats(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    at_parser_reset_stats(at->parser);
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+struct at_trace *at_get_trace(struct at *at)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    return &priv->trace;
+}
+
+void at_set_trace_dump(struct at *at, FILE *stream)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    pthread_mutex_lock(&priv->mutex);
+    priv->trace_dump = stream;
+    pthread_mutex_unlock(&priv->mutex);
+}
+
+/**
+ * Check whether the oldest request still has bytes to write.
+ */
+static bool request_writing(struct at_unix *priv)
+{
+    struct at_unix_request *request = request_current(priv);
+    return request && request->sent && request->written < request->size;
+}
+
+/**
+ * Send the oldest request, or as much of it as the port takes without
+ * blocking; whoever reads the port resumes once there's room. Requests whose
+ * command can't be written fail right away. Called with the mutex held.
+ */
+static void request_send(struct at_unix *priv)
+{
+    struct at_unix_request *request;
+
+    while ((request = request_current(priv))) {
+        if (!request->sent) {
+            /* The reader can't see the response before the command is
+             * queued: it needs the mutex to feed the parser. The modem may
+             * echo the command back, even before it's written in full. */
+            request->command.echo = request->data;
+            request->command.echo_len = request->size;
+            at_parser_queue_command(priv->at.parser, &request->command);
+
+            /* Waiting for room to write counts against the timeout. */
+            request->sent = true;
+            request->timed = request->timeout > 0;
+            if (request->timed)
+                deadline(&request->deadline, request->timeout);
+        }
+
+        if (request->written == request->size)
+            break;
+
+        ssize_t result = write(priv->fd, (const char *) request->data + request->written,
+                               request->size - request->written);
+        if (result >= 0) {
+            request->written += result;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            int why = errno;
+            at_parser_cancel_commands(priv->at.parser);
+            struct at_unix_request failed = request_pop(priv);
+            failed.cb(&priv->at, NULL, why, failed.arg);
+        }
+    }
+
+    request_schedule(priv);
+}
+
+/**
+ * Queue a request, sending it right away if it's the only one. Called with
+ * the mutex held.
+ *
+ * @param data Command to send. Must stay valid until the request completes,
+ *             unless copied.
+ * @param copy Send a copy of the data, which must fit AT_UNIX_COMMAND_LENGTH.
+ * @param hold Keep the response until the next held one, for at_command().
+ * @returns Zero on success, -1 and sets errno on failure.
+ */
+static int request_queue(struct at_unix *priv, const void *data, size_t size, bool copy,
+                         at_command_cb_t cb, void *arg, bool hold)
+{
+    /* Bail out if the channel is closing or closed. */
+    if (!priv->open) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (priv->request_count == AT_UNIX_REQUESTS_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Take over the settings made for this command. */
+    size_t slot = (priv->request_head + priv->request_count) % AT_UNIX_REQUESTS_MAX;
+    struct at_unix_request *request = &priv->requests[slot];
+    at_parser_take_next(priv->at.parser, &request->command);
+    request->command.hold = hold;
+    request->cb = cb;
+    request->arg = arg;
+    request->scanner = priv->at.command_scanner;
+    request->character_handler = priv->character_handler;
+    request->span_handler = priv->span_handler;
+    request->timeout = priv->timeout;
+    request->sent = false;
+    request->written = 0;
+    if (copy) {
+        memcpy(request->line, data, size);
+        data = request->line;
+    }
+    request->data = data;
+    request->size = size;
+    priv->request_count++;
+
+    /* Reset per-command settings. */
+    priv->at.command_scanner = NULL;
+    priv->character_handler = NULL;
+    priv->span_handler = NULL;
+
+    request_send(priv);
+    return 0;
+}
+
+/** Completion state of a blocking command. */
+struct command_wait {
+    const char *response;
+    int error;
+    bool done;
+};
+
+static void command_done(struct at *at, const char *response, int error, void *arg)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    struct command_wait *wait = (struct command_wait *) arg;
+
+    wait->response = response;
+    wait->error = error;
+    wait->done = true;
+    pthread_cond_broadcast(&priv->cond);
+}
+
+static const char *_at_command(struct at_unix *priv, const void *data, size_t size)
+{
+    struct command_wait wait = { .done = false };
+
+    pthread_mutex_lock(&priv->mutex);
+
+    /* The previous response is no longer needed. */
+    at_parser_release_response(priv->at.parser);
+    priv->response_line_count = 0;
+    priv->response_sink_used = 0;
+
+    if (request_queue(priv, data, size, false, command_done, &wait, true) == -1) {
+        pthread_mutex_unlock(&priv->mutex);
+        return NULL;
+    }
+
+    /* Wait for the reader to complete the request. Timeouts are normally
+     * fired by the reader too, but don't count on it being alive. */
+    while (!wait.done) {
+        struct at_unix_request *request = request_current(priv);
+        if (request && request->timed) {
+            struct timespec ts = request->deadline;
+            pthread_cond_timedwait(&priv->cond, &priv->mutex, &ts);
+            request_expire(priv);
+        } else {
+            pthread_cond_wait(&priv->cond, &priv->mutex);
+        }
+    }
+
+    if (wait.error == 0)
+        priv->response = wait.response;
+
+    pthread_mutex_unlock(&priv->mutex);
+
+    if (wait.error) {
+        errno = wait.error;
+        return NULL;
+    }
+    return wait.response;
+}
+
+/**
+ * Format a command line, with the trailing CR.
+ *
+ * @returns Line length on success, -1 and sets errno on failure.
+ */
+static int format_command(struct at_unix *priv, char *line, const char *format, va_list ap)
+{
+    int len = vsnprintf(line, AT_UNIX_COMMAND_LENGTH-1, format, ap);
+
+    /* Bail out if we run out of space. */
+    if (len >= AT_UNIX_COMMAND_LENGTH-1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+#if defined(ATTENTIVE_DEBUG)
+    printf("> %s\n", line);
+#endif
+    at_trace_record(&priv->trace, AT_TRACE_COMMAND, 0, line, len);
+
+    /* Append modem-style newline. */
+    line[len++] = '\r';
+    return len;
+}
+
+const char *at_command(struct at *at, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_UNIX_COMMAND_LENGTH];
+    int len = format_command(priv, line, format, ap);
+    va_end(ap);
+    if (len == -1)
+        return NULL;
+
+    /* Send the command. */
+    return _at_command(priv, line, len);
+}
+
+int at_command_async(struct at *at, at_command_cb_t cb, void *arg, const char *format, ...)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+    /* Build command string; the request keeps a copy. */
+    va_list ap;
+    va_start(ap, format);
+    char line[AT_UNIX_COMMAND_LENGTH];
+    int len = format_command(priv, line, format, ap);
+    va_end(ap);
+    if (len == -1)
+        return -1;
+
+    pthread_mutex_lock(&priv->mutex);
+    int result = request_queue(priv, line, len, true, cb, arg, false);
+    pthread_mutex_unlock(&priv->mutex);
+    return result;
+}
+
+const char *at_command_raw(struct at *at, const void *data, size_t size)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+
+#if defined(ATTENTIVE_DEBUG)
+    printf("> [%zu bytes]\n", size);
+#endif
+    at_trace_record(&priv->trace, AT_TRACE_RAW, 0, data, size);
+
+    return _at_command(priv, data, size);
+}
+
+const struct at_response_line *at_response_lines(struct at *at, size_t *count)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    const struct at_response_line *lines;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->completing) {
+        lines = at_parser_response_lines(at->parser, count);
+    } else {
+        *count = priv->response_line_count;
+        lines = priv->response_lines;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    return lines;
+}
+
+const char *at_response_line(struct at *at, size_t n, size_t *len)
+{
+    struct at_unix *priv = (struct at_unix *) at;
+    const char *line = NULL;
+
+    /* Asynchronous responses are only passed to their callbacks. */
+    pthread_mutex_lock(&priv->mutex);
+    if (!priv->completing && n < priv->response_line_count) {
+        *len = priv->response_lines[n].length;
+        line = priv->response + priv->response_lines[n].offset;
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    return line;
+}
+
+/**
+ * Make whoever reads the port aware of the oldest request's deadline, and
+ * of whether it waits for room to write.
+ */
+static void request_schedule(struct at_unix *priv)
+{
+#if defined(__linux__)
+    if (priv->reactor) {
+        struct at_unix_request *request = request_current(priv);
+        struct itimerspec its = { .it_value = { 0, 0 } };
+        if (request && request->timed) {
+            its.it_value = request->deadline;
+            /* An all-zero value would disarm the timer. */
+            if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+                its.it_value.tv_nsec = 1;
+        }
+        if (priv->open) {
+            timerfd_settime(priv->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+            reactor_watch(priv->reactor, priv, request_writing(priv));
+        }
+        return;
+    }
+#endif
+
+    /* The reader recomputes its poll() timeout and events on every wakeup. */
+    reader_wake(priv);
+}
+
+/**
+ * Make the reader thread return from poll(), if it's there.
+ */
+static void reader_wake(struct at_unix *priv)
+{
+    if (priv->reader) {
+        char byte = 0;
+        if (write(priv->wake[1], &byte, 1) == -1) {
+            /* Already full, so the reader will wake up anyway. */
+        }
+    }
+}
+
+void *at_reader_thread(void *arg)
+{
+    struct at_unix *priv = (struct at_unix *)arg;
+
+    printf("at_reader_thread[%s]: starting\n", priv->devpath);
+
+    /* The mutex is only dropped while waiting in poll() and read(). */
+    pthread_mutex_lock(&priv->mutex);
+
+    while (true) {
+        /* Wait for the port descriptor to be valid. */
+        while (priv->running && !priv->open)
+            pthread_cond_wait(&priv->cond, &priv->mutex);
 
         if (!priv->running) {
             /* Time to die. */
-            pthread_mutex_unlock(&priv->mutex);
             break;
         }
 
         /* Lock access to the port descriptor. */
         priv->busy = true;
+        size_t chunk = priv->read_chunk;
+        struct at_unix_request *request = request_current(priv);
+        int timeout = request && request->timed ? remaining_ms(&request->deadline) : -1;
+        short events = request_writing(priv) ? POLLIN | POLLOUT : POLLIN;
         pthread_mutex_unlock(&priv->mutex);
 
-        /* Attempt to read some data. */
-        char ch;
-        int result = read(priv->fd, &ch, 1);
+        /* Wait for data, room to write, a wakeup or the next deadline. */
+        struct pollfd fds[2] = {
+            { .fd = priv->fd, .events = events },
+            { .fd = priv->wake[0], .events = POLLIN },
+        };
+        ssize_t result = poll(fds, 2, timeout);
         int why = errno;
+        if (result > 0 && fds[1].revents) {
+            char drain[16];
+            while (read(priv->wake[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        bool writable = result > 0 && (fds[0].revents & POLLOUT);
+        bool readable = result > 0 && (fds[0].revents & ~POLLOUT);
+        if (readable) {
+            /* Read whatever is available, up to a chunk. */
+            result = read(priv->fd, priv->read_buf, chunk);
+            why = errno;
+        }
 
         pthread_mutex_lock(&priv->mutex);
         /* Unlock access to the port descriptor. */
         priv->busy = false;
-        /* Notify at_close() that the port is now free. */
-        pthread_cond_signal(&priv->cond);
-        pthread_mutex_unlock(&priv->mutex);
+        /* Notify at_close() that the port is now free. Commands wait on
+         * the same cond, so wake everyone up. */
+        pthread_cond_broadcast(&priv->cond);
 
-        if (result == 1) {
-            /* Data received, feed the parser. */
-            pthread_mutex_lock(&priv->mutex);
-            at_parser_feed(priv->at.parser, &ch, 1);
-            pthread_mutex_unlock(&priv->mutex);
-        } else if (result == -1) {
-            printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
-            if (why == EINTR)
-                continue;
-            else
+        if (writable && priv->open)
+            request_send(priv);
+
+        if (result == -1) {
+            if (why != EINTR) {
+                printf("at_reader_thread[%s]: %s\n", priv->devpath, strerror(why));
+                request_hangup(priv);
                 break;
+            }
+        } else if (!readable) {
+            /* Woken up, timed out or only writable. */
+        } else if (result > 0) {
+            /* Data received, feed the parser in one go. */
+            at_parser_feed(priv->at.parser, priv->read_buf, result);
         } else {
             printf("at_reader_thread[%s]: received EOF\n", priv->devpath);
+            request_hangup(priv);
             break;
         }
+
+        request_expire(priv);
     }
 
+    pthread_mutex_unlock(&priv->mutex);
+
     printf("at_reader_thread[%s]: finished\n", priv->devpath);
 
     return NULL;
 }
 
+#if defined(__linux__)
+/* epoll data of the reactor's stop event; channels use generation:slot,
+ * with REACTOR_TIMER set in the slot for their timer. */
+#define REACTOR_STOP UINT64_MAX
+#define REACTOR_TIMER 0x80000000u
+
+static uint64_t reactor_key(struct at_reactor *reactor, int slot)
+{
+    return (uint64_t) reactor->generations[slot] << 32 | (uint32_t) slot;
+}
+
+/**
+ * Register an open channel. Called with the channel's mutex held.
+ */
+static int reactor_add(struct at_reactor *reactor, struct at_unix *priv)
+{
+    pthread_mutex_lock(&reactor->mutex);
+
+    int slot = 0;
+    while (slot < AT_REACTOR_CHANNELS_MAX && reactor->channels[slot])
+        slot++;
+    if (slot == AT_REACTOR_CHANNELS_MAX) {
+        pthread_mutex_unlock(&reactor->mutex);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    /* One-shot, so that only one thread at a time reads a channel. */
+    reactor->generations[slot]++;
+    reactor->writing[slot] = false;
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLONESHOT,
+        .data.u64 = reactor_key(reactor, slot),
+    };
+    priv->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (priv->timerfd == -1) {
+        pthread_mutex_unlock(&reactor->mutex);
+        return -1;
+    }
+    struct epoll_event timer = {
+        .events = EPOLLIN,
+        .data.u64 = reactor_key(reactor, slot) | REACTOR_TIMER,
+    };
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, priv->fd, &event) == -1 ||
+            epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, priv->timerfd, &timer) == -1) {
+        int why = errno;
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, priv->fd, NULL);
+        close(priv->timerfd);
+        pthread_mutex_unlock(&reactor->mutex);
+        errno = why;
+        return -1;
+    }
+    reactor->channels[slot] = priv;
+    priv->reactor_slot = slot;
+
+    pthread_mutex_unlock(&reactor->mutex);
+    return 0;
+}
+
+/**
+ * Unregister a channel and wait until no thread is reading it. Must be
+ * called without the channel's mutex, which a reading thread may need.
+ */
+static void reactor_remove(struct at_reactor *reactor, struct at_unix *priv)
+{
+    int slot = priv->reactor_slot;
+
+    pthread_mutex_lock(&reactor->mutex);
+    reactor->channels[slot] = NULL;
+    reactor->generations[slot]++;
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, priv->fd, NULL);
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, priv->timerfd, NULL);
+    while (reactor->busy[slot])
+        pthread_cond_wait(&reactor->cond, &reactor->mutex);
+    close(priv->timerfd);
+    priv->timerfd = -1;
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+/**
+ * Re-arm a channel's port, for writing too if asked.
+ */
+static void reactor_arm(struct at_reactor *reactor, int slot, int fd)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLONESHOT | (reactor->writing[slot] ? EPOLLOUT : 0),
+        .data.u64 = reactor_key(reactor, slot),
+    };
+    epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/**
+ * Set whether a channel waits for room to write. Called with the channel's
+ * mutex held.
+ */
+static void reactor_watch(struct at_reactor *reactor, struct at_unix *priv, bool writing)
+{
+    int slot = priv->reactor_slot;
+
+    /* Re-arming a channel that is being served lets a second thread in
+     * early, which only has it wait for the channel's mutex. */
+    pthread_mutex_lock(&reactor->mutex);
+    if (reactor->channels[slot] == priv && reactor->writing[slot] != writing) {
+        reactor->writing[slot] = writing;
+        reactor_arm(reactor, slot, priv->fd);
+    }
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+/**
+ * Read a chunk from a ready channel and feed it to its parser, resume
+ * writing its command, or expire its requests once its timer fires.
+ */
+static void reactor_service(struct at_reactor *reactor, uint64_t key, uint32_t events)
+{
+    bool timer = key & REACTOR_TIMER;
+    key &= ~(uint64_t) REACTOR_TIMER;
+    int slot = (uint32_t) key;
+
+    /* Events fetched before the channel went away are stale. */
+    pthread_mutex_lock(&reactor->mutex);
+    struct at_unix *priv = reactor->channels[slot];
+    if (!priv || reactor_key(reactor, slot) != key) {
+        pthread_mutex_unlock(&reactor->mutex);
+        return;
+    }
+    reactor->busy[slot]++;
+    pthread_mutex_unlock(&reactor->mutex);
+
+    bool rearm = !timer;
+    pthread_mutex_lock(&priv->mutex);
+    if (timer) {
+        uint64_t expirations;
+        if (read(priv->timerfd, &expirations, sizeof(expirations)) > 0)
+            request_expire(priv);
+    } else if (priv->open) {
+        if (events & EPOLLOUT)
+            request_send(priv);
+        ssize_t result = read(priv->fd, priv->read_buf, priv->read_chunk);
+        if (result > 0) {
+            at_parser_feed(priv->at.parser, priv->read_buf, result);
+        } else if (result == 0) {
+            printf("at_reactor[%s]: received EOF\n", priv->devpath);
+            request_hangup(priv);
+            rearm = false;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            printf("at_reactor[%s]: %s\n", priv->devpath, strerror(errno));
+            request_hangup(priv);
+            rearm = false;
+        }
+        /* The oldest request may have changed. */
+        request_schedule(priv);
+    }
+    pthread_mutex_unlock(&priv->mutex);
+
+    pthread_mutex_lock(&reactor->mutex);
+    reactor->busy[slot]--;
+    if (rearm && reactor_key(reactor, slot) == key)
+        reactor_arm(reactor, slot, priv->fd);
+    pthread_cond_broadcast(&reactor->cond);
+    pthread_mutex_unlock(&reactor->mutex);
+}
+
+static void *reactor_thread(void *arg)
+{
+    struct at_reactor *reactor = (struct at_reactor *) arg;
+    struct epoll_event events[8];
+
+    while (true) {
+        int count = epoll_wait(reactor->epfd, events, 8, -1);
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            printf("at_reactor: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i=0; i<count; i++) {
+            /* The stop event stays readable, so every thread sees it. */
+            if (events[i].data.u64 == REACTOR_STOP)
+                return NULL;
+            reactor_service(reactor, events[i].data.u64, events[i].events);
+        }
+    }
+
+    return NULL;
+}
+
+int at_reactor_start(struct at_reactor *reactor, size_t threads)
+{
+    if (threads == 0 || threads > AT_REACTOR_THREADS_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(reactor, 0, sizeof(*reactor));
+
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epfd == -1)
+        return -1;
+
+    reactor->stopfd = eventfd(0, EFD_CLOEXEC);
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.u64 = REACTOR_STOP,
+    };
+    if (reactor->stopfd == -1 ||
+            epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->stopfd, &event) == -1) {
+        int why = errno;
+        if (reactor->stopfd != -1)
+            close(reactor->stopfd);
+        close(reactor->epfd);
+        errno = why;
+        return -1;
+    }
+
+    pthread_mutex_init(&reactor->mutex, NULL);
+    pthread_cond_init(&reactor->cond, NULL);
+
+    for (reactor->thread_count = 0; reactor->thread_count < threads; reactor->thread_count++) {
+        int result = pthread_create(&reactor->threads[reactor->thread_count], NULL,
+                                    reactor_thread, (void *) reactor);
+        if (result) {
+            at_reactor_stop(reactor);
+            errno = result;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int at_reactor_stop(struct at_reactor *reactor)
+{
+    pthread_mutex_lock(&reactor->mutex);
+    for (int slot=0; slot<AT_REACTOR_CHANNELS_MAX; slot++) {
+        if (reactor->channels[slot]) {
+            pthread_mutex_unlock(&reactor->mutex);
+            errno = EBUSY;
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&reactor->mutex);
+
+    uint64_t one = 1;
+    if (write(reactor->stopfd, &one, sizeof(one)) == -1) {
+        /* Only fails if the counter is about to overflow, so it's readable
+         * already. */
+    }
+    for (size_t i=0; i<reactor->thread_count; i++)
+        pthread_join(reactor->threads[i], NULL);
+
+    pthread_cond_destroy(&reactor->cond);
+    pthread_mutex_destroy(&reactor->mutex);
+    close(reactor->stopfd);
+    close(reactor->epfd);
+
+    return 0;
+}
+#endif
+
 /* vim: set ts=4 sw=4 et: */
@@ -62,32 +62,24 @@ void cellular_pdp_failure(struct cellular *modem)
 
 int cellular_op_imei(struct cellular *modem, char *buf, size_t len)
 {
-    char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
-
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     const char *response = at_command(modem->at, "AT+CGSN");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_digits(&tok, buf, len);
+    at_simple_tok_check(&tok);
 
     return 0;
 }
 
 int cellular_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
-    char fmt[16];
-    if (snprintf(fmt, sizeof(fmt), "%%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
-
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     const char *response = at_command(modem->at, "AT+CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_digits(&tok, buf, len);
+    at_simple_tok_check(&tok);
 
     return 0;
 }
@@ -96,9 +88,14 @@ int cellular_op_creg(struct cellular *modem)
 {
     int creg;
 
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     const char *response = at_command(modem->at, "AT+CREG?");
-    at_simple_scanf(response, "+CREG: %*d,%d", &creg);
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "+CREG: ");
+    at_tok_int(&tok, NULL);
+    at_tok_int(&tok, &creg);
+    at_simple_tok_check(&tok);
 
     return creg;
 }
@@ -107,9 +104,13 @@ int cellular_op_rssi(struct cellular *modem)
 {
     int rssi;
 
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     const char *response = at_command(modem->at, "AT+CSQ");
-    at_simple_scanf(response, "+CSQ: %d,%*d", &rssi);
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "+CSQ: ");
+    at_tok_int(&tok, &rssi);
+    at_simple_tok_check(&tok);
 
     return rssi;
 }
@@ -118,12 +119,23 @@ int cellular_op_clock_gettime(struct cellular *modem, struct timespec *ts)
 {
     struct tm tm;
 
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     const char *response = at_command(modem->at, "AT+CCLK?");
     memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%*d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "+CCLK: \"");
+    at_tok_int(&tok, &tm.tm_year);
+    at_tok_char(&tok, '/');
+    at_tok_int(&tok, &tm.tm_mon);
+    at_tok_char(&tok, '/');
+    at_tok_int(&tok, &tm.tm_mday);
+    at_tok_int(&tok, &tm.tm_hour);
+    at_tok_char(&tok, ':');
+    at_tok_int(&tok, &tm.tm_min);
+    at_tok_char(&tok, ':');
+    at_tok_int(&tok, &tm.tm_sec);
+    at_simple_tok_check(&tok);
 
     /* Most modems report some starting date way in the past when they have
      * no date/time estimation. */
@@ -158,7 +170,7 @@ int cellular_op_clock_settime(struct cellular *modem, const struct timespec *ts)
     tm.tm_mon += 1;
 
     /* Set the time. */
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     at_command_simple(modem->at, "AT+CCLK=\"%02d/%02d/%02d,%02d:%02d:%02d+00\"",
             tm.tm_year, tm.tm_mon, tm.tm_mday,
             tm.tm_hour, tm.tm_min, tm.tm_sec);
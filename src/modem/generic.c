@@ -7,16 +7,13 @@
  */
 
 #include <attentive/modem/common.h>
+#include <attentive/modem/generic.h>
 #include <attentive/cellular.h>
 
 #include <stdio.h>
 #include <string.h>
 
 
-struct cellular_generic {
-    struct cellular dev;
-};
-
 static const struct cellular_ops generic_ops = {
     .imei = cellular_op_imei,
     .iccid = cellular_op_iccid,
@@ -27,6 +24,16 @@ static const struct cellular_ops generic_ops = {
 };
 
 
+struct cellular *cellular_generic_init(struct cellular_generic *modem)
+{
+    memset(modem, 0, sizeof(*modem));
+
+    modem->dev.ops = &generic_ops;
+
+    return (struct cellular *) modem;
+}
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct cellular *cellular_generic_alloc(void)
 {
     struct cellular_generic *modem = malloc(sizeof(struct cellular_generic));
@@ -35,14 +42,13 @@ struct cellular *cellular_generic_alloc(void)
         return NULL;
     }
 
-    modem->dev.ops = &generic_ops;
-
-    return (struct cellular *) modem;
+    return cellular_generic_init(modem);
 }
 
 void cellular_generic_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
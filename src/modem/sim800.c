@@ -7,6 +7,7 @@
  */
 
 #include <attentive/modem/common.h>
+#include <attentive/modem/sim800.h>
 #include <attentive/cellular.h>
 
 #include <inttypes.h>
@@ -14,6 +15,9 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Command response scanners, generated from sim800.scanners. */
+#include "sim800-scanners.h"
+
 /*
  * SIM800 probably holds the highly esteemed position of the world's worst
  * behaving GSM modem, ever. The following quirks have been spotted so far:
@@ -32,55 +36,70 @@
 #define SIM800_AUTOBAUD_ATTEMPTS 5
 #define SIM800_WAITACK_TIMEOUT   40
 #define SIM800_FTP_TIMEOUT       60
-#define SET_TIMEOUT              60
+#define SET_TIMEOUT              60000
 #define NTP_BUF_SIZE             4
 
-enum sim800_socket_status {
-    SIM800_SOCKET_STATUS_ERROR = -1,
-    SIM800_SOCKET_STATUS_UNKNOWN = 0,
-    SIM800_SOCKET_STATUS_CONNECTED = 1,
-};
-
-#define SIM800_NSOCKETS                 6
 #define SIM800_CONNECT_TIMEOUT          20
 #define SIM800_CIPCFG_RETRIES           10
+#define SIM800_CIPRXGET_MAX             1460
+#define SIM800_RESPONSE_MAX             1024
 
-static const char *const sim800_urc_responses[] = {
-    "+CIPRXGET: 1,",    /* incoming socket data notification */
-    "+FTPGET: 1,",      /* FTP state change notification */
-    "+PDP: DEACT",      /* PDP disconnected */
-    "+SAPBR 1: DEACT",  /* PDP disconnected (for SAPBR apps) */
-    "*PSNWID: ",        /* AT+CLTS network name */
-    "*PSUTTZ: ",        /* AT+CLTS time */
-    "+CTZV: ",          /* AT+CLTS timezone */
-    "DST: ",            /* AT+CLTS dst information */
-    "+CIEV: ",          /* AT+CLTS undocumented indicator */
-    "RDY",              /* Assorted crap on newer firmware releases. */
-    "+CPIN: READY",
-    "Call Ready",
-    "SMS Ready",
-    "NORMAL POWER DOWN",
-    "UNDER-VOLTAGE POWER DOWN",
-    "UNDER-VOLTAGE WARNNING",
-    "OVER-VOLTAGE POWER DOWN",
-    "OVER-VOLTAGE WARNNING",
-    NULL
-};
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    /* URCs without a handler of their own end up here. */
+#if defined(ATTENTIVE_DEBUG)
+    printf("[sim800@%p] urc: %.*s\n", arg, (int) len, line);
+#else
+    (void) line;
+    (void) len;
+    (void) arg;
+#endif
+}
+
+static void handle_urc_ignored(const char *line, size_t len, struct at_tok *tok, void *arg)
+{
+    (void) tok;
+    handle_urc(line, len, arg);
+}
+
+static void handle_urc_ftpget1(const char *line, size_t len, struct at_tok *tok, void *arg)
+{
+    struct cellular_sim800 *priv = arg;
 
-struct cellular_sim800 {
-    struct cellular dev;
+    (void) line;
+    (void) len;
+    at_tok_int(tok, &priv->ftpget1_status);
+}
 
-    int ftpget1_status;
-    enum sim800_socket_status socket_status[SIM800_NSOCKETS];
+static const struct {
+    const char *prefix;
+    at_urc_handler_t handler;
+} sim800_urcs[] = {
+    { "+CIPRXGET: 1,",              handle_urc_ignored },   /* incoming socket data notification */
+    { "+FTPGET: 1,",                handle_urc_ftpget1 },   /* FTP state change notification */
+    { "+PDP: DEACT",                handle_urc_ignored },   /* PDP disconnected */
+    { "+SAPBR 1: DEACT",            handle_urc_ignored },   /* PDP disconnected (for SAPBR apps) */
+    { "*PSNWID: ",                  handle_urc_ignored },   /* AT+CLTS network name */
+    { "*PSUTTZ: ",                  handle_urc_ignored },   /* AT+CLTS time */
+    { "+CTZV: ",                    handle_urc_ignored },   /* AT+CLTS timezone */
+    { "DST: ",                      handle_urc_ignored },   /* AT+CLTS dst information */
+    { "+CIEV: ",                    handle_urc_ignored },   /* AT+CLTS undocumented indicator */
+    { "RDY",                        handle_urc_ignored },   /* Assorted crap on newer firmware releases. */
+    { "+CPIN: READY",               handle_urc_ignored },
+    { "Call Ready",                 handle_urc_ignored },
+    { "SMS Ready",                  handle_urc_ignored },
+    { "NORMAL POWER DOWN",          handle_urc_ignored },
+    { "UNDER-VOLTAGE POWER DOWN",   handle_urc_ignored },
+    { "UNDER-VOLTAGE WARNNING",     handle_urc_ignored },
+    { "OVER-VOLTAGE POWER DOWN",    handle_urc_ignored },
+    { "OVER-VOLTAGE WARNNING",      handle_urc_ignored },
 };
 
 static enum at_response_type scan_line(const char *line, size_t len, void *arg)
 {
-    (void) len;
     struct cellular_sim800 *priv = arg;
 
-    if (at_prefix_in_table(line, sim800_urc_responses))
-        return AT_RESPONSE_URC;
+    (void) len;
 
     /* Socket status notifications in form of "%d, <status>". */
     if (line[0] >= '0' && line[0] <= '0'+SIM800_NSOCKETS &&
@@ -106,16 +125,6 @@ static enum at_response_type scan_line(const char *line, size_t len, void *arg)
     return AT_RESPONSE_UNKNOWN;
 }
 
-static void handle_urc(const char *line, size_t len, void *arg)
-{
-    struct cellular_sim800 *priv = arg;
-
-    printf("[sim800@%p] urc: %.*s\n", priv, (int) len, line);
-
-    if (sscanf(line, "+FTPGET: 1,%d", &priv->ftpget1_status) == 1)
-        return;
-}
-
 static const struct at_callbacks sim800_callbacks = {
     .scan_line = scan_line,
     .handle_urc = handle_urc,
@@ -129,7 +138,7 @@ static const struct at_callbacks sim800_callbacks = {
  */
 static int sim800_config(struct cellular *modem, const char *option, const char *value, int attempts)
 {
-    at_set_timeout(modem->at, 10);
+    at_set_timeout_ms(modem->at, 10000);
 
     for (int i=0; i<attempts; i++) {
         /* Blindly try to set the configuration option. */
@@ -158,11 +167,22 @@ static int sim800_config(struct cellular *modem, const char *option, const char
 }
 
 
-static int sim800_attach(struct cellular *modem)
+/**
+ * Unregister the first count URC handlers, along with the callbacks.
+ */
+static void sim800_unregister_urcs(struct cellular *modem, size_t count)
 {
-    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
+    for (size_t i=0; i<count; i++)
+        at_unregister_urc(modem->at, sim800_urcs[i].prefix);
+    at_set_callbacks(modem->at, NULL, NULL);
+}
+
+static int sim800_init(struct cellular *modem)
+{
+    /* AT+CIPSTATUS lists all six connections; make sure it fits. */
+    at_set_buffer_limit(modem->at, SIM800_RESPONSE_MAX);
 
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
 
     /* Perform autobauding. */
     for (int i=0; i<SIM800_AUTOBAUD_ATTEMPTS; i++) {
@@ -172,10 +192,8 @@ static int sim800_attach(struct cellular *modem)
             break;
     }
 
-    /* Disable local echo. */
-    at_command(modem->at, "ATE0");
-
-    /* Disable local echo again; make sure it was disabled successfully. */
+    /* Disable local echo. Its echo is dropped, so one round trip is
+     * enough to tell if it worked. */
     at_command_simple(modem->at, "ATE0");
 
     /* Initialize modem. */
@@ -206,9 +224,34 @@ static int sim800_attach(struct cellular *modem)
     return 0;
 }
 
+static int sim800_attach(struct cellular *modem)
+{
+    const size_t count = sizeof(sim800_urcs)/sizeof(*sim800_urcs);
+
+    at_set_callbacks(modem->at, &sim800_callbacks, (void *) modem);
+    for (size_t i=0; i<count; i++) {
+        if (at_register_urc(modem->at, sim800_urcs[i].prefix, sim800_urcs[i].handler, modem) != 0) {
+            int why = errno;
+            sim800_unregister_urcs(modem, i);
+            errno = why;
+            return -1;
+        }
+    }
+
+    /* Leave nothing behind if the modem can't be set up. */
+    if (sim800_init(modem) != 0) {
+        int why = errno;
+        sim800_unregister_urcs(modem, count);
+        errno = why;
+        return -1;
+    }
+
+    return 0;
+}
+
 static int sim800_detach(struct cellular *modem)
 {
-    at_set_callbacks(modem->at, NULL, NULL);
+    sim800_unregister_urcs(modem, sizeof(sim800_urcs)/sizeof(*sim800_urcs));
     return 0;
 }
 
@@ -293,20 +336,6 @@ close_conn:
     return 0;
 }
 
-static enum at_response_type scanner_cipstatus(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    /* There are response lines after OK. Keep reading. */
-    if (!strcmp(line, "OK"))
-        return AT_RESPONSE_INTERMEDIATE;
-    /* Collect the entire post-OK response until the last C: line. */
-    if (!strncmp(line, "C: 5", strlen("C: 5")))
-        return AT_RESPONSE_FINAL;
-    return AT_RESPONSE_UNKNOWN;
-}
-
 /**
  * Retrieve AT+CIPSTATUS state.
  *
@@ -314,14 +343,19 @@ static enum at_response_type scanner_cipstatus(const char *line, size_t len, voi
  */
 static int sim800_ipstatus(struct cellular *modem)
 {
-    at_set_timeout(modem->at, 10);
+    at_set_timeout_ms(modem->at, 10000);
     at_set_command_scanner(modem->at, scanner_cipstatus);
     const char *response = at_command(modem->at, "AT+CIPSTATUS");
 
     if (response == NULL)
         return -1;
 
-    const char *state = strstr(response, "STATE: ");
+    /* Find the state line without rescanning the connection list. */
+    const char *state = NULL;
+    size_t len;
+    for (size_t i=0; (state = at_response_line(modem->at, i, &len)) != NULL; i++)
+        if (len >= strlen("STATE: ") && !strncmp(state, "STATE: ", strlen("STATE: ")))
+            break;
     if (!state) {
         errno = EPROTO;
         return -1;
@@ -336,21 +370,9 @@ static int sim800_ipstatus(struct cellular *modem)
     return -1;
 }
 
-static enum at_response_type scanner_cifsr(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    /* Accept an IP address as an OK response. */
-    int ip[4];
-    if (sscanf(line, "%d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]) == 4)
-        return AT_RESPONSE_FINAL_OK;
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static int sim800_pdp_open(struct cellular *modem, const char *apn)
 {
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
 
     /* Configure and open context for FTP/HTTP applications. */
     at_command_simple(modem->at, "AT+SAPBR=3,1,APN,\"%s\"", apn);
@@ -378,18 +400,9 @@ static int sim800_pdp_open(struct cellular *modem, const char *apn)
 }
 
 
-static enum at_response_type scanner_cipshut(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-    if (!strcmp(line, "SHUT OK"))
-        return AT_RESPONSE_FINAL_OK;
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static int sim800_pdp_close(struct cellular *modem)
 {
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_cipshut);
     at_command_simple(modem->at, "AT+CIPSHUT");
 
@@ -402,7 +415,7 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
     /* Send connection request. */
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
     priv->socket_status[connid] = SIM800_SOCKET_STATUS_UNKNOWN;
     cellular_command_simple_pdp(modem, "AT+CIPSTART=%d,TCP,\"%s\",%d", connid, host, port);
 
@@ -421,32 +434,12 @@ static int sim800_socket_connect(struct cellular *modem, int connid, const char
     return -1;
 }
 
-static enum at_response_type scanner_cipsend(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int connid, amount;
-    char last;
-    if (sscanf(line, "DATA ACCEPT:%d,%d", &connid, &amount) == 2)
-        return AT_RESPONSE_FINAL_OK;
-    if (sscanf(line, "%d, SEND O%c", &connid, &last) == 2 && last == 'K')
-        return AT_RESPONSE_FINAL_OK;
-    if (sscanf(line, "%d, SEND FAI%c", &connid, &last) == 2 && last == 'L')
-        return AT_RESPONSE_FINAL;
-    if (!strcmp(line, "SEND OK"))
-        return AT_RESPONSE_FINAL_OK;
-    if (!strcmp(line, "SEND FAIL"))
-        return AT_RESPONSE_FINAL;
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void *buffer, size_t amount, int flags)
 {
     (void) flags;
 
     /* Request transmission. */
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
     at_expect_dataprompt(modem->at);
     at_command_simple(modem->at, "AT+CIPSEND=%d,%zu", connid, amount);
 
@@ -457,68 +450,49 @@ static ssize_t sim800_socket_send(struct cellular *modem, int connid, const void
     return amount;
 }
 
-static enum at_response_type scanner_ciprxget(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int requested, confirmed;
-    if (sscanf(line, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) == 2)
-        if (requested > 0)
-            return AT_RESPONSE_RAWDATA_FOLLOWS(requested);
-
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static ssize_t sim800_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
 {
     (void) flags;
 
     int cnt = 0;
-    // TODO its dumb and exceptions should be handled in other right way
-    // FIXME: It has to be changed. Leave for now
-    char tries = 127;
-    while ( (cnt < (int) length) && tries-- ){
+    while (cnt < (int) length) {
         int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+        /* Limit read size to the modem's maximum. */
+        if (chunk > SIM800_CIPRXGET_MAX)
+            chunk = SIM800_CIPRXGET_MAX;
 
-        /* Perform the read. */
-        at_set_timeout(modem->at, SET_TIMEOUT);
+        /* Perform the read. Payload goes straight into the result buffer. */
+        at_set_timeout_ms(modem->at, SET_TIMEOUT);
         at_set_command_scanner(modem->at, scanner_ciprxget);
+        at_set_data_sink(modem->at, (char *)buffer + cnt, chunk);
         const char *response = at_command(modem->at, "AT+CIPRXGET=2,%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
-        /* Find the header line. */
-        int requested, confirmed;
-        // TODO:
-        // 1. connid is not checked
-        // 2. there is possible a bug here. if not all data are ready (confirmed < requested)
-        // then wierd things can happen. see memcpy
-        // requested should be equal to chunk
-        // confirmed is that what can be read
-        at_simple_scanf(response, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed);
-
-        /* Bail out if we're out of data. */
-        /* FIXME: We should maybe block until we receive something? */
-        if (requested == 0)
-            break;
-
-        /* Locate the payload. */
-        /* TODO: what if no \n is in input stream?
-         * should use strnchr at least */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
+        /* Find the header line. The payload was framed by the delivered
+         * length from it, so a short read completes in this round trip. */
+        // TODO: connid is not checked
+        int delivered, remaining;
+        struct at_tok tok;
+        at_simple_tok_init(&tok, response);
+        at_tok_prefix(&tok, "+CIPRXGET: 2,");
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, &delivered);
+        at_tok_int(&tok, &remaining);
+        at_simple_tok_check(&tok);
+
+        if (delivered < 0 || delivered > chunk ||
+            (size_t) delivered != at_data_sink_used(modem->at))
+        {
             errno = EPROTO;
             return -1;
         }
-        data += 1;
+        cnt += delivered;
 
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, requested);
-        cnt += requested;
+        /* Stop at a short read; the modem has nothing more buffered. */
+        /* FIXME: We should maybe block until we receive something? */
+        if (delivered < chunk || remaining == 0)
+            break;
     }
 
     return cnt;
@@ -528,12 +502,18 @@ static int sim800_socket_waitack(struct cellular *modem, int connid)
 {
     const char *response;
 
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     for (int i=0; i<SIM800_WAITACK_TIMEOUT; i++) {
         /* Read number of bytes waiting. */
         int nacklen;
         response = at_command(modem->at, "AT+CIPACK=%d", connid);
-        at_simple_scanf(response, "+CIPACK: %*d,%*d,%d", &nacklen);
+        struct at_tok tok;
+        at_simple_tok_init(&tok, response);
+        at_tok_prefix(&tok, "+CIPACK: ");
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, &nacklen);
+        at_simple_tok_check(&tok);
 
         /* Return if all bytes were acknowledged. */
         if (nacklen == 0)
@@ -546,21 +526,9 @@ static int sim800_socket_waitack(struct cellular *modem, int connid)
     return -1;
 }
 
-static enum at_response_type scanner_cipclose(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int connid;
-    char last;
-    if (sscanf(line, "%d, CLOSE O%c", &connid, &last) == 2 && last == 'K')
-        return AT_RESPONSE_FINAL_OK;
-    return AT_RESPONSE_UNKNOWN;
-}
-
 int sim800_socket_close(struct cellular *modem, int connid)
 {
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_cipclose);
     at_command_simple(modem->at, "AT+CIPCLOSE=%d", connid);
 
@@ -610,33 +578,24 @@ static int sim800_ftp_get(struct cellular *modem, const char *filename)
     return -1;
 }
 
-static enum at_response_type scanner_ftpget2(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int cnflength;
-    /* TODO: Verify if cnflength is indeed the size of raw payload. */
-    if (sscanf(line, "+FTPGET: 2,%d", &cnflength) == 1)
-        return AT_RESPONSE_RAWDATA_FOLLOWS(cnflength);
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static int sim800_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     struct cellular_sim800 *priv = (struct cellular_sim800 *) modem;
 
     int retries = 0;
 retry:
-    at_set_timeout(modem->at, SET_TIMEOUT);
+    at_set_timeout_ms(modem->at, SET_TIMEOUT);
     at_set_command_scanner(modem->at, scanner_ftpget2);
+    at_set_data_sink(modem->at, buffer, length);
     const char *response = at_command(modem->at, "AT+FTPGET=2,%zu", length);
 
     if (response == NULL)
         return -1;
 
+    struct at_tok tok;
     int cnflength;
-    if (sscanf(response, "+FTPGET: 2,%d", &cnflength) == 1) {
+    at_tok_init(&tok, response, strlen(response));
+    if (at_tok_prefix(&tok, "+FTPGET: 2,") && at_tok_int(&tok, &cnflength)) {
         /* Zero means no data is available. Wait for it. */
         if (cnflength == 0) {
             /* Bail out on timeout. */
@@ -648,17 +607,8 @@ retry:
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            errno = EPROTO;
-            return -1;
-        }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer, data, cnflength);
-        return cnflength;
+        /* Payload was delivered straight into the result buffer. */
+        return at_data_sink_used(modem->at);
     } else if (priv->ftpget1_status == 0) {
         /* Transfer finished. */
         return 0;
@@ -701,6 +651,16 @@ static const struct cellular_ops sim800_ops = {
     .ftp_close = sim800_ftp_close,
 };
 
+struct cellular *cellular_sim800_init(struct cellular_sim800 *modem)
+{
+    memset(modem, 0, sizeof(*modem));
+
+    modem->dev.ops = &sim800_ops;
+
+    return (struct cellular *) modem;
+}
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct cellular *cellular_sim800_alloc(void)
 {
     struct cellular_sim800 *modem = malloc(sizeof(struct cellular_sim800));
@@ -708,16 +668,14 @@ struct cellular *cellular_sim800_alloc(void)
         errno = ENOMEM;
         return NULL;
     }
-    memset(modem, 0, sizeof(*modem));
 
-    modem->dev.ops = &sim800_ops;
-
-    return (struct cellular *) modem;
+    return cellular_sim800_init(modem);
 }
 
 void cellular_sim800_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -7,6 +7,7 @@
  */
 
 #include <attentive/modem/common.h>
+#include <attentive/modem/telit2.h>
 #include <attentive/cellular.h>
 #include <attentive/at-timegm.h>
 
@@ -14,62 +15,73 @@
 #include <string.h>
 #include <unistd.h>
 
+/* Command response scanners, generated from telit2.scanners. */
+#include "telit2-scanners.h"
+
 
 #define TELIT2_WAITACK_TIMEOUT 60
 #define TELIT2_FTP_TIMEOUT 60
 #define TELIT2_LOCATE_TIMEOUT 150
+#define TELIT2_SRECV_MAX 1500
 
-static const char *const telit2_urc_responses[] = {
-    "SRING: ",
-    "#AGPSRING: ",
-    NULL
-};
-
-struct cellular_telit2 {
-    struct cellular dev;
-
-    int locate_status;
-    float latitude, longitude, altitude;
-};
-
-static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+static void handle_urc(const char *line, size_t len, void *arg)
 {
+#if defined(ATTENTIVE_DEBUG)
+    printf("[telit2@%p] urc: %.*s\n", arg, (int) len, line);
+#else
     (void) line;
     (void) len;
+    (void) arg;
+#endif
+}
 
-    struct cellular_telit2 *priv = arg;
-    (void) priv;
-
-    if (at_prefix_in_table(line, telit2_urc_responses))
-        return AT_RESPONSE_URC;
-
-    return AT_RESPONSE_UNKNOWN;
+static void handle_urc_sring(const char *line, size_t len, struct at_tok *tok, void *arg)
+{
+    (void) tok;
+    handle_urc(line, len, arg);
 }
 
-static void handle_urc(const char *line, size_t len, void *arg)
+static void handle_urc_agpsring(const char *line, size_t len, struct at_tok *tok, void *arg)
 {
     struct cellular_telit2 *priv = arg;
 
     int status;
-    if (sscanf(line, "#AGPSRING: %d", &status) == 1) {
+    if (at_tok_int(tok, &status)) {
         priv->locate_status = status;
-        sscanf(line, "#AGPSRING: %*d,%f,%f,%f", &priv->latitude, &priv->longitude, &priv->altitude);
+        at_tok_float(tok, &priv->latitude);
+        at_tok_float(tok, &priv->longitude);
+        at_tok_float(tok, &priv->altitude);
         return;
     }
 
-    printf("[telit2@%p] urc: %.*s\n", priv, (int) len, line);
+    handle_urc(line, len, arg);
 }
 
+static const struct {
+    const char *prefix;
+    at_urc_handler_t handler;
+} telit2_urcs[] = {
+    { "SRING: ",        handle_urc_sring },
+    { "#AGPSRING: ",    handle_urc_agpsring },
+};
+
 static const struct at_callbacks telit2_callbacks = {
-    .scan_line = scan_line,
     .handle_urc = handle_urc,
 };
 
-static int telit2_attach(struct cellular *modem)
+/**
+ * Unregister the first count URC handlers, along with the callbacks.
+ */
+static void telit2_unregister_urcs(struct cellular *modem, size_t count)
 {
-    at_set_callbacks(modem->at, &telit2_callbacks, (void *) modem);
+    for (size_t i=0; i<count; i++)
+        at_unregister_urc(modem->at, telit2_urcs[i].prefix);
+    at_set_callbacks(modem->at, NULL, NULL);
+}
 
-    at_set_timeout(modem->at, 1);
+static int telit2_init(struct cellular *modem)
+{
+    at_set_timeout_ms(modem->at, 1000);
     at_command(modem->at, "AT");        /* Aid autobauding. Always a good idea. */
     at_command(modem->at, "ATE0");      /* Disable local echo. */
 
@@ -86,18 +98,43 @@ static int telit2_attach(struct cellular *modem)
     return 0;
 }
 
+static int telit2_attach(struct cellular *modem)
+{
+    const size_t count = sizeof(telit2_urcs)/sizeof(*telit2_urcs);
+
+    at_set_callbacks(modem->at, &telit2_callbacks, (void *) modem);
+    for (size_t i=0; i<count; i++) {
+        if (at_register_urc(modem->at, telit2_urcs[i].prefix, telit2_urcs[i].handler, modem) != 0) {
+            int why = errno;
+            telit2_unregister_urcs(modem, i);
+            errno = why;
+            return -1;
+        }
+    }
+
+    /* Leave nothing behind if the modem can't be set up. */
+    if (telit2_init(modem) != 0) {
+        int why = errno;
+        telit2_unregister_urcs(modem, count);
+        errno = why;
+        return -1;
+    }
+
+    return 0;
+}
+
 static int telit2_detach(struct cellular *modem)
 {
-    at_set_callbacks(modem->at, NULL, NULL);
+    telit2_unregister_urcs(modem, sizeof(telit2_urcs)/sizeof(*telit2_urcs));
     return 0;
 }
 
 static int telit2_pdp_open(struct cellular *modem, const char *apn)
 {
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     at_command_simple(modem->at, "AT+CGDCONT=1,IP,\"%s\"", apn);
 
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     const char *response = at_command(modem->at, "AT#SGACT=1,1");
 
     if (response == NULL)
@@ -106,15 +143,24 @@ static int telit2_pdp_open(struct cellular *modem, const char *apn)
     if (!strcmp(response, "+CME ERROR: context already activated"))
         return 0;
 
-    int ip[4];
-    at_simple_scanf(response, "#SGACT: %d.%d.%d.%d", &ip[0], &ip[1], &ip[2], &ip[3]);
+    struct at_tok tok;
+    at_tok_init(&tok, response, strlen(response));
+    at_tok_prefix(&tok, "#SGACT: ");
+    at_tok_int(&tok, NULL);
+    at_tok_char(&tok, '.');
+    at_tok_int(&tok, NULL);
+    at_tok_char(&tok, '.');
+    at_tok_int(&tok, NULL);
+    at_tok_char(&tok, '.');
+    at_tok_int(&tok, NULL);
+    at_simple_tok_check(&tok);
 
     return 0;
 }
 
 static int telit2_pdp_close(struct cellular *modem)
 {
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     at_command_simple(modem->at, "AT#SGACT=1,0");
 
     return 0;
@@ -122,16 +168,13 @@ static int telit2_pdp_close(struct cellular *modem)
 
 static int telit2_op_iccid(struct cellular *modem, char *buf, size_t len)
 {
-    char fmt[24];
-    if (snprintf(fmt, sizeof(fmt), "#CCID: %%[0-9]%ds", (int) len) >= (int) sizeof(fmt)) {
-        errno = ENOSPC;
-        return -1;
-    }
-
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     const char *response = at_command(modem->at, "AT#CCID");
-    at_simple_scanf(response, fmt, buf);
-    buf[len-1] = '\0';
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "#CCID: ");
+    at_tok_digits(&tok, buf, len);
+    at_simple_tok_check(&tok);
 
     return 0;
 }
@@ -141,13 +184,24 @@ static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
     struct tm tm;
     int offset;
 
-    at_set_timeout(modem->at, 1);
+    at_set_timeout_ms(modem->at, 1000);
     const char *response = at_command(modem->at, "AT+CCLK?");
     memset(&tm, 0, sizeof(struct tm));
-    at_simple_scanf(response, "+CCLK: \"%d/%d/%d,%d:%d:%d%d\"",
-            &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
-            &tm.tm_hour, &tm.tm_min, &tm.tm_sec,
-            &offset);
+    struct at_tok tok;
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "+CCLK: \"");
+    at_tok_int(&tok, &tm.tm_year);
+    at_tok_char(&tok, '/');
+    at_tok_int(&tok, &tm.tm_mon);
+    at_tok_char(&tok, '/');
+    at_tok_int(&tok, &tm.tm_mday);
+    at_tok_int(&tok, &tm.tm_hour);
+    at_tok_char(&tok, ':');
+    at_tok_int(&tok, &tm.tm_min);
+    at_tok_char(&tok, ':');
+    at_tok_int(&tok, &tm.tm_sec);
+    at_tok_int(&tok, &offset);
+    at_simple_tok_check(&tok);
 
     /* Most modems report some starting date way in the past when they have
      * no date/time estimation. */
@@ -178,7 +232,7 @@ static int telit2_op_clock_gettime(struct cellular *modem, struct timespec *ts)
 static int telit2_socket_connect(struct cellular *modem, int connid, const char *host, uint16_t port)
 {
     /* Reset socket configuration to default. */
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     at_command_simple(modem->at, "AT#SCFGEXT=%d,0,0,0,0,0", connid);
     at_command_simple(modem->at, "AT#SCFGEXT2=%d,0,0,0,0,0", connid);
 
@@ -193,7 +247,7 @@ static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void
     (void) flags;
 
     /* Request transmission. */
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     at_expect_dataprompt(modem->at);
     at_command_simple(modem->at, "AT#SSENDEXT=%d,%zu", connid, amount);
 
@@ -203,18 +257,6 @@ static ssize_t telit2_socket_send(struct cellular *modem, int connid, const void
     return amount;
 }
 
-static enum at_response_type scanner_srecv(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int chunk;
-    if (sscanf(line, "#SRECV: %*d,%d", &chunk) == 1)
-        return AT_RESPONSE_RAWDATA_FOLLOWS(chunk);
-
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buffer, size_t length, int flags)
 {
     (void) flags;
@@ -222,37 +264,32 @@ static ssize_t telit2_socket_recv(struct cellular *modem, int connid, void *buff
     int cnt = 0;
     while (cnt < (int) length) {
         int chunk = (int) length - cnt;
-        /* Limit read size to avoid overflowing AT response buffer. */
-        if (chunk > 128)
-            chunk = 128;
+        /* Limit read size to the modem's maximum. */
+        if (chunk > TELIT2_SRECV_MAX)
+            chunk = TELIT2_SRECV_MAX;
 
-        /* Perform the read. */
-        at_set_timeout(modem->at, 150);
+        /* Perform the read. Payload goes straight into the result buffer. */
+        at_set_timeout_ms(modem->at, 150000);
         at_set_command_scanner(modem->at, scanner_srecv);
+        at_set_data_sink(modem->at, (char *)buffer + cnt, chunk);
         const char *response = at_command(modem->at, "AT#SRECV=%d,%d", connid, chunk);
         if (response == NULL)
             return -1;
 
-        /* Find the header line. */
-        int bytes;
-        at_simple_scanf(response, "#SRECV: %*d,%d", &bytes);
-
         /* Bail out if we're out of data. Message is misleading. */
         /* FIXME: We should maybe block until we receive something? */
         if (!strcmp(response, "+CME ERROR: activation failed"))
             break;
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            errno = EPROTO;
-            return -1;
-        }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy((char *)buffer + cnt, data, bytes);
-        cnt += bytes;
+        /* Find the header line. */
+        struct at_tok tok;
+        at_simple_tok_init(&tok, response);
+        at_tok_prefix(&tok, "#SRECV: ");
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, NULL);
+        at_simple_tok_check(&tok);
+
+        cnt += at_data_sink_used(modem->at);
     }
 
     return cnt;
@@ -262,17 +299,27 @@ static int telit2_socket_waitack(struct cellular *modem, int connid)
 {
     const char *response;
 
-    at_set_timeout(modem->at, 5);
+    at_set_timeout_ms(modem->at, 5000);
     for (int i=0; i<TELIT2_WAITACK_TIMEOUT; i++) {
         /* Read number of bytes waiting. */
         int ack_waiting;
         response = at_command(modem->at, "AT#SI=%d", connid);
-        at_simple_scanf(response, "#SI: %*d,%*d,%*d,%*d,%d", &ack_waiting);
+        struct at_tok tok;
+        at_simple_tok_init(&tok, response);
+        at_tok_prefix(&tok, "#SI: ");
+        for (int field=0; field<4; field++)
+            at_tok_int(&tok, NULL);
+        at_tok_int(&tok, &ack_waiting);
+        at_simple_tok_check(&tok);
 
         /* ack_waiting is meaningless if socket is not connected. Check this. */
         int socket_status;
         response = at_command(modem->at, "AT#SS=%d", connid);
-        at_simple_scanf(response, "#SS: %*d,%d", &socket_status);
+        at_simple_tok_init(&tok, response);
+        at_tok_prefix(&tok, "#SS: ");
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, &socket_status);
+        at_simple_tok_check(&tok);
         if (socket_status == 0) {
             errno = ECONNRESET;
             return -1;
@@ -291,7 +338,7 @@ static int telit2_socket_waitack(struct cellular *modem, int connid)
 
 static int telit2_socket_close(struct cellular *modem, int connid)
 {
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     at_command_simple(modem->at, "AT#SH=%d", connid);
 
     return 0;
@@ -306,37 +353,29 @@ static int telit2_ftp_open(struct cellular *modem, const char *host, uint16_t po
 
 static int telit2_ftp_get(struct cellular *modem, const char *filename)
 {
-    at_set_timeout(modem->at, 90);
+    at_set_timeout_ms(modem->at, 90000);
     at_command_simple(modem->at, "AT#FTPGETPKT=\"%s\",0", filename);
 
     return 0;
 }
 
-static enum at_response_type scanner_ftprecv(const char *line, size_t len, void *arg)
-{
-    (void) len;
-    (void) arg;
-
-    int bytes;
-    if (sscanf(line, "#FTPRECV: %d", &bytes) == 1)
-        return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
-    return AT_RESPONSE_UNKNOWN;
-}
-
 static int telit2_ftp_getdata(struct cellular *modem, char *buffer, size_t length)
 {
     /* FIXME: This function's flow is really ugly. */
     int retries = 0;
 retry:
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     at_set_command_scanner(modem->at, scanner_ftprecv);
+    at_set_data_sink(modem->at, buffer, length);
     const char *response = at_command(modem->at, "AT#FTPRECV=%zu", length);
 
     if (response == NULL)
         return -1;
 
+    struct at_tok tok;
     int bytes;
-    if (sscanf(response, "#FTPRECV: %d", &bytes) == 1) {
+    at_tok_init(&tok, response, strlen(response));
+    if (at_tok_prefix(&tok, "#FTPRECV: ") && at_tok_int(&tok, &bytes)) {
         /* Zero means no data is available. Wait for it. */
         if (bytes == 0) {
             /* Bail out on timeout. */
@@ -348,41 +387,20 @@ retry:
             goto retry;
         }
 
-        /* Locate the payload. */
-        const char *data = strchr(response, '\n');
-        if (data == NULL) {
-            errno = EPROTO;
-            return -1;
-        }
-        data += 1;
-
-        /* Copy payload to result buffer. */
-        memcpy(buffer, data, bytes);
-        return bytes;
+        /* Payload was delivered straight into the result buffer. */
+        return at_data_sink_used(modem->at);
     }
 
     /* Error or EOF? */
     int eof;
     response = at_command(modem->at, "AT#FTPGETPKT?");
     /* Expected response: #FTPGETPKT: <remotefile>,<viewMode>,<eof> */
-#if 0
-    /* The %[] specifier is not supported on some embedded systems. */
-    at_simple_scanf(response, "#FTPGETPKT: %*[^,],%*d,%d", &eof);
-#else
-    /* Parse manually. */
-    if (response == NULL)
-        return -1;
-    errno = EPROTO;
-    /* Check the initial part of the response. */
-    if (strncmp(response, "#FTPGETPKT: ", 12))
-        return -1;
-    /* Skip the filename. */
-    response = strchr(response, ',');
-    if (response == NULL)
-        return -1;
-    response++;
-    at_simple_scanf(response, "%*d,%d", &eof);
-#endif
+    at_simple_tok_init(&tok, response);
+    at_tok_prefix(&tok, "#FTPGETPKT: ");
+    at_tok_skip(&tok);
+    at_tok_int(&tok, NULL);
+    at_tok_int(&tok, &eof);
+    at_simple_tok_check(&tok);
 
     if (eof == 1)
         return 0;
@@ -395,7 +413,7 @@ static int telit2_locate(struct cellular *modem, float *latitude, float *longitu
     struct cellular_telit2 *priv = (struct cellular_telit2 *) modem;
 
     priv->locate_status = -1;
-    at_set_timeout(modem->at, 150);
+    at_set_timeout_ms(modem->at, 150000);
     cellular_command_simple_pdp(modem, "AT#AGPSSND");
 
     for (int i=0; i<TELIT2_LOCATE_TIMEOUT; i++) {
@@ -418,7 +436,7 @@ static int telit2_locate(struct cellular *modem, float *latitude, float *longitu
 
 static int telit2_ftp_close(struct cellular *modem)
 {
-    at_set_timeout(modem->at, 90);
+    at_set_timeout_ms(modem->at, 90000);
     at_command_simple(modem->at, "AT#FTPCLOSE");
 
     return 0;
@@ -449,6 +467,16 @@ static const struct cellular_ops telit2_ops = {
     .locate = telit2_locate,
 };
 
+struct cellular *cellular_telit2_init(struct cellular_telit2 *modem)
+{
+    memset(modem, 0, sizeof(*modem));
+
+    modem->dev.ops = &telit2_ops;
+
+    return (struct cellular *) modem;
+}
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct cellular *cellular_telit2_alloc(void)
 {
     struct cellular_telit2 *modem = malloc(sizeof(struct cellular_telit2));
@@ -456,16 +484,14 @@ struct cellular *cellular_telit2_alloc(void)
         errno = ENOMEM;
         return NULL;
     }
-    memset(modem, 0, sizeof(*modem));
-
-    modem->dev.ops = &telit2_ops;
 
-    return (struct cellular *) modem;
+    return cellular_telit2_init(modem);
 }
 
 void cellular_telit2_free(struct cellular *modem)
 {
     free(modem);
 }
+#endif
 
 /* vim: set ts=4 sw=4 et: */
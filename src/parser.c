@@ -7,17 +7,26 @@
  */
 
 #include <attentive/parser.h>
+#include <attentive/at-hex.h>
 
 #include <stdio.h>
 #include <string.h>
 
 
-static const char *const final_ok_responses[] = {
-    "OK",
-    NULL
-};
+/* Line length up to which a line can always be read, even if the response
+ * has to be cut short for it; enough to recognize final result codes. Small
+ * buffers reserve a quarter of their size instead. */
+#define PARSER_LINE_RESERVE 16
+
+/* Bytes decoded per step from a hex data block. */
+#define PARSER_HEX_BLOCK 64
+
+/* Bytes passed per call to a span handler. */
+#define PARSER_SPAN_MAX 64
 
-static const char *const final_responses[] = {
+/* Checked in order; the first match wins. */
+static const char *const generic_responses[] = {
+    "RING",
     "OK",
     "ERROR",
     "NO CARRIER",
@@ -26,11 +35,16 @@ static const char *const final_responses[] = {
     NULL
 };
 
-static const char *const urc_responses[] = {
-    "RING",
-    NULL
+static const enum at_response_type generic_response_types[] = {
+    AT_RESPONSE_URC,
+    AT_RESPONSE_FINAL_OK,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
+    AT_RESPONSE_FINAL,
 };
 
+#if !defined(ATTENTIVE_NO_MALLOC)
 struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t bufsize, void *priv)
 {
     /* Allocate parser struct. */
@@ -49,16 +63,24 @@ struct at_parser *at_parser_alloc(const struct at_parser_callbacks *cbs, size_t
     }
 
     at_parser_init(parser, cbs, buf, bufsize, priv);
+    parser->buf_owned = true;
 
     return parser;
 }
+#endif
 
 void at_parser_init(struct at_parser *parser, const struct at_parser_callbacks *cbs, void *buf, size_t bufsize, void *priv)
 {
     parser->cbs = cbs;
     parser->buf = buf;
     parser->buf_size = bufsize;
+    parser->buf_limit = 0;
+    parser->buf_owned = false;
     parser->priv = priv;
+    parser->clock = NULL;
+    parser->trace = NULL;
+    at_prefix_matcher_init(&parser->generic, generic_responses);
+    at_parser_reset_stats(parser);
 
     /* Prepare instance. */
     at_parser_reset(parser);
@@ -67,35 +89,196 @@ void at_parser_init(struct at_parser *parser, const struct at_parser_callbacks *
 void at_parser_reset(struct at_parser *parser)
 {
     parser->state = STATE_IDLE;
-    parser->expect_dataprompt = false;
+    memset(&parser->next, 0, sizeof(parser->next));
+    parser->command_head = 0;
+    parser->command_count = 0;
+    parser->held = false;
+    parser->buf_start = 0;
     parser->buf_used = 0;
     parser->buf_current = 0;
     parser->data_left = 0;
+    parser->overflow = false;
+    parser->line_overflow = false;
+    parser->line_count = 0;
     parser->character_handler = NULL;
+    parser->span_handler = NULL;
+    parser->sink = NULL;
+    parser->sink_size = 0;
+    parser->sink_used = 0;
+    parser->echo = NULL;
 }
 
 void at_parser_set_character_handler(struct at_parser *parser, at_character_handler_t handler)
 {
-    parser->character_handler = handler;
+    parser->next.character_handler = handler;
+}
+
+void at_parser_set_span_handler(struct at_parser *parser, at_span_handler_t handler)
+{
+    parser->next.span_handler = handler;
 }
 
 void at_parser_expect_dataprompt(struct at_parser *parser)
 {
-    parser->expect_dataprompt = true;
+    parser->next.dataprompt = true;
+}
+
+void at_parser_set_data_sink(struct at_parser *parser, void *buf, size_t size)
+{
+    parser->next.sink = buf;
+    parser->next.sink_size = size;
+}
+
+void at_parser_expect_echo(struct at_parser *parser, const void *data, size_t len)
+{
+    parser->next.echo = data;
+    parser->next.echo_len = len;
+}
+
+size_t at_parser_data_sink_used(const struct at_parser *parser)
+{
+    return parser->sink_used;
+}
+
+int at_parser_set_buffer_limit(struct at_parser *parser, size_t limit)
+{
+    /* Only buffers allocated by at_parser_alloc() can be resized. */
+    if (!parser->buf_owned || (limit != 0 && limit < parser->buf_size)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    parser->buf_limit = limit;
+    return 0;
+}
+
+bool at_parser_overflow(const struct at_parser *parser)
+{
+    return parser->overflow;
+}
+
+const struct at_response_line *at_parser_response_lines(const struct at_parser *parser, size_t *count)
+{
+    *count = parser->line_count;
+    return parser->lines;
+}
+
+void at_parser_set_clock(struct at_parser *parser, at_parser_clock_t clock)
+{
+    parser->clock = clock;
+}
+
+void at_parser_set_trace(struct at_parser *parser, struct at_trace *trace)
+{
+    parser->trace = trace;
+}
+
+void at_parser_get_stats(const struct at_parser *parser, struct at_parser_stats *stats)
+{
+    *stats = parser->stats;
+}
+
+void at_parser_reset_stats(struct at_parser *parser)
+{
+    memset(&parser->stats, 0, sizeof(parser->stats));
+}
+
+static uint32_t parser_clock(const struct at_parser *parser)
+{
+    return parser->clock ? parser->clock() : 0;
+}
+
+/**
+ * Start collecting the response to the oldest queued command, if any.
+ */
+static void parser_next_command(struct at_parser *parser)
+{
+    if (parser->command_count == 0) {
+        parser->state = parser->held ? STATE_RESPONSE_PENDING : STATE_IDLE;
+        parser->character_handler = NULL;
+        parser->span_handler = NULL;
+        parser->sink = NULL;
+        parser->echo = NULL;
+        return;
+    }
+
+    const struct at_parser_command *command = &parser->commands[parser->command_head];
+    parser->character_handler = command->character_handler;
+    parser->span_handler = command->span_handler;
+    parser->sink = command->sink;
+    parser->sink_size = command->sink_size;
+    parser->sink_used = 0;
+    parser->echo = command->echo_len > 0 ? command->echo : NULL;
+    parser->echo_len = command->echo_len;
+    parser->echo_matched = 0;
+    parser->echo_skip = false;
+    parser->overflow = false;
+    parser->line_count = 0;
+    parser->state = (command->dataprompt ? STATE_DATAPROMPT : STATE_READLINE);
+}
+
+void at_parser_take_next(struct at_parser *parser, struct at_parser_command *command)
+{
+    *command = parser->next;
+    memset(&parser->next, 0, sizeof(parser->next));
 }
 
 void at_parser_await_response(struct at_parser *parser)
 {
-    /* Preserve fields that may have been set before this call. */
-    bool expect_dataprompt = parser->expect_dataprompt;
-    at_character_handler_t character_handler = parser->character_handler;
+    /* Take over the settings made for this command. */
+    struct at_parser_command command;
+    at_parser_take_next(parser, &command);
+    command.hold = true;
 
     /* Release any pending response before starting a new command. */
     at_parser_release_response(parser);
 
-    parser->expect_dataprompt = expect_dataprompt;
-    parser->character_handler = character_handler;
-    parser->state = (expect_dataprompt ? STATE_DATAPROMPT : STATE_READLINE);
+    parser->command_head = 0;
+    parser->command_count = 0;
+    at_parser_queue_command(parser, &command);
+}
+
+int at_parser_queue_command(struct at_parser *parser, const struct at_parser_command *command)
+{
+    if (parser->command_count == AT_PARSER_COMMANDS_MAX) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    size_t slot = (parser->command_head + parser->command_count) % AT_PARSER_COMMANDS_MAX;
+    parser->commands[slot] = *command;
+    parser->command_count++;
+
+    /* Start right away if nothing else is being collected. */
+    if (parser->command_count == 1)
+        parser_next_command(parser);
+
+    return 0;
+}
+
+size_t at_parser_queued_commands(const struct at_parser *parser)
+{
+    return parser->command_count;
+}
+
+void at_parser_cancel_commands(struct at_parser *parser)
+{
+    /* The line index belongs to the response being dropped. */
+    if (parser->command_count > 0)
+        parser->line_count = 0;
+    parser->command_head = 0;
+    parser->command_count = 0;
+    parser->data_left = 0;
+    parser->overflow = false;
+    parser->line_overflow = false;
+
+    /* Drop everything received after the held response, if any. */
+    if (!parser->held)
+        parser->buf_start = 0;
+    parser->buf_current = parser->buf_start;
+    parser->buf_used = parser->buf_start;
+
+    parser_next_command(parser);
 }
 
 bool at_prefix_in_table(const char *line, const char *const table[])
@@ -107,51 +290,348 @@ bool at_prefix_in_table(const char *line, const char *const table[])
     return false;
 }
 
-static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
+/**
+ * Pack up to four leading bytes of a string into a word.
+ */
+static uint32_t prefix_head(const char *s, size_t len)
 {
-    (void) len;
+    uint32_t head = 0;
+    for (size_t i=0; i<len && i<4; i++)
+        head |= (uint32_t) (uint8_t) s[i] << (8*i);
+    return head;
+}
+
+int at_prefix_matcher_init(struct at_prefix_matcher *matcher, const char *const table[])
+{
+    size_t count = 0;
+    while (table[count] != NULL)
+        count++;
+
+    if (count > AT_PREFIX_MATCHER_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    matcher->table = table;
+    matcher->empty = -1;
+
+    /* Count prefixes per first byte. */
+    size_t bucket[257] = {0};
+    for (size_t i=0; i<count; i++) {
+        size_t len = strlen(table[i]);
+        if (len > UINT8_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        matcher->length[i] = len;
+        matcher->head[i] = prefix_head(table[i], len);
+        matcher->mask[i] = (len >= 4) ? UINT32_MAX : ((uint32_t) 1 << (8*len)) - 1;
+
+        if (len == 0) {
+            if (matcher->empty == -1)
+                matcher->empty = i;
+        } else {
+            bucket[(uint8_t) table[i][0] + 1]++;
+        }
+    }
+
+    /* Turn counts into bucket offsets. */
+    for (int b=0; b<256; b++)
+        bucket[b+1] += bucket[b];
+    for (int b=0; b<257; b++)
+        matcher->start[b] = bucket[b];
+
+    /* Fill the buckets, keeping table order within each of them. */
+    for (size_t i=0; i<count; i++)
+        if (matcher->length[i] > 0)
+            matcher->order[bucket[(uint8_t) table[i][0]]++] = i;
+
+    return 0;
+}
+
+int at_prefix_match(const struct at_prefix_matcher *matcher, const char *line, size_t len)
+{
+    if (len > 0) {
+        uint8_t b = line[0];
+        uint32_t head = prefix_head(line, len);
+        for (int i=matcher->start[b]; i<matcher->start[b+1]; i++) {
+            int index = matcher->order[i];
+            if ((head & matcher->mask[index]) == matcher->head[index] &&
+                matcher->length[index] <= len &&
+                !memcmp(line, matcher->table[index], matcher->length[index]))
+            {
+                if (matcher->empty != -1 && matcher->empty < index)
+                    return matcher->empty;
+                return index;
+            }
+        }
+    }
+
+    return matcher->empty;
+}
+
+/**
+ * Get the command whose response is being collected, if any.
+ */
+static const struct at_parser_command *parser_command(const struct at_parser *parser)
+{
+    if (parser->command_count == 0)
+        return NULL;
+    return &parser->commands[parser->command_head];
+}
 
+static enum at_response_type generic_line_scanner(const char *line, size_t len, struct at_parser *parser)
+{
     if (parser->state == STATE_DATAPROMPT)
         if (len == 2 && !memcmp(line, "> ", 2))
             return AT_RESPONSE_FINAL_OK;
 
-    if (at_prefix_in_table(line, urc_responses))
-        return AT_RESPONSE_URC;
-    else if (at_prefix_in_table(line, final_ok_responses))
-        return AT_RESPONSE_FINAL_OK;
-    else if (at_prefix_in_table(line, final_responses))
-        return AT_RESPONSE_FINAL;
+    int index = at_prefix_match(&parser->generic, line, len);
+    if (index >= 0)
+        return generic_response_types[index];
     else
         return AT_RESPONSE_INTERMEDIATE;
 }
 
+/**
+ * Free space at the end of the buffer, keeping one byte for the terminator.
+ * A response pending right at the end of the buffer leaves none at all.
+ */
+static size_t parser_space(const struct at_parser *parser)
+{
+    if (parser->buf_used >= parser->buf_size-1)
+        return 0;
+    return parser->buf_size-1 - parser->buf_used;
+}
+
+/**
+ * Move the current response back to the start of the buffer.
+ *
+ * Releasing a response leaves any partially received line in place, so the
+ * next response may start anywhere in the buffer. It only gets moved back
+ * once the space behind it runs out, and never while a held response has
+ * to stay put.
+ */
+static void parser_compact(struct at_parser *parser)
+{
+    if (parser->buf_start == 0 || parser->held)
+        return;
+
+    memmove(parser->buf, parser->buf + parser->buf_start, parser->buf_used - parser->buf_start);
+    parser->buf_used -= parser->buf_start;
+    parser->buf_current -= parser->buf_start;
+    parser->buf_start = 0;
+}
+
+/**
+ * Grow the buffer to fit at least len more bytes, up to the configured limit.
+ * Like compaction, this is not allowed while a response is pending.
+ */
+static void parser_grow(struct at_parser *parser, size_t len)
+{
+#if defined(ATTENTIVE_NO_MALLOC)
+    /* No buffer is ever owned by the parser, so none can grow. */
+    (void) parser;
+    (void) len;
+#else
+    if (parser->buf_limit <= parser->buf_size || parser->held)
+        return;
+
+    /* Always double, so the resulting size doesn't depend on how the data
+     * was split into feeds. */
+    size_t size = parser->buf_size * 2;
+    while (size < parser->buf_used + len + 1)
+        size *= 2;
+    if (size > parser->buf_limit)
+        size = parser->buf_limit;
+
+    char *buf = realloc(parser->buf, size);
+    if (buf == NULL)
+        return;
+
+    parser->buf = buf;
+    parser->buf_size = size;
+#endif
+}
+
+/**
+ * Make room for the beginning of a line by dropping trailing lines of the
+ * response collected so far. Only done while a response is being collected,
+ * so that a full buffer doesn't hide the final result code.
+ */
+static void parser_evict(struct at_parser *parser, size_t len)
+{
+    if (parser->state != STATE_READLINE && parser->state != STATE_DATAPROMPT)
+        return;
+
+    size_t reserve = parser->buf_size/4;
+    if (reserve > PARSER_LINE_RESERVE)
+        reserve = PARSER_LINE_RESERVE;
+
+    /* Only guarantee room for the first few bytes of the line. */
+    size_t line = parser->buf_used - parser->buf_current;
+    if (line >= reserve)
+        return;
+    if (len > reserve - line)
+        len = reserve - line;
+
+    size_t space = parser_space(parser);
+    if (len <= space)
+        return;
+    len -= space;
+
+    size_t room = parser->buf_current - parser->buf_start;
+    if (len > room)
+        len = room;
+    if (len == 0)
+        return;
+
+    /* Only drop whole lines. */
+    size_t current = parser->buf_current - len;
+    while (current > parser->buf_start && parser->buf[current-1] != '\n')
+        current--;
+
+    /* Data blocks may contain newlines of their own; drop those whole too,
+     * and forget about everything dropped. */
+    size_t offset = current - parser->buf_start;
+    while (parser->line_count > 0) {
+        const struct at_response_line *last = &parser->lines[parser->line_count-1];
+        if (last->offset + last->length < offset)
+            break;
+        if (last->offset < offset)
+            offset = last->offset;
+        parser->line_count--;
+    }
+    current = parser->buf_start + offset;
+
+    memmove(parser->buf + current, parser->buf + parser->buf_current, line);
+    parser->stats.bytes_dropped += parser->buf_current - current;
+    parser->buf_used -= parser->buf_current - current;
+    parser->buf_current = current;
+    parser->overflow = true;
+}
+
+/**
+ * Make room for len more bytes, if possible.
+ *
+ * @returns Number of bytes that can be appended, at most len.
+ */
+static size_t parser_reserve(struct at_parser *parser, size_t len)
+{
+    if (len > parser_space(parser)) {
+        parser_compact(parser);
+        if (len > parser_space(parser))
+            parser_grow(parser, len);
+        if (len > parser_space(parser))
+            parser_evict(parser, len);
+    }
+
+    size_t space = parser_space(parser);
+    if (len > space) {
+        /* Out of room; the excess will be dropped. */
+        parser->line_overflow = true;
+        parser->stats.bytes_dropped += len - space;
+        len = space;
+    }
+
+    return len;
+}
+
 static void parser_append(struct at_parser *parser, char ch)
 {
-    if (parser->buf_used < parser->buf_size-1)
+    if (parser_reserve(parser, 1))
         parser->buf[parser->buf_used++] = ch;
 }
 
-static void parser_include_line(struct at_parser *parser)
+static void parser_append_bytes(struct at_parser *parser, const void *data, size_t len)
 {
+    len = parser_reserve(parser, len);
+
+    memcpy(parser->buf + parser->buf_used, data, len);
+    parser->buf_used += len;
+}
+
+static void parser_include_line(struct at_parser *parser, bool data)
+{
+    /* Record the line in the index, as long as it can be addressed. */
+    size_t offset = parser->buf_current - parser->buf_start;
+    size_t length = parser->buf_used - parser->buf_current;
+    if (parser->line_count < AT_RESPONSE_LINES_MAX && offset + length <= UINT16_MAX) {
+        struct at_response_line *entry = &parser->lines[parser->line_count++];
+        entry->offset = offset;
+        entry->length = length;
+        entry->data = data;
+    }
+
     /* Append a newline. */
     parser_append(parser, '\n');
 
     /* Advance the current command pointer to the new position. */
     parser->buf_current = parser->buf_used;
+
+    /* A truncated line makes for a truncated response. */
+    parser->overflow |= parser->line_overflow;
+    parser->line_overflow = false;
+}
+
+static void parser_store_data(struct at_parser *parser, const void *data, size_t len)
+{
+    if (!parser->sink) {
+        parser_append_bytes(parser, data, len);
+        return;
+    }
+
+    /* Data sink in use; bypass the response buffer. Excess data is dropped. */
+    size_t space = parser->sink_size - parser->sink_used;
+    if (len > space) {
+        parser->line_overflow = true;
+        parser->stats.bytes_dropped += len - space;
+        len = space;
+    }
+
+    memcpy(parser->sink + parser->sink_used, data, len);
+    parser->sink_used += len;
+}
+
+static void parser_end_data(struct at_parser *parser)
+{
+    /* Terminate the data block unless it went to the sink. */
+    if (!parser->sink) {
+        parser_include_line(parser, true);
+    } else {
+        parser->overflow |= parser->line_overflow;
+        parser->line_overflow = false;
+    }
+
+    parser->state = STATE_READLINE;
 }
 
 static void parser_discard_line(struct at_parser *parser)
 {
     /* Rewind the end pointer back to the previous position. */
     parser->buf_used = parser->buf_current;
+    parser->line_overflow = false;
 }
 
 static void parser_finalize(struct at_parser *parser)
 {
-    /* Remove the last newline, if any. */
-    if (parser->buf_used > 0)
+    /* Remove the last newline, if any. It's missing if the response was cut
+     * short, in which case the last indexed line may be too. */
+    if (parser->buf_used > parser->buf_start && parser->buf[parser->buf_used-1] == '\n')
         parser->buf_used--;
 
+    size_t len = parser->buf_used - parser->buf_start;
+    while (parser->line_count > 0) {
+        struct at_response_line *last = &parser->lines[parser->line_count-1];
+        if (last->offset + last->length <= len)
+            break;
+        if (last->offset < len) {
+            last->length = len - last->offset;
+            break;
+        }
+        parser->line_count--;
+    }
+
     /* NULL-terminate the response. */
     parser->buf[parser->buf_used] = '\0';
 }
@@ -161,9 +641,15 @@ static void parser_finalize(struct at_parser *parser)
  */
 static void parser_handle_line(struct at_parser *parser)
 {
-    /* Skip empty lines. */
-    if (parser->buf_used == parser->buf_current)
+    /* Echo may show up at the start of the next line. */
+    parser->echo_skip = false;
+
+    /* Skip empty lines. A line that didn't fit at all is lost as well. */
+    if (parser->buf_used == parser->buf_current) {
+        parser->overflow |= parser->line_overflow;
+        parser->line_overflow = false;
         return;
+    }
 
     /* NULL-terminate the response .*/
     parser->buf[parser->buf_used] = '\0';
@@ -171,6 +657,7 @@ static void parser_handle_line(struct at_parser *parser)
     /* Extract line address & length for later use. */
     const char *line = parser->buf + parser->buf_current;
     size_t len = parser->buf_used - parser->buf_current;
+    parser->stats.lines++;
 
 #if defined(ATTENTIVE_DEBUG)
     /* Log the received line. */
@@ -178,20 +665,32 @@ static void parser_handle_line(struct at_parser *parser)
 #endif
 
     /* Determine response type. */
+    const struct at_parser_command *command = parser_command(parser);
     enum at_response_type type = AT_RESPONSE_UNKNOWN;
-    if (parser->cbs->scan_line)
+    if (command && command->scan_line)
+        type = command->scan_line(line, len, parser->priv);
+    if (!type && parser->cbs->scan_line)
         type = parser->cbs->scan_line(line, len, parser->priv);
     if (!type)
         type = generic_line_scanner(line, len, parser);
 
+    at_trace_record(parser->trace, AT_TRACE_LINE,
+                    type < 0 ? type : (int) (type & _AT_RESPONSE_TYPE_MASK), line, len);
+
     /* Expected URCs and all unexpected lines are sent to URC handler. */
     if (type == AT_RESPONSE_URC || parser->state == STATE_IDLE ||
         parser->state == STATE_RESPONSE_PENDING)
     {
+        parser->stats.urcs++;
+        if (type != AT_RESPONSE_URC)
+            parser->stats.unexpected++;
+
         /* Fire the callback on the URC line. */
+        uint32_t started = parser_clock(parser);
         parser->cbs->handle_urc(parser->buf + parser->buf_current,
                                 parser->buf_used - parser->buf_current,
                                 parser->priv);
+        parser->stats.callback_time += parser_clock(parser) - started;
 
         /* Discard the URC line from the buffer. */
         parser_discard_line(parser);
@@ -205,7 +704,7 @@ static void parser_handle_line(struct at_parser *parser)
         parser_discard_line(parser);
     } else {
         /* Include the line in the buffer. */
-        parser_include_line(parser);
+        parser_include_line(parser, false);
     }
 
     /* Act on the response type. */
@@ -213,16 +712,38 @@ static void parser_handle_line(struct at_parser *parser)
         case AT_RESPONSE_FINAL_OK:
         case AT_RESPONSE_FINAL:
         {
-            /* Fire the response callback. */
+            /* Fire the response callback. The command stays queued meanwhile,
+             * so that commands queued from the callback don't start yet. */
+            struct at_parser_command done = *command;
             parser_finalize(parser);
-            parser->cbs->handle_response(parser->buf, parser->buf_used, parser->priv);
-
-            /* Enter pending state - response buffer remains stable until released.
-             * URCs will use buffer space after the response. */
-            parser->buf_current = parser->buf_used + 1;
-            parser->buf_used = parser->buf_current;
-            parser->state = STATE_RESPONSE_PENDING;
-            parser->expect_dataprompt = false;
+            parser->stats.responses++;
+            uint32_t started = parser_clock(parser);
+            if (done.handle_response)
+                done.handle_response(parser->buf + parser->buf_start,
+                                     parser->buf_used - parser->buf_start,
+                                     done.arg);
+            else
+                parser->cbs->handle_response(parser->buf + parser->buf_start,
+                                             parser->buf_used - parser->buf_start,
+                                             parser->priv);
+            parser->stats.callback_time += parser_clock(parser) - started;
+
+            parser->command_head = (parser->command_head + 1) % AT_PARSER_COMMANDS_MAX;
+            parser->command_count--;
+
+            if (done.hold) {
+                /* Response buffer remains stable until released. URCs and
+                 * further responses will use buffer space after it. */
+                parser->buf_used++;
+                parser->buf_start = parser->buf_used;
+                parser->held = true;
+            } else {
+                /* The response is no longer needed. */
+                parser->buf_used = parser->buf_start;
+            }
+            parser->buf_current = parser->buf_used;
+
+            parser_next_command(parser);
         }
         break;
 
@@ -251,25 +772,220 @@ static void parser_handle_line(struct at_parser *parser)
     }
 }
 
-static int hex2int(char c)
+/**
+ * Handle a single character in one of the line-reading states.
+ */
+static void parser_feed_char(struct at_parser *parser, uint8_t ch)
 {
-    if (c >= '0' && c <= '9')
-        return c - '0';
-    if (c >= 'A' && c <= 'F')
-        return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f')
-        return c - 'a' + 10;
-    return -1;
+    if ((ch != '\r') && (ch != '\n')) {
+        /* Append the character if it's not a newline. */
+        parser_append(parser, ch);
+    }
+
+    /* Handle full lines. */
+    if ((ch == '\n') ||
+        (parser->state == STATE_DATAPROMPT &&
+         parser->buf_used - parser->buf_current == 2 &&
+         !memcmp(parser->buf + parser->buf_current, "> ", 2)))
+    {
+        parser_handle_line(parser);
+    }
 }
 
-void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
+/**
+ * Consume line data up to and including the next newline.
+ *
+ * Lines are collected a whole run at a time; the per-character path is only
+ * taken when a dataprompt is expected, as the prompt isn't followed by a
+ * newline.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_line(struct at_parser *parser, const uint8_t *data, size_t len)
 {
-    const uint8_t *buf = data;
+    if (parser->state == STATE_DATAPROMPT) {
+        parser_feed_char(parser, *data);
+        return 1;
+    }
+
+    const uint8_t *newline = memchr(data, '\n', len);
+    size_t span = newline ? (size_t) (newline - data) : len;
+
+    /* Append everything except carriage returns. */
+    const uint8_t *p = data;
+    size_t left = span;
+    while (left > 0) {
+        const uint8_t *cr = memchr(p, '\r', left);
+        size_t run = cr ? (size_t) (cr - p) : left;
+        parser_append_bytes(parser, p, run);
+        if (cr)
+            run++;
+        p += run;
+        left -= run;
+    }
+
+    if (!newline)
+        return span;
+
+    parser_handle_line(parser);
+    return span + 1;
+}
+
+/**
+ * Consume raw data bytes.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_rawdata(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    size_t amount = (len < parser->data_left) ? len : parser->data_left;
+    parser_store_data(parser, data, amount);
+    parser->data_left -= amount;
+    parser->stats.rawdata_bytes += amount;
+
+    if (parser->data_left == 0)
+        parser_end_data(parser);
+
+    return amount;
+}
+
+/**
+ * Consume hex-escaped data bytes.
+ *
+ * Runs of digit pairs go through the block decoder; separators and nibbles
+ * split across feeds are handled one character at a time.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_hexdata(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    size_t used = 0;
+
+    while (used < len && parser->data_left > 0) {
+        if (parser->nibble == -1) {
+            uint8_t block[PARSER_HEX_BLOCK];
+            size_t amount = (len - used) / 2;
+            if (amount > parser->data_left)
+                amount = parser->data_left;
+            if (amount > sizeof(block))
+                amount = sizeof(block);
+
+            amount = at_hex_decode(block, (const char *) data + used, 2*amount);
+            if (amount > 0) {
+                parser_store_data(parser, block, amount);
+                parser->data_left -= amount;
+                parser->stats.hexdata_bytes += amount;
+                used += 2*amount;
+                continue;
+            }
+        }
+
+        int value = at_hex_value(data[used++]);
+        if (value != -1) {
+            if (parser->nibble == -1) {
+                parser->nibble = value;
+            } else {
+                uint8_t byte = value | (parser->nibble << 4);
+                parser->nibble = -1;
+                parser_store_data(parser, &byte, 1);
+                parser->data_left--;
+                parser->stats.hexdata_bytes++;
+            }
+        }
+    }
+
+    if (parser->data_left == 0)
+        parser_end_data(parser);
+
+    return used;
+}
+
+static void parser_dispatch(struct at_parser *parser, const uint8_t *buf, size_t len, bool filter);
+
+/**
+ * Run line data through the span handler and parse what it leaves. Per-
+ * character handlers are adapted to a span handler taking a single byte,
+ * as they expect the line to be updated after each of them.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_filtered(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    char out[PARSER_SPAN_MAX];
 
+    /* Stop at a newline, so that a handler sees one line at a time and
+     * data following the line doesn't get filtered. A dataprompt ends a
+     * response without one, so take it a byte at a time then. */
+    if (len > sizeof(out))
+        len = sizeof(out);
+    const uint8_t *newline = memchr(data, '\n', len);
+    if (newline)
+        len = newline - data + 1;
+    if (parser->state == STATE_DATAPROMPT)
+        len = 1;
+
+    char *line = parser->buf + parser->buf_current;
+    size_t line_len = parser->buf_used - parser->buf_current;
+    size_t produced;
+    if (parser->span_handler) {
+        produced = parser->span_handler((const char *) data, len, out, line, line_len, parser->priv);
+        if (produced > len)
+            produced = len;
+    } else {
+        len = 1;
+        out[0] = parser->character_handler(data[0], line, line_len, parser->priv);
+        produced = 1;
+    }
+
+    parser_dispatch(parser, (const uint8_t *) out, produced, false);
+    return len;
+}
+
+/**
+ * Match received data at the start of a line against the expected command
+ * echo. Matched bytes are dropped. On a mismatch, the bytes dropped so far are
+ * parsed after all, and no echo is looked for until the line ends.
+ *
+ * @returns Number of bytes consumed.
+ */
+static size_t parser_feed_echo(struct at_parser *parser, const uint8_t *data, size_t len)
+{
+    const char *expected = parser->echo + parser->echo_matched;
+    size_t left = parser->echo_len - parser->echo_matched;
+    if (len > left)
+        len = left;
+
+    size_t same = 0;
+    while (same < len && data[same] == (uint8_t) expected[same])
+        same++;
+
+    if (same == len) {
+        parser->echo_matched += len;
+        if (parser->echo_matched == parser->echo_len) {
+            parser->stats.echo_bytes += parser->echo_len;
+            parser->echo = NULL;
+        }
+        return len;
+    }
+
+    /* Not an echo; the dropped bytes equal the start of the echo itself. */
+    size_t matched = parser->echo_matched;
+    parser->echo_matched = 0;
+    parser->echo_skip = true;
+    parser_dispatch(parser, (const uint8_t *) parser->echo, matched, true);
+    return 0;
+}
+
+/**
+ * Feed data according to the parser state.
+ *
+ * @param filter Pass line data through the span or character handler.
+ */
+static void parser_dispatch(struct at_parser *parser, const uint8_t *buf, size_t len, bool filter)
+{
     while (len > 0)
     {
-        /* Fetch next character. */
-        uint8_t ch = *buf++; len--;
+        size_t used = 0;
 
         switch (parser->state)
         {
@@ -277,83 +993,58 @@ void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
             case STATE_IDLE:
             case STATE_READLINE:
             case STATE_DATAPROMPT:
-            {
-                /* Handle a single character. */
-                if (parser->character_handler) {
-                    ch = parser->character_handler(ch, parser->buf + parser->buf_current,
-                                                    parser->buf_used - parser->buf_current,
-                                                    parser->priv);
-                }
-
-                if ((ch != '\r') && (ch != '\n')) {
-                    /* Append the character if it's not a newline. */
-                    parser_append(parser, ch);
-                }
-
-                /* Handle full lines. */
-                if ((ch == '\n') ||
-                    (parser->state == STATE_DATAPROMPT &&
-                     parser->buf_used == 2 &&
-                     !memcmp(parser->buf, "> ", 2)))
-                {
-                    parser_handle_line(parser);
-                }
-            }
-            break;
+                if (filter && parser->echo && !parser->echo_skip &&
+                    parser->buf_used == parser->buf_current)
+                    used = parser_feed_echo(parser, buf, len);
+                else if (filter && (parser->span_handler || parser->character_handler))
+                    used = parser_feed_filtered(parser, buf, len);
+                else
+                    used = parser_feed_line(parser, buf, len);
+                break;
 
-            case STATE_RAWDATA: {
-                if (parser->data_left > 0) {
-                    parser_append(parser, ch);
-                    parser->data_left--;
-                }
-
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
-            } break;
-
-            case STATE_HEXDATA: {
-                if (parser->data_left > 0) {
-                    int value = hex2int(ch);
-                    if (value != -1) {
-                        if (parser->nibble == -1) {
-                            parser->nibble = value;
-                        } else {
-                            value |= (parser->nibble << 4);
-                            parser->nibble = -1;
-                            parser_append(parser, value);
-                            parser->data_left--;
-                        }
-                    }
-                }
-
-                if (parser->data_left == 0) {
-                    parser_include_line(parser);
-                    parser->state = STATE_READLINE;
-                }
-            } break;
+            case STATE_RAWDATA:
+                used = parser_feed_rawdata(parser, buf, len);
+                break;
+
+            case STATE_HEXDATA:
+                used = parser_feed_hexdata(parser, buf, len);
+                break;
         }
+
+        buf += used;
+        len -= used;
     }
 }
 
+void at_parser_feed(struct at_parser *parser, const void *data, size_t len)
+{
+    parser->stats.bytes_fed += len;
+    parser_dispatch(parser, data, len, true);
+}
+
+#if !defined(ATTENTIVE_NO_MALLOC)
 void at_parser_free(struct at_parser *parser)
 {
     free(parser->buf);
     free(parser);
 }
+#endif
 
 void at_parser_release_response(struct at_parser *parser)
 {
+    if (!parser->held)
+        return;
+
+    parser->held = false;
     if (parser->state == STATE_RESPONSE_PENDING)
-    {
-        /* Move any pending data to the start of the buffer. */
-        size_t pending = parser->buf_used - parser->buf_current;
-        if (pending > 0)
-            memmove(parser->buf, parser->buf + parser->buf_current, pending);
+        parser->state = STATE_IDLE;
 
-        at_parser_reset(parser);
-        parser->buf_used = pending;
+    /* Anything received since is left where it is; with nothing at all,
+     * start over at the beginning of the buffer. */
+    if (parser->buf_used == parser->buf_start) {
+        parser->buf_start = 0;
+        parser->buf_current = 0;
+        parser->buf_used = 0;
     }
 }
 
@@ -0,0 +1,339 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Transport benchmark. Runs the full at_command() path against a modem
+ * emulator on the other side of a pseudo-terminal, and prints one JSON
+ * object per measurement. The emulator writes each response either in one
+ * go or one byte at a time. URCs are either handled by the reader or queued
+ * and drained after each command, and found either by the application's
+ * line scanner or in a URC registry holding a sim800-sized set of prefixes.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <attentive/at.h>
+#include <attentive/at-unix.h>
+#include <attentive/at-hex.h>
+
+
+/* Commands per measurement: enough for about TARGET_BYTES of responses,
+ * within these bounds. */
+#define TARGET_BYTES (1024*1024)
+#define COMMANDS_MIN 100
+#define COMMANDS_MAX 2000
+
+#define RAWDATA_SIZE 1460
+#define URC_BURST 16
+#define URC_SLOT_SIZE 128
+
+struct emulator {
+    int fd;
+    bool bytewise;
+};
+
+static void emulator_write(struct emulator *emu, const char *data, size_t len)
+{
+    size_t step = emu->bytewise ? 1 : len;
+    for (size_t pos=0; pos<len; pos+=step) {
+        size_t amount = len - pos < step ? len - pos : step;
+        if (write(emu->fd, data + pos, amount) != (ssize_t) amount) {
+            perror("emulator: write");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Build the response to a single command.
+ *
+ * @returns Response length.
+ */
+static size_t emulator_respond(const char *command, char *out)
+{
+    static uint8_t payload[RAWDATA_SIZE];
+    for (int i=0; i<RAWDATA_SIZE; i++)
+        payload[i] = (uint8_t) (i * 31 + 7);
+
+    int n;
+    size_t len = 0;
+    if (!strcmp(command, "AT+CSQ")) {
+        len = sprintf(out, "\r\n+CSQ: 17,0\r\n\r\nOK\r\n");
+    } else if (sscanf(command, "AT+CIPRXGET=2,0,%d", &n) == 1) {
+        len = sprintf(out, "\r\n+CIPRXGET: 2,0,%d,0\r\n", n);
+        memcpy(out + len, payload, n);
+        len += n;
+        len += sprintf(out + len, "\r\nOK\r\n");
+    } else if (sscanf(command, "AT+HEXGET=%d", &n) == 1) {
+        len = sprintf(out, "\r\n+HEXDATA: %d\r\n", n);
+        len += at_hex_encode(out + len, payload, n);
+        len += sprintf(out + len, "\r\nOK\r\n");
+    } else if (!strcmp(command, "AT+URC")) {
+        for (int i=0; i<URC_BURST; i++)
+            len += sprintf(out + len, "\r\n+CIEV: 10,\"24201\",\"Telia\",\"Telia\", 0, 0\r\n");
+        len += sprintf(out + len, "\r\nOK\r\n");
+    } else {
+        len = sprintf(out, "\r\nERROR\r\n");
+    }
+
+    return len;
+}
+
+static void *emulator_thread(void *arg)
+{
+    struct emulator *emu = arg;
+    static char response[2*RAWDATA_SIZE + URC_BURST*64 + 64];
+    char command[128];
+    size_t used = 0;
+
+    for (;;) {
+        char ch;
+        if (read(emu->fd, &ch, 1) != 1)
+            break;
+
+        if (ch != '\r') {
+            if (used < sizeof(command)-1)
+                command[used++] = ch;
+            continue;
+        }
+
+        command[used] = '\0';
+        used = 0;
+        emulator_write(emu, response, emulator_respond(command, response));
+    }
+
+    return NULL;
+}
+
+static enum at_response_type scanner_ciprxget(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    struct at_tok tok;
+    int bytes;
+    at_tok_init(&tok, line, len);
+    at_tok_prefix(&tok, "+CIPRXGET: 2,");
+    at_tok_int(&tok, NULL);
+    if (at_tok_int(&tok, &bytes) && bytes > 0)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type scanner_hexget(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    struct at_tok tok;
+    int bytes;
+    at_tok_init(&tok, line, len);
+    if (at_tok_prefix(&tok, "+HEXDATA: ") && at_tok_int(&tok, &bytes))
+        return AT_RESPONSE_HEXDATA_FOLLOWS(bytes);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static size_t urcs;
+
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    (void) line;
+    (void) len;
+    (void) arg;
+    urcs++;
+}
+
+static void handle_registered_urc(const char *line, size_t len, struct at_tok *tok, void *arg)
+{
+    (void) tok;
+    handle_urc(line, len, arg);
+}
+
+/* Registered ahead of "+CIEV: ", so that it doesn't come first. */
+static const char *const registry_prefixes[] = {
+    "+CIPRXGET: 1,", "+FTPGET: 1,", "+PDP: DEACT", "+SAPBR 1: DEACT",
+    "*PSNWID: ", "*PSUTTZ: ", "+CTZV: ", "DST: ", "RDY", "+CPIN: READY",
+    "Call Ready", "SMS Ready", "NORMAL POWER DOWN", "UNDER-VOLTAGE POWER DOWN",
+    "UNDER-VOLTAGE WARNNING", "OVER-VOLTAGE POWER DOWN", "OVER-VOLTAGE WARNNING",
+    "+CIEV: ",
+};
+
+static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    if (len >= 7 && !memcmp(line, "+CIEV: ", 7))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static const struct at_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = handle_urc,
+};
+
+struct workload {
+    const char *name;
+    const char *command;
+    at_line_scanner_t scanner;
+    bool urc_queue;
+    bool urc_registry;
+};
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t count_lines(const char *data, size_t len)
+{
+    size_t lines = 0;
+    for (size_t i=0; i<len; i++)
+        if (data[i] == '\n')
+            lines++;
+    return lines;
+}
+
+static void run(FILE *out, struct at *at, struct emulator *emu,
+                const struct workload *workload, bool bytewise)
+{
+    static char response[2*RAWDATA_SIZE + URC_BURST*64 + 64];
+    static char sink[RAWDATA_SIZE];
+
+    size_t response_len = emulator_respond(workload->command, response);
+    size_t response_lines = count_lines(response, response_len);
+    int commands = TARGET_BYTES / response_len;
+    if (commands < COMMANDS_MIN)
+        commands = COMMANDS_MIN;
+    if (commands > COMMANDS_MAX)
+        commands = COMMANDS_MAX;
+
+    emu->bytewise = bytewise;
+    urcs = 0;
+    if (at_set_urc_queue(at, workload->urc_queue ? 2*URC_BURST : 0, URC_SLOT_SIZE,
+                         AT_URC_DROP_OLDEST, false))
+    {
+        perror("at_set_urc_queue");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i=0; workload->urc_registry && i<sizeof(registry_prefixes)/sizeof(*registry_prefixes); i++) {
+        if (at_register_urc(at, registry_prefixes[i], handle_registered_urc, NULL)) {
+            perror("at_register_urc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    double start = now_ns();
+    for (int i=0; i<commands; i++) {
+        at_set_command_scanner(at, workload->scanner);
+        at_set_data_sink(at, sink, sizeof(sink));
+        if (!at_command(at, "%s", workload->command)) {
+            perror(workload->command);
+            exit(EXIT_FAILURE);
+        }
+        if (workload->urc_queue)
+            at_urc_drain(at);
+    }
+    double elapsed = now_ns() - start;
+
+    for (size_t i=0; workload->urc_registry && i<sizeof(registry_prefixes)/sizeof(*registry_prefixes); i++)
+        at_unregister_urc(at, registry_prefixes[i]);
+
+    double bytes = (double) response_len * commands;
+    double lines = (double) response_lines * commands;
+    fprintf(out, "{\"bench\": \"at_command\", \"workload\": \"%s\", \"mode\": \"%s\", "
+            "\"commands\": %d, \"bytes\": %.0f, \"lines\": %.0f, \"urcs\": %zu, "
+            "\"bytes_per_sec\": %.0f, \"lines_per_sec\": %.0f, \"ns_per_line\": %.2f, "
+            "\"ns_per_command\": %.0f}\n",
+            workload->name, bytewise ? "bytewise" : "chunked",
+            commands, bytes, lines, urcs,
+            bytes / elapsed * 1e9, lines / elapsed * 1e9, elapsed / lines,
+            elapsed / commands);
+    fflush(out);
+}
+
+int main(void)
+{
+    /* The library logs to stdout; keep results on it and move the rest. */
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) || unlockpt(master)) {
+        perror("posix_openpt");
+        return EXIT_FAILURE;
+    }
+    const char *slave = ptsname(master);
+
+    /* Raw mode, so the line discipline neither echoes nor translates. Keep
+     * a descriptor open so the settings stick. */
+    int keep = open(slave, O_RDWR | O_NOCTTY);
+    struct termios attr;
+    if (keep == -1 || tcgetattr(keep, &attr)) {
+        perror(slave);
+        return EXIT_FAILURE;
+    }
+    attr.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    attr.c_oflag &= ~OPOST;
+    attr.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    attr.c_cflag &= ~(CSIZE | PARENB);
+    attr.c_cflag |= CS8;
+    tcsetattr(keep, TCSANOW, &attr);
+
+    struct emulator emu = { .fd = master };
+    pthread_t thread;
+    pthread_create(&thread, NULL, emulator_thread, &emu);
+
+    struct at *at = at_alloc_unix(slave, 0);
+    if (!at || at_open(at)) {
+        perror("at_open");
+        return EXIT_FAILURE;
+    }
+    at_set_callbacks(at, &callbacks, NULL);
+    at_set_timeout(at, 5);
+
+    char command[32];
+    snprintf(command, sizeof(command), "AT+CIPRXGET=2,0,%d", RAWDATA_SIZE);
+    char hexcommand[32];
+    snprintf(hexcommand, sizeof(hexcommand), "AT+HEXGET=%d", RAWDATA_SIZE);
+
+    const struct workload workloads[] = {
+        { "command-ok", "AT+CSQ", NULL, false, false },
+        { "urc-storm", "AT+URC", NULL, false, false },
+        { "urc-storm-queued", "AT+URC", NULL, true, false },
+        { "urc-storm-registry", "AT+URC", NULL, false, true },
+        { "urc-storm-registry-queued", "AT+URC", NULL, true, true },
+        { "rawdata", command, scanner_ciprxget, false, false },
+        { "hexdata", hexcommand, scanner_hexget, false, false },
+    };
+
+    for (size_t i=0; i<sizeof(workloads)/sizeof(*workloads); i++) {
+        run(out, at, &emu, &workloads[i], true);
+        run(out, at, &emu, &workloads[i], false);
+    }
+
+    at_close(at);
+    at_free(at);
+    close(keep);
+    close(master);
+    pthread_join(thread, NULL);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,283 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Parser throughput benchmark. Replays recorded and synthetic modem traffic
+ * through at_parser_feed(), both byte-by-byte (as the reader thread does)
+ * and in large chunks, and prints one JSON object per measurement.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+#include <attentive/at-hex.h>
+#include <attentive/at-tokenizer.h>
+
+
+/* Total bytes replayed per workload and feed mode. */
+#define TARGET_BYTES (8*1024*1024)
+
+/* Chunk size for the "chunked" feed mode; larger than any single read. */
+#define CHUNK_SIZE 4096
+
+#define RAWDATA_SIZE 1460
+
+/**
+ * A workload is a list of exchanges. Each exchange is fed in one go; if it
+ * is a command response, the parser is told to expect one beforehand.
+ */
+struct exchange {
+    bool command;
+    const char *data;
+    size_t len;
+};
+
+struct workload {
+    const char *name;
+    struct exchange *exchanges;
+    size_t count;
+};
+
+/*
+ * Recorded SIM800 session: boot URCs, registration, a TCP connection with
+ * a short send/receive and teardown. Captured with ATE0.
+ */
+#define RECORDED(command, text) { command, text, sizeof(text)-1 }
+static struct exchange recorded_session[] = {
+    RECORDED(false, "\r\nRDY\r\n\r\n+CFUN: 1\r\n\r\n+CPIN: READY\r\n"),
+    RECORDED(true,  "\r\nOK\r\n"),
+    RECORDED(true,  "\r\nOK\r\n"),
+    RECORDED(false, "\r\nCall Ready\r\n\r\nSMS Ready\r\n"),
+    RECORDED(true,  "\r\n+CGSN: 866192034158421\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n89460799011234567890\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n+CREG: 0,2\r\n\r\nOK\r\n"),
+    RECORDED(false, "\r\n*PSUTTZ: 2015,8,24,11,52,10,\"+8\",0\r\n\r\nDST: 0\r\n"),
+    RECORDED(true,  "\r\n+CREG: 0,1\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n+CSQ: 17,0\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n+CCLK: \"15/08/24,11:52:14+08\"\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\nOK\r\n"),
+    RECORDED(true,  "\r\nOK\r\n"),
+    RECORDED(true,  "\r\nOK\r\n\r\nSTATE: IP STATUS\r\n\r\n"
+                    "C: 0,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+                    "C: 1,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+                    "C: 2,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+                    "C: 3,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+                    "C: 4,,\"\",\"\",\"\",\"INITIAL\"\r\n"
+                    "C: 5,,\"\",\"\",\"\",\"INITIAL\"\r\n"),
+    RECORDED(true,  "\r\nOK\r\n"),
+    RECORDED(false, "\r\n0, CONNECT OK\r\n"),
+    RECORDED(true,  "\r\n+CIPRXGET: 2,0,0,0\r\n\r\nOK\r\n"),
+    RECORDED(false, "\r\n+CIPRXGET: 1,0\r\n"),
+    RECORDED(true,  "\r\n+CIPRXGET: 2,0,32,0\r\nHTTP/1.1 200 OK\r\nServer: nginx\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n+CIPACK: 64,64,0\r\n\r\nOK\r\n"),
+    RECORDED(true,  "\r\n0, CLOSE OK\r\n"),
+    RECORDED(false, "\r\n+CIEV: 10,\"24201\",\"Telia\",\"Telia\", 0, 0\r\n"),
+};
+#undef RECORDED
+
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) priv;
+
+    struct at_tok tok;
+    int bytes;
+
+    at_tok_init(&tok, line, len);
+    if (at_tok_prefix(&tok, "+CIPRXGET: 2,")) {
+        at_tok_int(&tok, NULL);
+        at_tok_int(&tok, &bytes);
+        if (at_tok_ok(&tok) && bytes > 0)
+            return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
+        return AT_RESPONSE_UNKNOWN;
+    }
+
+    at_tok_init(&tok, line, len);
+    if (at_tok_prefix(&tok, "+HEXDATA: ") && at_tok_int(&tok, &bytes))
+        return AT_RESPONSE_HEXDATA_FOLLOWS(bytes);
+
+    at_tok_init(&tok, line, len);
+    if (at_tok_int(&tok, NULL) && at_tok_prefix(&tok, " CLOSE OK"))
+        return AT_RESPONSE_FINAL_OK;
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static size_t responses, urcs;
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    responses++;
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+    urcs++;
+}
+
+static const struct at_parser_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_response = handle_response,
+    .handle_urc = handle_urc,
+};
+
+static struct exchange make_exchange(bool command, char *data, size_t len)
+{
+    return (struct exchange) { .command = command, .data = data, .len = len };
+}
+
+static struct workload synthetic_command_ok(void)
+{
+    static char text[] = "\r\n+CSQ: 17,0\r\n\r\nOK\r\n";
+    static struct exchange exchanges[1];
+    exchanges[0] = make_exchange(true, text, strlen(text));
+    return (struct workload) { "command-ok", exchanges, 1 };
+}
+
+static struct workload synthetic_urc_storm(void)
+{
+    static const char *const lines[] = {
+        "\r\n+CIEV: 10,\"24201\",\"Telia\",\"Telia\", 0, 0\r\n",
+        "\r\nRING\r\n",
+        "\r\n+CIPRXGET: 1,0\r\n",
+        "\r\n*PSUTTZ: 2015,8,24,11,52,10,\"+8\",0\r\n",
+        "\r\nDST: 0\r\n",
+        "\r\n+CREG: 1\r\n",
+    };
+    static char text[1024];
+    size_t len = 0;
+    for (size_t i=0; i<sizeof(lines)/sizeof(*lines); i++) {
+        strcpy(text + len, lines[i]);
+        len += strlen(lines[i]);
+    }
+
+    static struct exchange exchanges[1];
+    exchanges[0] = make_exchange(false, text, len);
+    return (struct workload) { "urc-storm", exchanges, 1 };
+}
+
+static struct workload synthetic_rawdata(void)
+{
+    static char text[RAWDATA_SIZE + 64];
+    size_t len = sprintf(text, "\r\n+CIPRXGET: 2,0,%d,0\r\n", RAWDATA_SIZE);
+    for (int i=0; i<RAWDATA_SIZE; i++)
+        text[len++] = (char) (i * 31 + 7);
+    len += sprintf(text + len, "\r\nOK\r\n");
+
+    static struct exchange exchanges[1];
+    exchanges[0] = make_exchange(true, text, len);
+    return (struct workload) { "rawdata", exchanges, 1 };
+}
+
+static struct workload synthetic_hexdata(void)
+{
+    static char text[2*RAWDATA_SIZE + 64];
+    uint8_t payload[RAWDATA_SIZE];
+    for (int i=0; i<RAWDATA_SIZE; i++)
+        payload[i] = (uint8_t) (i * 31 + 7);
+
+    size_t len = sprintf(text, "\r\n+HEXDATA: %d\r\n", RAWDATA_SIZE);
+    len += at_hex_encode(text + len, payload, RAWDATA_SIZE);
+    len += sprintf(text + len, "\r\nOK\r\n");
+
+    static struct exchange exchanges[1];
+    exchanges[0] = make_exchange(true, text, len);
+    return (struct workload) { "hexdata", exchanges, 1 };
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t count_lines(const struct exchange *exchange)
+{
+    size_t lines = 0;
+    for (size_t i=0; i<exchange->len; i++)
+        if (exchange->data[i] == '\n')
+            lines++;
+    return lines;
+}
+
+static void run(const struct workload *workload, const char *mode, size_t chunk)
+{
+    struct at_parser *parser = at_parser_alloc(&callbacks, 4096, NULL);
+    if (!parser) {
+        perror("at_parser_alloc");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Payloads go to a sink, like the drivers do it. */
+    static char sink[2*RAWDATA_SIZE];
+
+    size_t trace_bytes = 0, trace_lines = 0;
+    for (size_t i=0; i<workload->count; i++) {
+        trace_bytes += workload->exchanges[i].len;
+        trace_lines += count_lines(&workload->exchanges[i]);
+    }
+    size_t rounds = TARGET_BYTES / trace_bytes + 1;
+
+    responses = urcs = 0;
+    double start = now_ns();
+    for (size_t round=0; round<rounds; round++) {
+        for (size_t i=0; i<workload->count; i++) {
+            const struct exchange *exchange = &workload->exchanges[i];
+            if (exchange->command) {
+                at_parser_set_data_sink(parser, sink, sizeof(sink));
+                at_parser_await_response(parser);
+            }
+            for (size_t pos=0; pos<exchange->len; pos+=chunk) {
+                size_t len = exchange->len - pos < chunk ? exchange->len - pos : chunk;
+                at_parser_feed(parser, exchange->data + pos, len);
+            }
+        }
+    }
+    double elapsed = now_ns() - start;
+
+    double bytes = (double) trace_bytes * rounds;
+    double lines = (double) trace_lines * rounds;
+    printf("{\"bench\": \"parser\", \"workload\": \"%s\", \"mode\": \"%s\", "
+           "\"bytes\": %.0f, \"lines\": %.0f, \"responses\": %zu, \"urcs\": %zu, "
+           "\"bytes_per_sec\": %.0f, \"lines_per_sec\": %.0f, \"ns_per_line\": %.2f}\n",
+           workload->name, mode, bytes, lines, responses, urcs,
+           bytes / elapsed * 1e9, lines / elapsed * 1e9, elapsed / lines);
+
+    at_parser_free(parser);
+}
+
+int main(void)
+{
+    struct workload workloads[] = {
+        { "recorded", recorded_session, sizeof(recorded_session)/sizeof(*recorded_session) },
+        synthetic_command_ok(),
+        synthetic_urc_storm(),
+        synthetic_rawdata(),
+        synthetic_hexdata(),
+    };
+
+    for (size_t i=0; i<sizeof(workloads)/sizeof(*workloads); i++) {
+        run(&workloads[i], "bytewise", 1);
+        run(&workloads[i], "chunked", CHUNK_SIZE);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
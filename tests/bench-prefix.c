@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Line classification micro-benchmark: at_prefix_in_table() versus a compiled
+ * at_prefix_matcher, for URC tables of growing size. Prints one JSON object
+ * per measurement.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+
+
+#define ITERATIONS 200000
+
+/* Real-world prefixes first; the rest is padded with vendor-style URCs. */
+static const char *const base_prefixes[] = {
+    "+CIPRXGET: 1,",
+    "+FTPGET: 1,",
+    "+PDP: DEACT",
+    "+SAPBR 1: DEACT",
+    "*PSNWID: ",
+    "*PSUTTZ: ",
+    "+CTZV: ",
+    "DST: ",
+    "+CIEV: ",
+    "RDY",
+    "+CPIN: READY",
+    "Call Ready",
+    "SMS Ready",
+    "NORMAL POWER DOWN",
+    "UNDER-VOLTAGE POWER DOWN",
+    "UNDER-VOLTAGE WARNNING",
+    "OVER-VOLTAGE POWER DOWN",
+    "OVER-VOLTAGE WARNNING",
+};
+
+/* A typical mix of traffic: mostly responses, some URCs. */
+static const char *const lines[] = {
+    "OK",
+    "+CSQ: 17,0",
+    "+CREG: 0,1",
+    "+CIPRXGET: 1,0",
+    "+CIPRXGET: 2,0,128,0",
+    "SEND OK",
+    "+CIEV: 10,\"24201\"",
+    "DATA ACCEPT:0,64",
+    "ERROR",
+    "0, CLOSE OK",
+};
+
+#define NLINES (sizeof(lines)/sizeof(*lines))
+#define NBASE (sizeof(base_prefixes)/sizeof(*base_prefixes))
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *method, int entries, double elapsed, int hits)
+{
+    double count = (double) ITERATIONS * NLINES;
+    printf("{\"bench\": \"prefix\", \"method\": \"%s\", \"entries\": %d, "
+           "\"lines\": %.0f, \"ns_per_line\": %.2f, \"hits\": %d}\n",
+           method, entries, count, elapsed / count, hits);
+}
+
+int main(void)
+{
+    static const char *table[AT_PREFIX_MATCHER_MAX+1];
+    static char names[AT_PREFIX_MATCHER_MAX][16];
+    size_t lengths[NLINES];
+
+    for (size_t i=0; i<NLINES; i++)
+        lengths[i] = strlen(lines[i]);
+
+    for (int entries=4; entries<=AT_PREFIX_MATCHER_MAX; entries*=2) {
+        for (int i=0; i<entries; i++) {
+            if (i < (int) NBASE) {
+                table[i] = base_prefixes[i];
+            } else {
+                snprintf(names[i], sizeof(names[i]), "+VND%02d: ", i);
+                table[i] = names[i];
+            }
+        }
+        table[entries] = NULL;
+
+        struct at_prefix_matcher matcher;
+        if (at_prefix_matcher_init(&matcher, table) != 0) {
+            perror("at_prefix_matcher_init");
+            return EXIT_FAILURE;
+        }
+
+        int hits = 0;
+        double start = now_ns();
+        for (int n=0; n<ITERATIONS; n++)
+            for (size_t i=0; i<NLINES; i++)
+                hits += at_prefix_in_table(lines[i], table);
+        report("table", entries, now_ns() - start, hits);
+
+        hits = 0;
+        start = now_ns();
+        for (int n=0; n<ITERATIONS; n++)
+            for (size_t i=0; i<NLINES; i++)
+                hits += at_prefix_match(&matcher, lines[i], lengths[i]) >= 0;
+        report("matcher", entries, now_ns() - start, hits);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
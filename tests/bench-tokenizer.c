@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Line scanner micro-benchmark: the sim800 +CIPSEND and +CIPRXGET scanners
+ * written with sscanf(), as they used to be, versus the same scanners written
+ * with the at_tok_* tokenizer and as generated by tools/scanner-gen from
+ * src/modem/sim800.scanners. Prints one JSON object per measurement.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <attentive/parser.h>
+#include <attentive/at-tokenizer.h>
+
+#include "../src/modem/sim800-scanners.h"
+
+
+#define ITERATIONS 200000
+
+/* Lines a scanner sees while its command is in flight. */
+static const char *const lines[] = {
+    "DATA ACCEPT:0,64",
+    "0, SEND OK",
+    "1, SEND FAIL",
+    "SEND OK",
+    "+CIPRXGET: 2,0,128,0",
+    "+CIPRXGET: 2,1,0,0",
+    "+CIEV: 10,\"24201\"",
+    "OK",
+};
+
+#define NLINES (sizeof(lines)/sizeof(*lines))
+
+static enum at_response_type sscanf_cipsend(const char *line, size_t len)
+{
+    (void) len;
+
+    int connid, amount;
+    char last;
+    if (sscanf(line, "DATA ACCEPT:%d,%d", &connid, &amount) == 2)
+        return AT_RESPONSE_FINAL_OK;
+    if (sscanf(line, "%d, SEND O%c", &connid, &last) == 2 && last == 'K')
+        return AT_RESPONSE_FINAL_OK;
+    if (sscanf(line, "%d, SEND FAI%c", &connid, &last) == 2 && last == 'L')
+        return AT_RESPONSE_FINAL;
+    if (!strcmp(line, "SEND OK"))
+        return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "SEND FAIL"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type tok_cipsend(const char *line, size_t len)
+{
+    struct at_tok tok;
+    at_tok_init(&tok, line, len);
+    if (at_tok_prefix(&tok, "DATA ACCEPT:")) {
+        at_tok_int(&tok, NULL);
+        if (at_tok_int(&tok, NULL))
+            return AT_RESPONSE_FINAL_OK;
+        return AT_RESPONSE_UNKNOWN;
+    }
+
+    at_tok_init(&tok, line, len);
+    if (at_tok_int(&tok, NULL)) {
+        struct at_tok rest = tok;
+        if (at_tok_prefix(&tok, " SEND OK"))
+            return AT_RESPONSE_FINAL_OK;
+        if (at_tok_prefix(&rest, " SEND FAIL"))
+            return AT_RESPONSE_FINAL;
+        return AT_RESPONSE_UNKNOWN;
+    }
+
+    if (!strcmp(line, "SEND OK"))
+        return AT_RESPONSE_FINAL_OK;
+    if (!strcmp(line, "SEND FAIL"))
+        return AT_RESPONSE_FINAL;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type sscanf_ciprxget(const char *line, size_t len)
+{
+    (void) len;
+
+    int requested, confirmed;
+    if (sscanf(line, "+CIPRXGET: 2,%*d,%d,%d", &requested, &confirmed) == 2)
+        if (requested > 0)
+            return AT_RESPONSE_RAWDATA_FOLLOWS(requested);
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type tok_ciprxget(const char *line, size_t len)
+{
+    struct at_tok tok;
+    int requested;
+    at_tok_init(&tok, line, len);
+    at_tok_prefix(&tok, "+CIPRXGET: 2,");
+    at_tok_int(&tok, NULL);
+    at_tok_int(&tok, &requested);
+    at_tok_int(&tok, NULL);
+    if (at_tok_ok(&tok) && requested > 0)
+        return AT_RESPONSE_RAWDATA_FOLLOWS(requested);
+
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static enum at_response_type generated_cipsend(const char *line, size_t len)
+{
+    return scanner_cipsend(line, len, NULL);
+}
+
+static enum at_response_type generated_ciprxget(const char *line, size_t len)
+{
+    return scanner_ciprxget(line, len, NULL);
+}
+
+/* The rest of the generated sim800 scanners aren't measured. */
+static void unused_scanners(void)
+{
+    (void) scanner_cipstatus;
+    (void) scanner_cifsr;
+    (void) scanner_cipshut;
+    (void) scanner_cipclose;
+    (void) scanner_ftpget2;
+}
+
+typedef enum at_response_type (*scanner_t)(const char *line, size_t len);
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long run(const char *scanner, const char *method, scanner_t scan, const size_t *lengths)
+{
+    long checksum = 0;
+    double start = now_ns();
+    for (int n=0; n<ITERATIONS; n++)
+        for (size_t i=0; i<NLINES; i++)
+            checksum += scan(lines[i], lengths[i]);
+    double elapsed = now_ns() - start;
+
+    double count = (double) ITERATIONS * NLINES;
+    printf("{\"bench\": \"tokenizer\", \"scanner\": \"%s\", \"method\": \"%s\", "
+           "\"lines\": %.0f, \"ns_per_line\": %.2f, \"checksum\": %ld}\n",
+           scanner, method, count, elapsed / count, checksum);
+    return checksum;
+}
+
+int main(void)
+{
+    size_t lengths[NLINES];
+    for (size_t i=0; i<NLINES; i++)
+        lengths[i] = strlen(lines[i]);
+
+    unused_scanners();
+
+    /* All flavours must classify every line the same way. */
+    for (size_t i=0; i<NLINES; i++) {
+        if (sscanf_cipsend(lines[i], lengths[i]) != tok_cipsend(lines[i], lengths[i]) ||
+            generated_cipsend(lines[i], lengths[i]) != tok_cipsend(lines[i], lengths[i]) ||
+            sscanf_ciprxget(lines[i], lengths[i]) != tok_ciprxget(lines[i], lengths[i]) ||
+            generated_ciprxget(lines[i], lengths[i]) != tok_ciprxget(lines[i], lengths[i]))
+        {
+            fprintf(stderr, "scanner mismatch on '%s'\n", lines[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    run("cipsend", "sscanf", sscanf_cipsend, lengths);
+    run("cipsend", "tokenizer", tok_cipsend, lengths);
+    run("cipsend", "generated", generated_cipsend, lengths);
+    run("ciprxget", "sscanf", sscanf_ciprxget, lengths);
+    run("ciprxget", "tokenizer", tok_ciprxget, lengths);
+    run("ciprxget", "generated", generated_ciprxget, lengths);
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */
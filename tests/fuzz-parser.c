@@ -0,0 +1,419 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Parser fuzz harness with a chunking-equivalence oracle.
+ *
+ * The input is a script of parser operations: awaiting a response (with or
+ * without a dataprompt), queueing pipelined commands (with or without echo),
+ * releasing responses, installing a data sink, resetting and feeding data. The script is replayed against three parsers that get
+ * the same data all at once, byte by byte and in irregular chunks, and all
+ * three must produce identical callbacks. Line types come from a scanner
+ * that derives them from the line contents, so every flavour of response
+ * (including raw and hex data blocks of any length) gets exercised.
+ *
+ * Build with -DFUZZ_LIBFUZZER for libFuzzer. Otherwise the harness has its
+ * own main(), which replays files given on the command line, runs a number
+ * of pseudo-random scripts with "-random <count>", or reads a single script
+ * from stdin (for AFL).
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <attentive/parser.h>
+
+
+/* Callback log limit; scripts that log more are cut short. */
+#define LOG_SIZE (64*1024)
+
+/* Command echo; spans a newline so that a mismatch can end lines. */
+static const char fuzz_echo[] = "AT\rOK\r\nAT";
+
+enum op {
+    OP_AWAIT,
+    OP_AWAIT_DATAPROMPT,
+    OP_RELEASE,
+    OP_SINK,
+    OP_RESET,
+    OP_QUEUE,
+    OP_FEED,
+    OP_COUNT,
+};
+
+struct harness {
+    struct at_parser *parser;
+    uint8_t log[LOG_SIZE];
+    size_t log_used;
+    bool log_full;
+    char sink[256];
+};
+
+static void log_bytes(struct harness *h, const void *data, size_t len)
+{
+    if (h->log_used + len > sizeof(h->log)) {
+        h->log_full = true;
+        return;
+    }
+    memcpy(h->log + h->log_used, data, len);
+    h->log_used += len;
+}
+
+static void log_event(struct harness *h, char kind, const char *data, size_t len)
+{
+    uint32_t size = len;
+    log_bytes(h, &kind, 1);
+    log_bytes(h, &size, sizeof(size));
+    log_bytes(h, data, len);
+}
+
+/**
+ * Derive a line type from the line contents. The first character selects
+ * the type; the second one, where needed, the data block length.
+ */
+static enum at_response_type scan_line(const char *line, size_t len, void *priv)
+{
+    (void) priv;
+
+    int amount = len > 1 ? (uint8_t) line[1] % 48 : 0;
+    switch (line[0]) {
+        case 'R': return AT_RESPONSE_RAWDATA_FOLLOWS(amount);
+        case 'H': return AT_RESPONSE_HEXDATA_FOLLOWS(amount);
+        case 'U': return AT_RESPONSE_URC;
+        case 'F': return AT_RESPONSE_FINAL;
+        case 'K': return AT_RESPONSE_FINAL_OK;
+        case 'D': return AT_RESPONSE_INTERMEDIATE_DISCARDED;
+        case 'I': return AT_RESPONSE_INTERMEDIATE;
+        case 'X': return AT_RESPONSE_UNEXPECTED;
+        default: return AT_RESPONSE_UNKNOWN;
+    }
+}
+
+static void log_response(struct harness *h, char kind, const char *line, size_t len)
+{
+    /* The response is NUL-terminated. */
+    if (line[len] != '\0')
+        abort();
+
+    log_event(h, kind, line, len);
+
+    bool overflow = at_parser_overflow(h->parser);
+    log_bytes(h, &overflow, sizeof(overflow));
+
+    /* The line index must point within the response. */
+    size_t count;
+    const struct at_response_line *lines = at_parser_response_lines(h->parser, &count);
+    for (size_t i=0; i<count; i++) {
+        if ((size_t) lines[i].offset + lines[i].length > len)
+            abort();
+        log_bytes(h, &lines[i].offset, sizeof(lines[i].offset));
+        log_bytes(h, &lines[i].length, sizeof(lines[i].length));
+        log_bytes(h, &lines[i].data, sizeof(lines[i].data));
+    }
+
+    size_t used = at_parser_data_sink_used(h->parser);
+    log_event(h, 's', h->sink, used);
+}
+
+static void handle_response(const char *line, size_t len, void *priv)
+{
+    log_response(priv, 'r', line, len);
+}
+
+static void handle_queued_response(const char *line, size_t len, void *priv)
+{
+    log_response(priv, 'q', line, len);
+}
+
+static void handle_urc(const char *line, size_t len, void *priv)
+{
+    log_event(priv, 'u', line, len);
+}
+
+/** Drop XON/XOFF characters. */
+static size_t span_handler(const char *data, size_t len, char *out,
+                           const char *line, size_t line_len, void *priv)
+{
+    (void) line;
+    (void) line_len;
+    (void) priv;
+
+    size_t used = 0;
+    for (size_t i=0; i<len; i++)
+        if (data[i] != '\x11' && data[i] != '\x13')
+            out[used++] = data[i];
+    return used;
+}
+
+/** Turn XOFF characters into newlines. */
+static char character_handler(char ch, char *line, size_t len, void *priv)
+{
+    (void) line;
+    (void) len;
+    (void) priv;
+
+    return ch == '\x13' ? '\n' : ch;
+}
+
+static const struct at_parser_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_response = handle_response,
+    .handle_urc = handle_urc,
+};
+
+/**
+ * Run a script against a single parser.
+ *
+ * @param chunking Feed split: 0 for all at once, 1 for byte by byte, other
+ *                 values for a chunk pattern derived from it.
+ */
+static void run(struct harness *h, const uint8_t *data, size_t size, unsigned chunking)
+{
+    memset(h, 0, sizeof(*h));
+    if (size < 2)
+        return;
+
+    /* Script header: buffer size and growth limit. */
+    size_t bufsize = 8 + data[0] % 120;
+    size_t limit = (data[1] & 0x80) ? bufsize + (data[1] & 0x7f) * 4 : 0;
+    data += 2;
+    size -= 2;
+
+    h->parser = at_parser_alloc(&callbacks, bufsize, h);
+    if (!h->parser)
+        abort();
+    if (limit)
+        at_parser_set_buffer_limit(h->parser, limit);
+
+    unsigned step = 0;
+    while (size > 0 && !h->log_full) {
+        uint8_t op = *data++ % OP_COUNT;
+        size--;
+
+        switch (op) {
+            case OP_AWAIT:
+                at_parser_await_response(h->parser);
+                break;
+
+            case OP_AWAIT_DATAPROMPT:
+                at_parser_expect_dataprompt(h->parser);
+                at_parser_await_response(h->parser);
+                break;
+
+            case OP_RELEASE:
+                at_parser_release_response(h->parser);
+                break;
+
+            case OP_SINK:
+            {
+                size_t sinksize = size > 0 ? *data % (sizeof(h->sink) + 1) : 0;
+                if (size > 0) {
+                    data++;
+                    size--;
+                }
+                at_parser_set_data_sink(h->parser, sinksize ? h->sink : NULL, sinksize);
+                break;
+            }
+
+            case OP_RESET:
+                at_parser_reset(h->parser);
+                break;
+
+            case OP_QUEUE:
+            {
+                /* Flags: hold, dataprompt, data sink, default handler, span
+                 * handler, character handler, echo. */
+                uint8_t flags = size > 0 ? *data : 0;
+                if (size > 0) {
+                    data++;
+                    size--;
+                }
+
+                struct at_parser_command command = {
+                    .hold = flags & 1,
+                    .dataprompt = flags & 2,
+                    .sink = (flags & 4) ? h->sink : NULL,
+                    .sink_size = (flags & 4) ? sizeof(h->sink)/4 : 0,
+                    .handle_response = (flags & 8) ? NULL : handle_queued_response,
+                    .arg = h,
+                    .span_handler = (flags & 16) ? span_handler : NULL,
+                    .character_handler = (flags & 32) ? character_handler : NULL,
+                    .echo = (flags & 64) ? fuzz_echo : NULL,
+                    .echo_len = (flags & 64) ? strlen(fuzz_echo) : 0,
+                };
+                int result = at_parser_queue_command(h->parser, &command);
+                log_bytes(h, &result, sizeof(result));
+                break;
+            }
+
+            case OP_FEED:
+            {
+                size_t len = size > 0 ? *data : 0;
+                if (size > 0) {
+                    data++;
+                    size--;
+                }
+                if (len > size)
+                    len = size;
+
+                size_t pos = 0;
+                while (pos < len) {
+                    size_t chunk = len - pos;
+                    if (chunking == 1)
+                        chunk = 1;
+                    else if (chunking > 1)
+                        chunk = 1 + (chunking * 7 + step++ * 13) % 11;
+                    if (chunk > len - pos)
+                        chunk = len - pos;
+                    at_parser_feed(h->parser, data + pos, chunk);
+                    pos += chunk;
+                }
+
+                data += len;
+                size -= len;
+                break;
+            }
+        }
+    }
+
+    at_parser_free(h->parser);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct harness whole, bytewise, chunked;
+
+    run(&whole, data, size, 0);
+    run(&bytewise, data, size, 1);
+    run(&chunked, data, size, 5);
+
+    if (whole.log_full || bytewise.log_full || chunked.log_full)
+        return 0;
+
+    if (whole.log_used != bytewise.log_used ||
+        memcmp(whole.log, bytewise.log, whole.log_used) ||
+        whole.log_used != chunked.log_used ||
+        memcmp(whole.log, chunked.log, whole.log_used))
+    {
+        fprintf(stderr, "fuzz-parser: callbacks depend on feed chunking\n");
+        abort();
+    }
+
+    return 0;
+}
+
+#if !defined(FUZZ_LIBFUZZER)
+
+static uint32_t random_state = 2463534242u;
+
+static uint32_t random_next(void)
+{
+    /* xorshift32 */
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+/**
+ * Generate a script that is mostly made of plausible modem traffic.
+ */
+static size_t random_script(uint8_t *script, size_t size)
+{
+    static const char *const pieces[] = {
+        "\r\n", "\n", "\r", "OK", "ERROR", "RING", "> ", ">",
+        "+CME ERROR: 1", "R\x05", "R\x30", "H\x04", "H\x22", "U+CIEV",
+        "F", "K", "D", "I", "X", "0123456789abcdef", "41 42 43", "\0",
+        "\x11", "\x13", "AT", "AT\r",
+    };
+
+    size_t len = 0;
+    script[len++] = random_next();
+    script[len++] = random_next();
+
+    while (len + 2 < size) {
+        uint8_t op = random_next() % (OP_COUNT + 4);
+        if (op < OP_FEED) {
+            script[len++] = op;
+            if (op == OP_SINK || op == OP_QUEUE)
+                script[len++] = random_next();
+            continue;
+        }
+
+        /* Feed a run of pieces. */
+        size_t start = len + 2;
+        size_t feed = start;
+        int count = random_next() % 12;
+        for (int i=0; i<count; i++) {
+            const char *piece = pieces[random_next() % (sizeof(pieces)/sizeof(*pieces))];
+            size_t piece_len = piece[0] ? strlen(piece) : 1;
+            if (feed + piece_len > size || feed + piece_len - start > 255)
+                break;
+            memcpy(script + feed, piece, piece_len);
+            feed += piece_len;
+        }
+        script[len++] = OP_FEED;
+        script[len++] = feed - start;
+        len = feed;
+    }
+
+    return len;
+}
+
+static int replay_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    static uint8_t data[1024*1024];
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+
+    LLVMFuzzerTestOneInput(data, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && !strcmp(argv[1], "-random")) {
+        long count = atol(argv[2]);
+        for (long i=0; i<count; i++) {
+            uint8_t script[1024];
+            size_t len = random_script(script, 64 + random_next() % (sizeof(script) - 64));
+            LLVMFuzzerTestOneInput(script, len);
+        }
+        printf("fuzz-parser: %ld random scripts passed\n", count);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc > 1) {
+        for (int i=1; i<argc; i++)
+            if (replay_file(argv[i]) != 0)
+                return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    /* AFL: a single script on stdin. */
+    static uint8_t data[1024*1024];
+    size_t size = fread(data, 1, sizeof(data), stdin);
+    LLVMFuzzerTestOneInput(data, size);
+
+    return EXIT_SUCCESS;
+}
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
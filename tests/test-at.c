@@ -0,0 +1,1198 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * AT channel tests. Commands go through the full at-unix path to a modem
+ * emulator on the other side of a pseudo-terminal.
+ */
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include <attentive/at.h>
+#include <attentive/at-unix.h>
+#include <attentive/cellular.h>
+
+
+static void sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+struct emulator {
+    int master;
+    int keep;
+    const char *slave;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    unsigned commands;      /**< Commands received so far. */
+    bool hungup;            /**< Master side was closed by "AT+HANGUP". */
+};
+
+/**
+ * Build the response to a single command. Unknown commands get an ERROR,
+ * "AT+SILENT" gets nothing at all, and "AT+LATE" gets a URC only after a
+ * while. "AT+STALL" gets nothing either, and stops the emulator from reading
+ * for a second. "AT+HANGUP" makes the emulator close its side of the line.
+ *
+ * @returns Response length.
+ */
+static size_t emulator_respond(const char *command, char *out)
+{
+    int n;
+    size_t len = 0;
+    if (!strcmp(command, "AT")) {
+        len = sprintf(out, "\r\nOK\r\n");
+    } else if (sscanf(command, "AT+VAL=%d", &n) == 1) {
+        len = sprintf(out, "\r\n+VAL: %d\r\n\r\nOK\r\n", n);
+    } else if (sscanf(command, "AT+URC=%d", &n) == 1) {
+        for (int i=0; i<n; i++)
+            len += sprintf(out + len, "\r\n+URC: %d\r\n", i);
+        len += sprintf(out + len, "\r\nOK\r\n");
+    } else if (sscanf(command, "AT+RAW=%d", &n) == 1) {
+        len = sprintf(out, "\r\n+RAW: %d\r\n", n);
+        for (int i=0; i<n; i++)
+            out[len++] = 'a' + i % 26;
+        len += sprintf(out + len, "\r\nOK\r\n");
+    } else if (!strcmp(command, "AT+LATE")) {
+        sleep_ms(300);
+        len = sprintf(out, "\r\n+URC: late\r\n");
+    } else if (!strcmp(command, "AT+SILENT")) {
+        len = 0;
+    } else if (!strcmp(command, "AT+STALL")) {
+        sleep_ms(1000);
+        len = 0;
+    } else {
+        len = sprintf(out, "\r\nERROR\r\n");
+    }
+
+    return len;
+}
+
+static void *emulator_thread(void *arg)
+{
+    struct emulator *emu = arg;
+    static char response[4096];
+    char command[128];
+    size_t used = 0;
+
+    for (;;) {
+        char ch;
+        if (read(emu->master, &ch, 1) != 1)
+            break;
+
+        if (ch != '\r') {
+            if (used < sizeof(command)-1)
+                command[used++] = ch;
+            continue;
+        }
+
+        command[used] = '\0';
+        used = 0;
+        if (!strcmp(command, "AT+HANGUP")) {
+            pthread_mutex_lock(&emu->mutex);
+            emu->hungup = true;
+            emu->commands++;
+            pthread_cond_broadcast(&emu->cond);
+            pthread_mutex_unlock(&emu->mutex);
+            close(emu->master);
+            break;
+        }
+        size_t len = emulator_respond(command, response);
+        if (write(emu->master, response, len) != (ssize_t) len)
+            break;
+
+        pthread_mutex_lock(&emu->mutex);
+        emu->commands++;
+        pthread_cond_broadcast(&emu->cond);
+        pthread_mutex_unlock(&emu->mutex);
+    }
+
+    return NULL;
+}
+
+static void emulator_start(struct emulator *emu)
+{
+    memset(emu, 0, sizeof(*emu));
+
+    emu->master = posix_openpt(O_RDWR | O_NOCTTY);
+    ck_assert(emu->master != -1);
+    ck_assert(!grantpt(emu->master) && !unlockpt(emu->master));
+    emu->slave = ptsname(emu->master);
+
+    /* Raw mode, so the line discipline neither echoes nor translates. Keep
+     * a descriptor open so the settings stick. */
+    emu->keep = open(emu->slave, O_RDWR | O_NOCTTY);
+    ck_assert(emu->keep != -1);
+    struct termios attr;
+    ck_assert(!tcgetattr(emu->keep, &attr));
+    attr.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    attr.c_oflag &= ~OPOST;
+    attr.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    attr.c_cflag &= ~(CSIZE | PARENB);
+    attr.c_cflag |= CS8;
+    tcsetattr(emu->keep, TCSANOW, &attr);
+
+    pthread_mutex_init(&emu->mutex, NULL);
+    pthread_cond_init(&emu->cond, NULL);
+    pthread_create(&emu->thread, NULL, emulator_thread, emu);
+}
+
+/**
+ * Wait until the emulator has received a number of commands in total.
+ */
+static void emulator_wait(struct emulator *emu, unsigned commands)
+{
+    pthread_mutex_lock(&emu->mutex);
+    while (emu->commands < commands)
+        pthread_cond_wait(&emu->cond, &emu->mutex);
+    pthread_mutex_unlock(&emu->mutex);
+}
+
+/**
+ * Stop the emulator. Channels on it must be closed first: the emulator
+ * only sees the end of the line once the slave side is closed everywhere.
+ */
+static void emulator_stop(struct emulator *emu)
+{
+    close(emu->keep);
+    pthread_join(emu->thread, NULL);
+    if (!emu->hungup)
+        close(emu->master);
+    pthread_cond_destroy(&emu->cond);
+    pthread_mutex_destroy(&emu->mutex);
+}
+
+/* URCs seen by the handler. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char lines[16][32];
+    unsigned count;
+    pthread_t thread;       /**< Thread that ran the handler last. */
+    bool block;             /**< Make the handler wait for release. */
+    bool blocked;           /**< Handler is waiting. */
+} urcs = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static enum at_response_type scan_line(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    if (len >= 6 && !memcmp(line, "+URC: ", 6))
+        return AT_RESPONSE_URC;
+    return AT_RESPONSE_UNKNOWN;
+}
+
+static void handle_urc(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&urcs.mutex);
+    urcs.blocked = urcs.block;
+    pthread_cond_broadcast(&urcs.cond);
+    while (urcs.block)
+        pthread_cond_wait(&urcs.cond, &urcs.mutex);
+    urcs.blocked = false;
+
+    /* Only read the line once released. */
+    if (urcs.count < 16)
+        snprintf(urcs.lines[urcs.count], sizeof(urcs.lines[0]), "%.*s", (int) len, line);
+    urcs.count++;
+    urcs.thread = pthread_self();
+    pthread_cond_broadcast(&urcs.cond);
+    pthread_mutex_unlock(&urcs.mutex);
+}
+
+static const struct at_callbacks callbacks = {
+    .scan_line = scan_line,
+    .handle_urc = handle_urc,
+};
+
+/**
+ * Wait until the handler has seen a number of URCs in total.
+ */
+static void urcs_wait(unsigned count)
+{
+    pthread_mutex_lock(&urcs.mutex);
+    while (urcs.count < count)
+        pthread_cond_wait(&urcs.cond, &urcs.mutex);
+    pthread_mutex_unlock(&urcs.mutex);
+}
+
+static enum at_response_type scanner_raw(const char *line, size_t len, void *arg)
+{
+    (void) arg;
+
+    struct at_tok tok;
+    int bytes;
+    at_tok_init(&tok, line, len);
+    if (at_tok_prefix(&tok, "+RAW: ") && at_tok_int(&tok, &bytes))
+        return AT_RESPONSE_RAWDATA_FOLLOWS(bytes);
+    return AT_RESPONSE_UNKNOWN;
+}
+
+/* Asynchronous command completions. */
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char responses[8][32];
+    int errors[8];
+    unsigned count;
+} completions = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/**
+ * Record a completion. If arg is set, queue it as the next command.
+ */
+static void command_done(struct at *at, const char *response, int error, void *arg)
+{
+    pthread_mutex_lock(&completions.mutex);
+    if (completions.count < 8) {
+        snprintf(completions.responses[completions.count], sizeof(completions.responses[0]),
+                 "%s", response ? response : "(null)");
+        completions.errors[completions.count] = error;
+    }
+    completions.count++;
+    pthread_cond_broadcast(&completions.cond);
+    pthread_mutex_unlock(&completions.mutex);
+
+    if (arg)
+        ck_assert_int_eq(at_command_async(at, command_done, NULL, "%s", (const char *) arg), 0);
+}
+
+/**
+ * Wait until a number of commands have completed in total.
+ */
+static void completions_wait(unsigned count)
+{
+    pthread_mutex_lock(&completions.mutex);
+    while (completions.count < count)
+        pthread_cond_wait(&completions.cond, &completions.mutex);
+    pthread_mutex_unlock(&completions.mutex);
+}
+
+static struct at *channel_open(struct emulator *emu)
+{
+    struct at *at = at_alloc_unix(emu->slave, 0);
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_callbacks(at, &callbacks, NULL);
+    at_set_timeout(at, 5);
+    return at;
+}
+
+struct blocked_command {
+    struct at *at;
+    const char *response;
+    int error;
+};
+
+static void *blocked_command_thread(void *arg)
+{
+    struct blocked_command *blocked = arg;
+
+    blocked->response = at_command(blocked->at, "AT+SILENT");
+    blocked->error = blocked->response ? 0 : errno;
+    return NULL;
+}
+
+START_TEST(test_at_close_blocked)
+{
+    printf(":: test_at_close_blocked\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+    at_set_timeout(at, 0);
+
+    /* The reader and the blocked command share a condition variable; close
+     * must not depend on which of them gets woken up. */
+    for (unsigned i=1; i<=20; i++) {
+        struct blocked_command blocked = { .at = at };
+        pthread_t thread;
+        pthread_create(&thread, NULL, blocked_command_thread, &blocked);
+        emulator_wait(&emu, i);
+
+        ck_assert_int_eq(at_close(at), 0);
+        pthread_join(thread, NULL);
+        ck_assert(blocked.response == NULL);
+        ck_assert_int_eq(blocked.error, ENODEV);
+
+        ck_assert_int_eq(at_open(at), 0);
+    }
+
+    /* The channel still works after all that. */
+    at_set_timeout(at, 5);
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 1), "+VAL: 1");
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_urc_direct)
+{
+    printf(":: test_at_urc_direct\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* Without a queue, the reader runs the handler before the response. */
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(urcs.count, 2);
+    ck_assert_str_eq(urcs.lines[0], "+URC: 0");
+    ck_assert_str_eq(urcs.lines[1], "+URC: 1");
+    ck_assert_int_eq(at_urc_drain(at), 0);
+    ck_assert_int_eq(at_urc_dropped(at), 0);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_urc_queue_drop)
+{
+    printf(":: test_at_urc_queue_drop\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    errno = 0;
+    ck_assert_int_eq(at_set_urc_queue(at, 4, 0, AT_URC_DROP_NEWEST, false), -1);
+    ck_assert_int_eq(errno, EINVAL);
+
+    /* A full queue keeps the oldest URCs. */
+    ck_assert_int_eq(at_set_urc_queue(at, 4, 16, AT_URC_DROP_NEWEST, false), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 6), "");
+    ck_assert_int_eq(urcs.count, 0);
+    ck_assert_int_eq(at_urc_dropped(at), 2);
+    ck_assert_int_eq(at_urc_drain(at), 4);
+    ck_assert_int_eq(urcs.count, 4);
+    for (int i=0; i<4; i++) {
+        char expected[16];
+        sprintf(expected, "+URC: %d", i);
+        ck_assert_str_eq(urcs.lines[i], expected);
+    }
+    ck_assert_int_eq(at_urc_drain(at), 0);
+
+    /* Or the newest ones; a new queue starts counting from zero. */
+    ck_assert_int_eq(at_set_urc_queue(at, 4, 16, AT_URC_DROP_OLDEST, false), 0);
+    ck_assert_int_eq(at_urc_dropped(at), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 6), "");
+    ck_assert_int_eq(at_urc_dropped(at), 2);
+    ck_assert_int_eq(at_urc_drain(at), 4);
+    ck_assert_int_eq(urcs.count, 8);
+    for (int i=0; i<4; i++) {
+        char expected[16];
+        sprintf(expected, "+URC: %d", i+2);
+        ck_assert_str_eq(urcs.lines[4+i], expected);
+    }
+
+    /* Long URCs are truncated to the slot size. */
+    ck_assert_int_eq(at_set_urc_queue(at, 1, 3, AT_URC_DROP_NEWEST, false), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 1), "");
+    ck_assert_int_eq(at_urc_drain(at), 1);
+    ck_assert_str_eq(urcs.lines[8], "+UR");
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_urc_queue_dispatcher)
+{
+    printf(":: test_at_urc_queue_dispatcher\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    ck_assert_int_eq(at_set_urc_queue(at, 8, 16, AT_URC_DROP_NEWEST, true), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 5), "");
+    urcs_wait(5);
+    ck_assert(!pthread_equal(urcs.thread, pthread_self()));
+    for (int i=0; i<5; i++) {
+        char expected[16];
+        sprintf(expected, "+URC: %d", i);
+        ck_assert_str_eq(urcs.lines[i], expected);
+    }
+    ck_assert_int_eq(at_urc_dropped(at), 0);
+
+    /* Back to direct delivery; the dispatcher thread is gone. */
+    ck_assert_int_eq(at_set_urc_queue(at, 0, 0, AT_URC_DROP_NEWEST, false), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 1), "");
+    ck_assert_int_eq(urcs.count, 6);
+    ck_assert(pthread_equal(urcs.thread, ((struct at_unix *) at)->thread));
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+struct urc_drain {
+    struct at *at;
+    int handled;
+    bool done;
+};
+
+static void *urc_drain_thread(void *arg)
+{
+    struct urc_drain *drain = arg;
+
+    drain->handled = at_urc_drain(drain->at);
+    return NULL;
+}
+
+static void *urc_queue_off_thread(void *arg)
+{
+    struct urc_drain *drain = arg;
+
+    at_set_urc_queue(drain->at, 0, 0, AT_URC_DROP_NEWEST, false);
+    pthread_mutex_lock(&urcs.mutex);
+    drain->done = true;
+    pthread_mutex_unlock(&urcs.mutex);
+    return NULL;
+}
+
+START_TEST(test_at_urc_queue_replace_draining)
+{
+    printf(":: test_at_urc_queue_replace_draining\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    ck_assert_int_eq(at_set_urc_queue(at, 4, 16, AT_URC_DROP_NEWEST, false), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 1), "");
+
+    /* Hold the handler while another thread drains the queue. */
+    urcs.block = true;
+    struct urc_drain drain = { .at = at };
+    pthread_t drainer, replacer;
+    pthread_create(&drainer, NULL, urc_drain_thread, &drain);
+    pthread_mutex_lock(&urcs.mutex);
+    while (!urcs.blocked)
+        pthread_cond_wait(&urcs.cond, &urcs.mutex);
+    pthread_mutex_unlock(&urcs.mutex);
+
+    /* Freeing the queue must wait for the handler to be done with it. */
+    pthread_create(&replacer, NULL, urc_queue_off_thread, &drain);
+    sleep_ms(100);
+    pthread_mutex_lock(&urcs.mutex);
+    ck_assert(!drain.done);
+    urcs.block = false;
+    pthread_cond_broadcast(&urcs.cond);
+    pthread_mutex_unlock(&urcs.mutex);
+
+    pthread_join(drainer, NULL);
+    pthread_join(replacer, NULL);
+    ck_assert(drain.done);
+    ck_assert_int_eq(drain.handled, 1);
+    ck_assert_str_eq(urcs.lines[0], "+URC: 0");
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_async_order)
+{
+    printf(":: test_at_async_order\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* The first one times out; the rest wait for it, then go in order. */
+    at_set_timeout_ms(at, 200);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+SILENT"), 0);
+    at_set_timeout(at, 5);
+    for (int i=1; i<AT_UNIX_REQUESTS_MAX; i++)
+        ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+VAL=%d", i), 0);
+    ck_assert_int_eq(completions.count, 0);
+
+    errno = 0;
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT"), -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+
+    completions_wait(AT_UNIX_REQUESTS_MAX);
+    ck_assert_int_eq(completions.errors[0], ETIMEDOUT);
+    ck_assert_str_eq(completions.responses[0], "(null)");
+    for (int i=1; i<AT_UNIX_REQUESTS_MAX; i++) {
+        char expected[16];
+        sprintf(expected, "+VAL: %d", i);
+        ck_assert_int_eq(completions.errors[i], 0);
+        ck_assert_str_eq(completions.responses[i], expected);
+    }
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_async_blocking)
+{
+    printf(":: test_at_async_blocking\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* A blocking command queues behind asynchronous ones; one queued from a
+     * completion callback goes after both. */
+    ck_assert_int_eq(at_command_async(at, command_done, "AT+VAL=2", "AT+VAL=%d", 1), 0);
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 3), "+VAL: 3");
+    ck_assert_str_eq(completions.responses[0], "+VAL: 1");
+    completions_wait(2);
+    ck_assert_str_eq(completions.responses[1], "+VAL: 2");
+
+    /* Error results are responses; only timeouts fail. */
+    ck_assert_str_eq(at_command(at, "AT+BOGUS"), "ERROR");
+    at_set_timeout_ms(at, 100);
+    errno = 0;
+    ck_assert(at_command(at, "AT+SILENT") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+
+    /* The next one is answered normally. */
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 4), "+VAL: 4");
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_response_kept)
+{
+    printf(":: test_at_response_kept\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* The command queued once the first one times out goes behind the
+     * blocking one, and starts as soon as that is answered, before
+     * at_command() even returns. */
+    char sink[8];
+    at_set_timeout_ms(at, 200);
+    ck_assert_int_eq(at_command_async(at, command_done, "AT+VAL=22", "AT+SILENT"), 0);
+    at_set_timeout(at, 5);
+    at_set_command_scanner(at, scanner_raw);
+    at_set_data_sink(at, sink, sizeof(sink));
+    ck_assert_str_eq(at_command(at, "AT+RAW=%d", 4), "+RAW: 4");
+    completions_wait(2);
+    ck_assert_int_eq(completions.errors[0], ETIMEDOUT);
+    ck_assert_str_eq(completions.responses[1], "+VAL: 22");
+
+    /* What at_command() returned is still described correctly. */
+    ck_assert_int_eq(at_data_sink_used(at), 4);
+    size_t count, len;
+    const struct at_response_line *lines = at_response_lines(at, &count);
+    ck_assert_int_eq(count, 1);
+    ck_assert_int_eq(lines[0].length, 7);
+    const char *line = at_response_line(at, 0, &len);
+    ck_assert(line != NULL);
+    ck_assert_int_eq(len, 7);
+    ck_assert(!memcmp(line, "+RAW: 4", 7));
+    ck_assert(at_response_line(at, 1, &len) == NULL);
+
+    /* The next command starts afresh. */
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 333), "+VAL: 333");
+    ck_assert_int_eq(at_data_sink_used(at), 0);
+    ck_assert(at_response_line(at, 0, &len) != NULL);
+    ck_assert_int_eq(len, 9);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_async_close)
+{
+    printf(":: test_at_async_close\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    at_set_timeout(at, 0);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+SILENT"), 0);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+VAL=%d", 1), 0);
+    emulator_wait(&emu, 1);
+
+    /* Both fail right in at_close(), in order. */
+    ck_assert_int_eq(at_close(at), 0);
+    ck_assert_int_eq(completions.count, 2);
+    ck_assert_int_eq(completions.errors[0], ENODEV);
+    ck_assert_int_eq(completions.errors[1], ENODEV);
+
+    errno = 0;
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT"), -1);
+    ck_assert_int_eq(errno, ENODEV);
+    ck_assert(at_command(at, "AT") == NULL);
+    ck_assert_int_eq(errno, ENODEV);
+    ck_assert_int_eq(completions.count, 2);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_timeout_keeps_state)
+{
+    printf(":: test_at_timeout_keeps_state\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    const char *held = at_command(at, "AT+VAL=%d", 7);
+    ck_assert_str_eq(held, "+VAL: 7");
+
+    /* The reader times a command out while this thread still holds its
+     * previous response and has already set up the next command. */
+    at_set_timeout_ms(at, 100);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+LATE"), 0);
+    at_set_timeout(at, 5);
+    char sink[8];
+    at_set_data_sink(at, sink, sizeof(sink));
+    completions_wait(1);
+    ck_assert_int_eq(completions.errors[0], ETIMEDOUT);
+
+    /* The URC arriving afterwards goes after the held response. */
+    urcs_wait(1);
+    ck_assert_str_eq(urcs.lines[0], "+URC: late");
+    ck_assert_str_eq(held, "+VAL: 7");
+
+    /* The data sink set up before the timeout still applies. */
+    at_set_command_scanner(at, scanner_raw);
+    ck_assert_str_eq(at_command(at, "AT+RAW=%d", 4), "+RAW: 4");
+    ck_assert_int_eq(at_data_sink_used(at), 4);
+    ck_assert(!memcmp(sink, "abcd", 4));
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_read_settings)
+{
+    printf(":: test_at_read_settings\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    errno = 0;
+    ck_assert_int_eq(at_set_read_unix(at, 0, 1, 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert_int_eq(at_set_read_unix(at, AT_UNIX_READ_SIZE+1, 1, 0), -1);
+    /* A VMIN above one could keep read() from returning for good. */
+    ck_assert_int_eq(at_set_read_unix(at, 64, 4, 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+
+    /* Whatever the chunk size, the parser gets all of the input. */
+    static char response[4096];
+    size_t len = emulator_respond("AT+URC=10", response);
+    const size_t chunks[] = { 1, 7, AT_UNIX_READ_SIZE };
+    for (size_t i=0; i<sizeof(chunks)/sizeof(*chunks); i++) {
+        ck_assert_int_eq(at_set_read_unix(at, chunks[i], 1, 0), 0);
+        at_reset_stats(at);
+        urcs.count = 0;
+        ck_assert_str_eq(at_command(at, "AT+URC=%d", 10), "");
+        ck_assert_int_eq(urcs.count, 10);
+        ck_assert_str_eq(urcs.lines[9], "+URC: 9");
+
+        struct at_parser_stats stats;
+        at_get_stats(at, &stats);
+        ck_assert_int_eq(stats.bytes_fed, len);
+        ck_assert_int_eq(stats.urcs, 10);
+        ck_assert_int_eq(stats.responses, 1);
+    }
+
+    /* VMIN and VTIME apply from the next open. */
+    ck_assert_int_eq(at_set_read_unix(at, 64, 16, 1), 0);
+    ck_assert_int_eq(at_close(at), 0);
+    ck_assert_int_eq(at_open(at), 0);
+    struct termios attr;
+    ck_assert_int_eq(tcgetattr(((struct at_unix *) at)->fd, &attr), 0);
+    ck_assert_int_eq(attr.c_cc[VMIN], 16);
+    ck_assert_int_eq(attr.c_cc[VTIME], 1);
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 1), "+VAL: 1");
+    char sink[100];
+    at_set_command_scanner(at, scanner_raw);
+    at_set_data_sink(at, sink, sizeof(sink));
+    ck_assert_str_eq(at_command(at, "AT+RAW=%d", 100), "+RAW: 100");
+    ck_assert_int_eq(at_data_sink_used(at), 100);
+    ck_assert(!memcmp(sink + 26, "abcd", 4));
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+struct registered {
+    unsigned calls;
+    int value;          /**< Number right after the prefix, or -1. */
+};
+
+static void handle_registered(const char *line, size_t len, struct at_tok *tok, void *arg)
+{
+    struct registered *registered = arg;
+    (void) line;
+    (void) len;
+
+    registered->calls++;
+    registered->value = -1;
+    at_tok_int(tok, &registered->value);
+}
+
+START_TEST(test_at_urc_registry)
+{
+    printf(":: test_at_urc_registry\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* Registered URCs bypass the URC callback; the handler gets the rest
+     * of the line. */
+    struct registered any = { 0 }, one = { 0 };
+    ck_assert_int_eq(at_register_urc(at, "+URC: ", handle_registered, &any), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(any.calls, 2);
+    ck_assert_int_eq(any.value, 1);
+    ck_assert_int_eq(urcs.count, 0);
+
+    /* With overlapping prefixes, the one registered first wins. */
+    ck_assert_int_eq(at_register_urc(at, "+URC: 1", handle_registered, &one), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(any.calls, 4);
+    ck_assert_int_eq(one.calls, 0);
+
+    /* Once the shorter one is gone, the longer one gets its line, and the
+     * rest go to the URC callback again. */
+    ck_assert_int_eq(at_unregister_urc(at, "+URC: "), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(any.calls, 4);
+    ck_assert_int_eq(one.calls, 1);
+    ck_assert_int_eq(one.value, -1);
+    ck_assert_int_eq(urcs.count, 1);
+    ck_assert_str_eq(urcs.lines[0], "+URC: 0");
+
+    errno = 0;
+    ck_assert_int_eq(at_unregister_urc(at, "+URC: "), -1);
+    ck_assert_int_eq(errno, ENOENT);
+
+    /* Registering a prefix again replaces its handler. */
+    ck_assert_int_eq(at_register_urc(at, "+URC: 1", handle_registered, &any), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(one.calls, 1);
+    ck_assert_int_eq(any.calls, 5);
+
+    /* Queued URCs are looked up when they're dispatched. */
+    ck_assert_int_eq(at_set_urc_queue(at, 4, 16, AT_URC_DROP_NEWEST, false), 0);
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 2), "");
+    ck_assert_int_eq(any.calls, 5);
+    ck_assert_int_eq(at_urc_drain(at), 2);
+    ck_assert_int_eq(any.calls, 6);
+    ck_assert_int_eq(urcs.count, 3);
+    ck_assert_int_eq(at_set_urc_queue(at, 0, 0, AT_URC_DROP_NEWEST, false), 0);
+
+    /* Fill the registry up. */
+    static char prefixes[AT_URC_HANDLERS_MAX][8];
+    for (int i=1; i<AT_URC_HANDLERS_MAX; i++) {
+        sprintf(prefixes[i], "+R%d: ", i);
+        ck_assert_int_eq(at_register_urc(at, prefixes[i], handle_registered, &one), 0);
+    }
+    errno = 0;
+    ck_assert_int_eq(at_register_urc(at, "+FULL: ", handle_registered, &one), -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+    /* Replacing still works when full. */
+    ck_assert_int_eq(at_register_urc(at, "+URC: 1", handle_registered, &one), 0);
+    ck_assert_int_eq(at_unregister_urc(at, prefixes[1]), 0);
+    ck_assert_int_eq(at_register_urc(at, "+FULL: ", handle_registered, &one), 0);
+    ck_assert_int_eq(at->urcs.count, AT_URC_HANDLERS_MAX);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+START_TEST(test_at_sim800_attach_fails)
+{
+    printf(":: test_at_sim800_attach_fails\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    /* The emulator rejects ATE0, so the driver gives up after registering
+     * its URC handlers; they must not stay behind. */
+    struct registered mine = { 0 };
+    ck_assert_int_eq(at_register_urc(at, "+URC: ", handle_registered, &mine), 0);
+    struct cellular *modem = cellular_sim800_alloc();
+    ck_assert(modem != NULL);
+    ck_assert_int_eq(cellular_attach(modem, at, "apn"), -1);
+    ck_assert_int_eq(at->urcs.count, 1);
+    ck_assert(at->cbs == NULL);
+    cellular_sim800_free(modem);
+
+    /* No room for all of them: the ones that did fit are gone, too. */
+    static char prefixes[AT_URC_HANDLERS_MAX][8];
+    for (int i=1; i<AT_URC_HANDLERS_MAX-2; i++) {
+        sprintf(prefixes[i], "+R%d: ", i);
+        ck_assert_int_eq(at_register_urc(at, prefixes[i], handle_registered, &mine), 0);
+    }
+    modem = cellular_sim800_alloc();
+    errno = 0;
+    ck_assert_int_eq(cellular_attach(modem, at, "apn"), -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+    ck_assert_int_eq(at->urcs.count, AT_URC_HANDLERS_MAX-2);
+    cellular_sim800_free(modem);
+
+    /* What was registered before still works. */
+    ck_assert_str_eq(at_command(at, "AT+URC=%d", 1), "");
+    ck_assert_int_eq(mine.calls, 1);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/**
+ * Check that commands time out on time.
+ */
+static void check_timeouts(struct at *at)
+{
+    struct timespec start;
+
+    at_set_timeout_ms(at, 150);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    errno = 0;
+    ck_assert(at_command(at, "AT+SILENT") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_ge(elapsed_ms(&start), 150);
+    ck_assert_int_lt(elapsed_ms(&start), 650);
+
+    /* Each timeout runs from when its command is sent. */
+    unsigned done = completions.count;
+    at_set_timeout_ms(at, 100);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+SILENT"), 0);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+SILENT"), 0);
+    completions_wait(done + 2);
+    ck_assert_int_ge(elapsed_ms(&start), 200);
+    ck_assert_int_lt(elapsed_ms(&start), 700);
+    ck_assert_int_eq(completions.errors[done], ETIMEDOUT);
+    ck_assert_int_eq(completions.errors[done+1], ETIMEDOUT);
+
+    /* Whole seconds still work. */
+    at_set_timeout(at, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert(at_command(at, "AT+SILENT") == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_ge(elapsed_ms(&start), 1000);
+    ck_assert_int_lt(elapsed_ms(&start), 1500);
+
+    /* A response within the deadline beats it. */
+    at_set_timeout_ms(at, 1000);
+    ck_assert_str_eq(at_command(at, "AT+VAL=%d", 5), "+VAL: 5");
+}
+
+START_TEST(test_at_timeout)
+{
+    printf(":: test_at_timeout\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    check_timeouts(at);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+/**
+ * Check that requests fail once the emulator hangs up.
+ */
+static void check_hangup(struct at *at)
+{
+    at_set_timeout(at, 0);
+
+    unsigned done = completions.count;
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT+HANGUP"), 0);
+    ck_assert_int_eq(at_command_async(at, command_done, NULL, "AT"), 0);
+    completions_wait(done + 2);
+    ck_assert_int_eq(completions.errors[done], EIO);
+    ck_assert_int_eq(completions.errors[done+1], EIO);
+}
+
+START_TEST(test_at_hangup)
+{
+    printf(":: test_at_hangup\n");
+
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open(&emu);
+
+    check_hangup(at);
+
+    at_free(at);
+    emulator_stop(&emu);
+}
+END_TEST
+
+#if defined(__linux__)
+static struct at *channel_open_reactor(struct emulator *emu, struct at_reactor *reactor)
+{
+    struct at *at = at_alloc_unix(emu->slave, 0);
+    ck_assert(at != NULL);
+    ck_assert_int_eq(at_set_reactor_unix(at, reactor), 0);
+    ck_assert_int_eq(at_open(at), 0);
+    at_set_callbacks(at, &callbacks, NULL);
+    at_set_timeout(at, 5);
+    return at;
+}
+
+#define REACTOR_COMMANDS 200
+
+static void *reactor_commands_thread(void *arg)
+{
+    struct at *at = arg;
+
+    for (int i=0; i<REACTOR_COMMANDS; i++) {
+        char expected[16];
+        sprintf(expected, "+VAL: %d", i);
+        const char *response = at_command(at, "AT+VAL=%d", i);
+        if (!response || strcmp(response, expected))
+            return (void *) "bad response";
+    }
+    return NULL;
+}
+
+START_TEST(test_at_reactor)
+{
+    printf(":: test_at_reactor\n");
+
+    struct at_reactor reactor;
+    errno = 0;
+    ck_assert_int_eq(at_reactor_start(&reactor, 0), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert_int_eq(at_reactor_start(&reactor, AT_REACTOR_THREADS_MAX+1), -1);
+    ck_assert_int_eq(at_reactor_start(&reactor, 2), 0);
+
+    struct emulator emu[3];
+    struct at *at[3];
+    for (int i=0; i<3; i++) {
+        emulator_start(&emu[i]);
+        at[i] = channel_open_reactor(&emu[i], &reactor);
+    }
+
+    /* Only a channel that was never opened can switch. */
+    errno = 0;
+    ck_assert_int_eq(at_set_reactor_unix(at[0], NULL), -1);
+    ck_assert_int_eq(errno, EBUSY);
+
+    /* Every response needs the channel re-armed. */
+    pthread_t threads[3];
+    for (int i=0; i<3; i++)
+        pthread_create(&threads[i], NULL, reactor_commands_thread, at[i]);
+    for (int i=0; i<3; i++) {
+        void *result;
+        pthread_join(threads[i], &result);
+        ck_assert_msg(result == NULL, "channel %d: %s", i, (const char *) result);
+    }
+
+    /* A channel timer fires while the others carry on. */
+    at_set_timeout_ms(at[0], 100);
+    ck_assert_int_eq(at_command_async(at[0], command_done, NULL, "AT+SILENT"), 0);
+    ck_assert_str_eq(at_command(at[1], "AT+VAL=%d", 1), "+VAL: 1");
+    completions_wait(1);
+    ck_assert_int_eq(completions.errors[0], ETIMEDOUT);
+    ck_assert_str_eq(at_command(at[0], "AT+VAL=%d", 2), "+VAL: 2");
+
+    /* The reactor can't stop while it serves channels. */
+    errno = 0;
+    ck_assert_int_eq(at_reactor_stop(&reactor), -1);
+    ck_assert_int_eq(errno, EBUSY);
+
+    /* Closing one channel leaves the others running. */
+    ck_assert_int_eq(at_close(at[2]), 0);
+    ck_assert_int_eq(at_reactor_stop(&reactor), -1);
+    ck_assert_str_eq(at_command(at[1], "AT+VAL=%d", 3), "+VAL: 3");
+    ck_assert_int_eq(at_open(at[2]), 0);
+    ck_assert_str_eq(at_command(at[2], "AT+VAL=%d", 4), "+VAL: 4");
+
+    for (int i=0; i<3; i++) {
+        at_free(at[i]);
+        emulator_stop(&emu[i]);
+    }
+    ck_assert_int_eq(at_reactor_stop(&reactor), 0);
+}
+END_TEST
+
+START_TEST(test_at_reactor_timeout)
+{
+    printf(":: test_at_reactor_timeout\n");
+
+    struct at_reactor reactor;
+    ck_assert_int_eq(at_reactor_start(&reactor, 1), 0);
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open_reactor(&emu, &reactor);
+
+    check_timeouts(at);
+
+    at_free(at);
+    emulator_stop(&emu);
+    ck_assert_int_eq(at_reactor_stop(&reactor), 0);
+}
+END_TEST
+
+START_TEST(test_at_reactor_write_stall)
+{
+    printf(":: test_at_reactor_write_stall\n");
+
+    struct at_reactor reactor;
+    ck_assert_int_eq(at_reactor_start(&reactor, 1), 0);
+    struct emulator emu[2];
+    struct at *at[2];
+    for (int i=0; i<2; i++) {
+        emulator_start(&emu[i]);
+        at[i] = channel_open_reactor(&emu[i], &reactor);
+    }
+
+    /* Stop reading one channel's line. */
+    at_set_timeout_ms(at[0], 50);
+    ck_assert_int_eq(at_command_async(at[0], command_done, NULL, "AT+STALL"), 0);
+    completions_wait(1);
+    ck_assert_int_eq(completions.errors[0], ETIMEDOUT);
+
+    /* Filling the line up doesn't keep the command from timing out. */
+    static char data[256 * 1024];
+    memset(data, 'x', sizeof(data));
+    struct timespec start;
+    at_set_timeout_ms(at[0], 100);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    errno = 0;
+    ck_assert(at_command_raw(at[0], data, sizeof(data)) == NULL);
+    ck_assert_int_eq(errno, ETIMEDOUT);
+    ck_assert_int_lt(elapsed_ms(&start), 400);
+
+    /* The reactor thread starts writing the second command once the first
+     * times out, and serves the other channel meanwhile. */
+    ck_assert_int_eq(at_command_async(at[0], command_done, NULL, "AT"), 0);
+    ck_assert_int_eq(at_command_async(at[0], command_done, NULL, "AT"), 0);
+    completions_wait(2);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ck_assert_str_eq(at_command(at[1], "AT+VAL=%d", 1), "+VAL: 1");
+    ck_assert_int_lt(elapsed_ms(&start), 300);
+    completions_wait(3);
+    ck_assert_int_eq(completions.errors[1], ETIMEDOUT);
+    ck_assert_int_eq(completions.errors[2], ETIMEDOUT);
+
+    for (int i=0; i<2; i++) {
+        at_free(at[i]);
+        emulator_stop(&emu[i]);
+    }
+    ck_assert_int_eq(at_reactor_stop(&reactor), 0);
+}
+END_TEST
+
+START_TEST(test_at_reactor_hangup)
+{
+    printf(":: test_at_reactor_hangup\n");
+
+    struct at_reactor reactor;
+    ck_assert_int_eq(at_reactor_start(&reactor, 1), 0);
+    struct emulator emu;
+    emulator_start(&emu);
+    struct at *at = channel_open_reactor(&emu, &reactor);
+
+    check_hangup(at);
+
+    at_free(at);
+    emulator_stop(&emu);
+    ck_assert_int_eq(at_reactor_stop(&reactor), 0);
+}
+END_TEST
+#endif
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("at");
+    tcase_add_test(tc, test_at_close_blocked);
+    tcase_add_test(tc, test_at_urc_direct);
+    tcase_add_test(tc, test_at_urc_queue_drop);
+    tcase_add_test(tc, test_at_urc_queue_dispatcher);
+    tcase_add_test(tc, test_at_urc_queue_replace_draining);
+    tcase_add_test(tc, test_at_async_order);
+    tcase_add_test(tc, test_at_async_blocking);
+    tcase_add_test(tc, test_at_response_kept);
+    tcase_add_test(tc, test_at_async_close);
+    tcase_add_test(tc, test_at_timeout_keeps_state);
+    tcase_add_test(tc, test_at_urc_registry);
+    tcase_add_test(tc, test_at_sim800_attach_fails);
+    tcase_add_test(tc, test_at_read_settings);
+    tcase_add_test(tc, test_at_timeout);
+    tcase_add_test(tc, test_at_hangup);
+#if defined(__linux__)
+    tcase_add_test(tc, test_at_reactor);
+    tcase_add_test(tc, test_at_reactor_timeout);
+    tcase_add_test(tc, test_at_reactor_write_stall);
+    tcase_add_test(tc, test_at_reactor_hangup);
+#endif
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,149 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/at-hex.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+/* Reference decoder; mirrors the documented semantics one pair at a time. */
+static size_t reference_decode(uint8_t *dst, const char *src, size_t len)
+{
+    size_t done;
+    for (done = 0; done < len/2; done++) {
+        int hi = at_hex_value(src[2*done]);
+        int lo = at_hex_value(src[2*done+1]);
+        if (hi < 0 || lo < 0)
+            break;
+        dst[done] = (hi << 4) | lo;
+    }
+    return done;
+}
+
+START_TEST(test_hex_value)
+{
+    printf(":: test_hex_value\n");
+
+    const char *digits = "0123456789abcdef";
+    const char *upper = "0123456789ABCDEF";
+    for (int i=0; i<16; i++) {
+        ck_assert_int_eq(at_hex_value(digits[i]), i);
+        ck_assert_int_eq(at_hex_value(upper[i]), i);
+    }
+
+    for (int c=0; c<256; c++)
+        if (!strchr("0123456789abcdefABCDEF", c) || c == 0)
+            ck_assert_int_eq(at_hex_value((char) c), -1);
+}
+END_TEST
+
+START_TEST(test_hex_decode)
+{
+    printf(":: test_hex_decode\n");
+
+    uint8_t out[64];
+
+    ck_assert_int_eq(at_hex_decode(out, STR_LEN("")), 0);
+    ck_assert_int_eq(at_hex_decode(out, STR_LEN("a")), 0);
+
+    ck_assert_int_eq(at_hex_decode(out, STR_LEN("00ff7F80")), 4);
+    ck_assert(!memcmp(out, "\x00\xff\x7f\x80", 4));
+
+    /* Stops at the first pair with a separator in it. */
+    ck_assert_int_eq(at_hex_decode(out, STR_LEN("6162 6364")), 2);
+    ck_assert_int_eq(at_hex_decode(out, STR_LEN("616 26364")), 1);
+
+    /* Block-sized input, all 256 byte values in mixed case. */
+    char text[2*256+1];
+    uint8_t data[256], back[256];
+    for (int i=0; i<256; i++)
+        data[i] = i;
+    ck_assert_int_eq(at_hex_encode(text, data, 256), 512);
+    for (int i=0; i<512; i+=3)
+        if (text[i] >= 'A')
+            text[i] += 'a' - 'A';
+    ck_assert_int_eq(at_hex_decode(back, text, 512), 256);
+    ck_assert(!memcmp(data, back, 256));
+}
+END_TEST
+
+START_TEST(test_hex_decode_invalid)
+{
+    printf(":: test_hex_decode_invalid\n");
+
+    /* Poison every position of a multi-block run with every class of
+     * character the vector ranges could get wrong. */
+    static const char poison[] = { '/', ':', '@', 'G', '`', 'g', ' ', '\0', '\x80', '\xff' };
+    char text[96];
+    uint8_t out[48], expected[48];
+
+    for (size_t i=0; i<sizeof(text); i++)
+        text[i] = "0123456789abcdefABCDEF"[(i*7) % 22];
+
+    for (size_t pos=0; pos<sizeof(text); pos++) {
+        for (size_t p=0; p<sizeof(poison); p++) {
+            char saved = text[pos];
+            text[pos] = poison[p];
+            for (size_t offset=0; offset<4; offset++) {
+                size_t len = sizeof(text) - offset;
+                size_t n = reference_decode(expected, text + offset, len);
+                ck_assert_int_eq(at_hex_decode(out, text + offset, len), n);
+                ck_assert(!memcmp(out, expected, n));
+            }
+            text[pos] = saved;
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_hex_encode)
+{
+    printf(":: test_hex_encode\n");
+
+    char text[16];
+    memset(text, '#', sizeof(text));
+    ck_assert_int_eq(at_hex_encode(text, "\x00\x1f\xa0\xff", 4), 8);
+    ck_assert(!memcmp(text, "001FA0FF#", 9));
+
+    ck_assert_int_eq(at_hex_encode(text, "", 0), 0);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("hex");
+    tcase_add_test(tc, test_hex_value);
+    tcase_add_test(tc, test_hex_decode);
+    tcase_add_test(tc, test_hex_decode_invalid);
+    tcase_add_test(tc, test_hex_encode);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
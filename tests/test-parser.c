@@ -200,11 +200,66 @@ START_TEST(test_parser_overflow)
     at_parser_feed(parser, STR_LEN("1234\r\nOK\r\n"));
     expect_nothing();
 
-    /* this one doesn't. */
-    /* TODO: We could be better behaved when it comes to overflows. Not crashing is enough for now. */
+    /* this one doesn't; it's dropped to make room for the final response. */
+    expect_response("");
     at_parser_await_response(parser);
     at_parser_feed(parser, STR_LEN("12345\r\nOK\r\n"));
     expect_nothing();
+    ck_assert(at_parser_overflow(parser));
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static bool response_overflow;
+
+static void handle_response_overflow(const char *line, size_t len, void *priv)
+{
+    response_overflow = at_parser_overflow(priv);
+    assert_line_expected(line, len, &expected_responses);
+}
+
+START_TEST(test_parser_growable)
+{
+    printf(":: test_parser_growable\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response_overflow,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 8, NULL);
+    ck_assert(parser != NULL);
+    parser->priv = parser;
+
+    expect_prepare();
+
+    /* A fixed buffer reports truncation. */
+    expect_response("1234");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("1234\r\n567890\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(response_overflow);
+
+    /* A growable one takes whatever fits under the limit... */
+    ck_assert_int_eq(at_parser_set_buffer_limit(parser, 32), 0);
+    expect_response("1234\n56789\nabcdefghij");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("1234\r\n56789\r\nabcdefghij\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(!response_overflow);
+
+    /* ...and no more. Trailing lines make room for the final response. */
+    expect_response("0123456789\n0123456789");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0123456789\r\n0123456789\r\n0123456789\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert(response_overflow);
+
+    /* Caller-provided buffers can't grow. */
+    char buf[16];
+    struct at_parser fixed;
+    at_parser_init(&fixed, &cbs, buf, sizeof(buf), NULL);
+    ck_assert_int_eq(at_parser_set_buffer_limit(&fixed, 64), -1);
 
     at_parser_free(parser);
 }
@@ -270,6 +325,13 @@ START_TEST(test_parser_hexdata)
     at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 10\r\n61 62 6364 01 ff 78797a70\r\nOK\r\n"));
     expect_nothing();
 
+    /* Long runs go through the block decoder, split mid-byte. */
+    expect_response("+HEXDATA: 40\n0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcd");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 40\r\n30313233343536373839414243444546474"));
+    at_parser_feed(parser, STR_LEN("8494a4B4C4D4E4F505152535455565758595a61626364\r\nOK\r\n"));
+    expect_nothing();
+
     at_parser_free(parser);
 }
 END_TEST
@@ -304,6 +366,303 @@ START_TEST(test_parser_dataprompt)
 }
 END_TEST
 
+START_TEST(test_parser_data_sink)
+{
+    printf(":: test_parser_data_sink\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 32, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Payload bypasses the response buffer, which is too small to hold it. */
+    char sink[64];
+    at_parser_set_data_sink(parser, sink, sizeof(sink));
+    expect_response("+RAWDATA: 32");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 32\r\nabcdefghijklmnopqrstuvwxyz012345\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_parser_data_sink_used(parser), 32);
+    ck_assert(!memcmp(sink, "abcdefghijklmnopqrstuvwxyz012345", 32));
+
+    /* Hex data is decoded into the sink as well; excess is dropped. */
+    at_parser_set_data_sink(parser, sink, 4);
+    expect_response("+HEXDATA: 6");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+HEXDATA: 6\r\n616263646566\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_parser_data_sink_used(parser), 4);
+    ck_assert(!memcmp(sink, "abcd", 4));
+
+    /* The sink only applies to a single command. */
+    expect_response("+RAWDATA: 4\nwxyz");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 4\r\nwxyz\r\nOK\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_parser_data_sink_used(parser), 0);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_line_index)
+{
+    printf(":: test_parser_line_index\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    const struct at_response_line *lines;
+    size_t count;
+
+    /* Text lines, a data block with a newline in it and a final result. */
+    expect_response("+CSQ: 1\n+RAWDATA: 4\nw\nyz\nERROR");
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+CSQ: 1\r\nRING\r\n+RAWDATA: 4\r\nw\nyz\r\nERROR\r\n"));
+    expect_nothing();
+    lines = at_parser_response_lines(parser, &count);
+    ck_assert_int_eq(count, 4);
+    ck_assert_int_eq(lines[0].offset, 0);
+    ck_assert_int_eq(lines[0].length, 7);
+    ck_assert(!lines[0].data);
+    ck_assert_int_eq(lines[1].offset, 8);
+    ck_assert_int_eq(lines[1].length, 11);
+    ck_assert(!lines[1].data);
+    ck_assert_int_eq(lines[2].offset, 20);
+    ck_assert_int_eq(lines[2].length, 4);
+    ck_assert(lines[2].data);
+    ck_assert_int_eq(lines[3].offset, 25);
+    ck_assert_int_eq(lines[3].length, 5);
+    ck_assert(!lines[3].data);
+
+    /* Discarded lines are not indexed. */
+    expect_response("");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\nOK\r\n"));
+    expect_nothing();
+    at_parser_response_lines(parser, &count);
+    ck_assert_int_eq(count, 0);
+
+    /* Excess lines are stored but not indexed. */
+    expect_response("0\n1\n2\n3\n4\n5\n6\n7\n8\n9\na\nb\nc\nd\ne\nf\ng\nh");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("0\r\n1\r\n2\r\n3\r\n4\r\n5\r\n6\r\n7\r\n8\r\n"));
+    at_parser_feed(parser, STR_LEN("9\r\na\r\nb\r\nc\r\nd\r\ne\r\nf\r\ng\r\nh\r\nOK\r\n"));
+    expect_nothing();
+    lines = at_parser_response_lines(parser, &count);
+    ck_assert_int_eq(count, AT_RESPONSE_LINES_MAX);
+    ck_assert_int_eq(lines[count-1].offset, 2*(count-1));
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static size_t longest_span;
+
+static size_t strip_flow_control(const char *data, size_t len, char *out,
+                                 const char *line, size_t line_len, void *priv)
+{
+    (void) line;
+    (void) line_len;
+    (void) priv;
+
+    if (len > longest_span)
+        longest_span = len;
+
+    size_t used = 0;
+    for (size_t i=0; i<len; i++)
+        if (data[i] != '\x11' && data[i] != '\x13')
+            out[used++] = data[i];
+    return used;
+}
+
+static char uppercase_after_colon(char ch, char *line, size_t len, void *priv)
+{
+    (void) priv;
+
+    /* Sees the line as it is collected. */
+    if (memchr(line, ':', len) && ch >= 'a' && ch <= 'z')
+        return ch - 'a' + 'A';
+    return ch;
+}
+
+START_TEST(test_parser_span_handler)
+{
+    printf(":: test_parser_span_handler\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Flow control characters are removed from lines, but not from data;
+     * spans stop at newlines. */
+    longest_span = 0;
+    at_parser_set_span_handler(parser, strip_flow_control);
+    expect_response("+CSQ: 12,0\n+RAWDATA: 2\n\x11\x13");
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+CSQ:\x13 12,0\x11\r\nRI\x11NG\r\n+RAWDATA: 2\r\n\x11\x13\r\nO\x13K\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(longest_span, 14);
+
+    /* The handler only applies to a single command. */
+    expect_response("\x11");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\x11\r\nOK\r\n"));
+    expect_nothing();
+
+    /* Character handlers get one byte at a time. */
+    at_parser_set_character_handler(parser, uppercase_after_colon);
+    expect_response("+cgmi: SIMCOM");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("+cgmi: simcom\r\nOK\r\n"));
+    expect_nothing();
+
+    /* Span handlers take precedence. */
+    at_parser_set_character_handler(parser, uppercase_after_colon);
+    at_parser_set_span_handler(parser, strip_flow_control);
+    expect_response("+cgmi: simcom");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("+cgmi: sim\x11" "com\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static uint32_t ticks;
+
+static uint32_t tick_clock(void)
+{
+    return ticks++;
+}
+
+START_TEST(test_parser_stats)
+{
+    printf(":: test_parser_stats\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 64, NULL);
+    ck_assert(parser != NULL);
+    at_parser_set_clock(parser, tick_clock);
+
+    expect_prepare();
+
+    struct at_parser_stats stats;
+    at_parser_get_stats(parser, &stats);
+    ck_assert_int_eq(stats.bytes_fed, 0);
+    ck_assert_int_eq(stats.callback_time, 0);
+
+    /* Each callback takes exactly one tick of the clock. */
+    expect_urc("RING");
+    expect_urc("+FOO");
+    expect_response("+RAWDATA: 2\nab");
+    at_parser_feed(parser, STR_LEN("RING\r\n+FOO\r\n"));
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+RAWDATA: 2\r\nab\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_get_stats(parser, &stats);
+    ck_assert_int_eq(stats.bytes_fed, 35);
+    ck_assert_int_eq(stats.bytes_dropped, 0);
+    ck_assert_int_eq(stats.rawdata_bytes, 2);
+    ck_assert_int_eq(stats.hexdata_bytes, 0);
+    ck_assert_int_eq(stats.lines, 4);
+    ck_assert_int_eq(stats.responses, 1);
+    ck_assert_int_eq(stats.urcs, 2);
+    ck_assert_int_eq(stats.unexpected, 1);
+    ck_assert_int_eq(stats.callback_time, 3);
+
+    /* Counters survive parser resets, but not a stats reset. */
+    at_parser_reset(parser);
+    at_parser_reset_stats(parser);
+    at_parser_get_stats(parser, &stats);
+    ck_assert_int_eq(stats.bytes_fed, 0);
+    ck_assert_int_eq(stats.lines, 0);
+
+    /* Bytes that don't fit are counted. */
+    char sink[4];
+    at_parser_set_data_sink(parser, sink, sizeof(sink));
+    expect_response("+HEXDATA: 6");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("+HEXDATA: 6\r\n616263646566\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_get_stats(parser, &stats);
+    ck_assert_int_eq(stats.hexdata_bytes, 6);
+    ck_assert_int_eq(stats.bytes_dropped, 2);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static void feed_bytewise(struct at_parser *parser, const char *data, size_t len)
+{
+    for (size_t i=0; i<len; i++)
+        at_parser_feed(parser, data+i, 1);
+}
+
+START_TEST(test_parser_bytewise)
+{
+    printf(":: test_parser_bytewise\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Same streams as above, but split at every possible position. */
+    expect_response("12345\n67890");
+    expect_urc("RING");
+    expect_urc("RING");
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    feed_bytewise(parser, STR_LEN("\r\n12345\r\nRING\r\n67890\r\nRING\r\nOK\r\n\r\nRING\r\n"));
+    expect_nothing();
+
+    expect_response("+RAWDATA: 16\nRING\r\nabcd\x01\xffxyzp");
+    expect_urc("RING");
+    at_parser_await_response(parser);
+    feed_bytewise(parser, STR_LEN("\r\n+RAWDATA: 16\r\nRING\r\nabcd\x01\xFFxyzp\r\nRING\r\nOK\r\n"));
+    expect_nothing();
+
+    expect_response("+HEXDATA: 10\nabcd\x01\xffxyzp");
+    at_parser_await_response(parser);
+    feed_bytewise(parser, STR_LEN("\r\n+HEXDATA: 10\r\n61 62 6364 01 ff 78797a70\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_free(parser);
+}
+END_TEST
+
 static const char *response_buf_ptr;
 
 static void capture_response(const char *buf, size_t len, void *priv)
@@ -341,6 +700,301 @@ START_TEST(test_parser_urc_does_not_overwrite_response)
 }
 END_TEST
 
+START_TEST(test_parser_release_keeps_pending_line)
+{
+    printf(":: test_parser_release_keeps_pending_line\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 24, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* A URC is cut in half by each release; it must survive intact. Repeat
+     * enough times for the buffer to wrap around. */
+    expect_response("data");
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("data\r\nOK\r\nRI"));
+    expect_nothing();
+
+    for (int i=0; i<8; i++) {
+        expect_urc("RING");
+        expect_response("12345678");
+        at_parser_await_response(parser);
+        at_parser_feed(parser, STR_LEN("NG\r\n12345678\r\nOK\r\nRI"));
+        expect_nothing();
+    }
+
+    at_parser_free(parser);
+}
+END_TEST
+
+static GQueue expected_queued = G_QUEUE_INIT;
+
+static void handle_queued_response(const char *line, size_t len, void *priv)
+{
+    ck_assert(priv == &expected_queued);
+    assert_line_expected(line, len, &expected_queued);
+}
+
+START_TEST(test_parser_pipeline)
+{
+    printf(":: test_parser_pipeline\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 64, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+    g_queue_clear(&expected_queued);
+
+    char sink[8];
+    const struct at_parser_command commands[] = {
+        { .handle_response = handle_queued_response, .arg = &expected_queued },
+        { .scan_line = line_scanner, .sink = sink, .sink_size = sizeof(sink),
+          .handle_response = handle_queued_response, .arg = &expected_queued },
+        { .dataprompt = true, .handle_response = handle_queued_response, .arg = &expected_queued },
+        { .hold = true, .handle_response = capture_response },
+    };
+    for (size_t i=0; i<sizeof(commands)/sizeof(*commands); i++)
+        ck_assert_int_eq(at_parser_queue_command(parser, &commands[i]), 0);
+    ck_assert_int_eq(at_parser_queued_commands(parser), 4);
+
+    /* No room for more. */
+    ck_assert_int_eq(at_parser_queue_command(parser, &commands[0]), -1);
+    ck_assert_int_eq(errno, ENOBUFS);
+
+    /* Responses complete the commands in order; URCs go in between. Data
+     * lines are only raw data for the command that expects them. */
+    g_queue_push_tail(&expected_queued, "+CSQ: 17,0\n+RAWDATA: 4");
+    g_queue_push_tail(&expected_queued, "+RAWDATA: 4");
+    g_queue_push_tail(&expected_queued, "");
+    expect_urc("RING");
+    at_parser_feed(parser, STR_LEN("\r\n+CSQ: 17,0\r\n+RAWDATA: 4\r\n\r\nOK\r\n"
+                                   "\r\n+RAWDATA: 4\r\nOK\r\n\r\nOK\r\n"
+                                   "RING\r\n> \r\nERROR\r\n"));
+    expect_nothing();
+    ck_assert(g_queue_is_empty(&expected_queued));
+    ck_assert_int_eq(at_parser_queued_commands(parser), 0);
+    ck_assert(!memcmp(sink, "OK\r\n", 4));
+    ck_assert_str_eq(response_buf_ptr, "ERROR");
+
+    /* A held response stays put while later ones are collected. */
+    ck_assert_int_eq(at_parser_queue_command(parser, &commands[0]), 0);
+    g_queue_push_tail(&expected_queued, "+CREG: 0,1");
+    at_parser_feed(parser, STR_LEN("+CREG: 0,1\r\nOK\r\n"));
+    ck_assert(g_queue_is_empty(&expected_queued));
+    ck_assert_str_eq(response_buf_ptr, "ERROR");
+    at_parser_release_response(parser);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_cancel_commands)
+{
+    printf(":: test_parser_cancel_commands\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = capture_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 64, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+    g_queue_clear(&expected_queued);
+
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("data\r\nOK\r\n"));
+    ck_assert_str_eq(response_buf_ptr, "data");
+
+    /* A command gets cut off halfway through its response, while the next
+     * one is being set up. */
+    const struct at_parser_command command = {
+        .handle_response = handle_queued_response, .arg = &expected_queued,
+    };
+    ck_assert_int_eq(at_parser_queue_command(parser, &command), 0);
+    at_parser_feed(parser, STR_LEN("+CSQ: 17,0\r\n+CS"));
+    char sink[8];
+    at_parser_set_data_sink(parser, sink, sizeof(sink));
+    at_parser_cancel_commands(parser);
+    ck_assert_int_eq(at_parser_queued_commands(parser), 0);
+
+    /* The held response and the next command's settings are untouched; the
+     * partial line is gone. */
+    expect_urc("RING");
+    at_parser_feed(parser, STR_LEN("\r\nRING\r\n"));
+    expect_nothing();
+    ck_assert_str_eq(response_buf_ptr, "data");
+
+    struct at_parser_command next;
+    at_parser_take_next(parser, &next);
+    ck_assert(next.sink == sink);
+    ck_assert_int_eq(next.sink_size, sizeof(sink));
+
+    /* Later commands pick up from there. */
+    ck_assert_int_eq(at_parser_queue_command(parser, &command), 0);
+    g_queue_push_tail(&expected_queued, "+CREG: 0,1");
+    at_parser_feed(parser, STR_LEN("+CREG: 0,1\r\nOK\r\n"));
+    ck_assert(g_queue_is_empty(&expected_queued));
+    ck_assert_str_eq(response_buf_ptr, "data");
+    at_parser_release_response(parser);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_echo)
+{
+    printf(":: test_parser_echo\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 256, NULL);
+    ck_assert(parser != NULL);
+
+    expect_prepare();
+
+    /* Echoed command is dropped, whole or byte by byte. */
+    at_parser_expect_echo(parser, STR_LEN("AT+CGSN\r"));
+    at_parser_await_response(parser);
+    expect_response("123");
+    at_parser_feed(parser, STR_LEN("AT+CGSN\r\r\n123\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    at_parser_expect_echo(parser, STR_LEN("AT+CGSN\r"));
+    at_parser_await_response(parser);
+    expect_response("123");
+    feed_bytewise(parser, STR_LEN("AT+CGSN\r\r\n123\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* Without echo, lines that only start like the command are kept. */
+    at_parser_expect_echo(parser, STR_LEN("ATI\r"));
+    at_parser_await_response(parser);
+    expect_response("AT\nATX");
+    feed_bytewise(parser, STR_LEN("\r\nAT\r\nATX\r\n\r\nOK\r\n"));
+    expect_nothing();
+
+    /* Echo of a command expecting a dataprompt, then of the data. */
+    at_parser_expect_echo(parser, STR_LEN("AT+CIPSEND=5\r"));
+    at_parser_expect_dataprompt(parser);
+    at_parser_await_response(parser);
+    expect_response("");
+    at_parser_feed(parser, STR_LEN("AT+CIPSEND=5\r\r\n> "));
+    expect_nothing();
+
+    at_parser_expect_echo(parser, STR_LEN("a\r\nb\n"));
+    at_parser_await_response(parser);
+    expect_response("");
+    at_parser_feed(parser, STR_LEN("a\r\nb\n\r\nOK\r\n"));
+    expect_nothing();
+
+    struct at_parser_stats stats;
+    at_parser_get_stats(parser, &stats);
+    ck_assert_int_eq(stats.echo_bytes, 8 + 8 + 13 + 5);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_parser_trace)
+{
+    printf(":: test_parser_trace\n");
+
+    struct at_parser_callbacks cbs = {
+        .handle_response = handle_response,
+        .handle_urc = handle_urc,
+        .scan_line = line_scanner,
+    };
+    struct at_parser *parser = at_parser_alloc(&cbs, 64, NULL);
+    ck_assert(parser != NULL);
+
+    struct at_trace trace;
+    struct at_trace_record records[8], out[8];
+    ck_assert_int_eq(at_trace_init(&trace, records, 8, NULL), 0);
+    at_parser_set_trace(parser, &trace);
+
+    expect_prepare();
+
+    /* Every received line is traced with its type; data lengths are cut. */
+    expect_urc("RING");
+    expect_response("+CSQ: 1\n+RAWDATA: 2\nab");
+    at_parser_feed(parser, STR_LEN("RING\r\n"));
+    at_parser_await_response(parser);
+    at_parser_feed(parser, STR_LEN("\r\n+CSQ: 1\r\n+RAWDATA: 2\r\nab\r\nOK\r\n"));
+    expect_nothing();
+
+    ck_assert_int_eq(at_trace_snapshot(&trace, out, 8), 4);
+    ck_assert_int_eq(out[0].type, AT_RESPONSE_URC);
+    ck_assert_int_eq(out[1].type, AT_RESPONSE_INTERMEDIATE);
+    ck_assert_int_eq(out[1].length, 7);
+    ck_assert(!memcmp(out[1].data, "+CSQ: 1", 7));
+    ck_assert_int_eq(out[2].type, _AT_RESPONSE_RAWDATA_FOLLOWS);
+    ck_assert_int_eq(out[3].type, AT_RESPONSE_FINAL_OK);
+    for (int i=0; i<4; i++)
+        ck_assert_int_eq(out[i].event, AT_TRACE_LINE);
+
+    /* Tracing stops when the trace is removed. */
+    at_parser_set_trace(parser, NULL);
+    expect_urc("RING");
+    at_parser_feed(parser, STR_LEN("RING\r\n"));
+    expect_nothing();
+    ck_assert_int_eq(at_trace_snapshot(&trace, out, 8), 4);
+
+    at_parser_free(parser);
+}
+END_TEST
+
+START_TEST(test_prefix_matcher)
+{
+    printf(":: test_prefix_matcher\n");
+
+    static const char *const table[] = {
+        "+CIPRXGET: 1,",
+        "+CIEV: ",
+        "OK",
+        "+CIPRXGET:",
+        "RDY",
+        NULL
+    };
+    struct at_prefix_matcher matcher;
+    ck_assert_int_eq(at_prefix_matcher_init(&matcher, table), 0);
+
+    /* Results must agree with at_prefix_in_table(); first match wins. */
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIPRXGET: 1,0")), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIPRXGET: 2,0,4,0")), 3);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CIEV: 10,\"NET\"")), 1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("OK")), 2);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("RDY")), 4);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("RD")), -1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("+CSQ: 10,0")), -1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("")), -1);
+
+    /* An empty prefix matches everything. */
+    static const char *const wildcard[] = { "OK", "", NULL };
+    ck_assert_int_eq(at_prefix_matcher_init(&matcher, wildcard), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("OK")), 0);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("ERROR")), 1);
+    ck_assert_int_eq(at_prefix_match(&matcher, STR_LEN("")), 1);
+
+    /* Oversized tables are refused. */
+    static const char *oversized[AT_PREFIX_MATCHER_MAX+2];
+    for (int i=0; i<AT_PREFIX_MATCHER_MAX+1; i++)
+        oversized[i] = "X";
+    oversized[AT_PREFIX_MATCHER_MAX+1] = NULL;
+    ck_assert_int_eq(at_prefix_matcher_init(&matcher, oversized), -1);
+}
+END_TEST
+
 Suite *attentive_suite(void)
 {
     Suite *s = suite_create("attentive");
@@ -352,10 +1006,22 @@ Suite *attentive_suite(void)
     tcase_add_test(tc, test_parser_urc);
     tcase_add_test(tc, test_parser_mixed);
     tcase_add_test(tc, test_parser_overflow);
+    tcase_add_test(tc, test_parser_growable);
     tcase_add_test(tc, test_parser_rawdata);
     tcase_add_test(tc, test_parser_hexdata);
     tcase_add_test(tc, test_parser_dataprompt);
+    tcase_add_test(tc, test_parser_data_sink);
+    tcase_add_test(tc, test_parser_bytewise);
     tcase_add_test(tc, test_parser_urc_does_not_overwrite_response);
+    tcase_add_test(tc, test_parser_release_keeps_pending_line);
+    tcase_add_test(tc, test_parser_line_index);
+    tcase_add_test(tc, test_parser_stats);
+    tcase_add_test(tc, test_parser_span_handler);
+    tcase_add_test(tc, test_parser_pipeline);
+    tcase_add_test(tc, test_parser_cancel_commands);
+    tcase_add_test(tc, test_parser_echo);
+    tcase_add_test(tc, test_parser_trace);
+    tcase_add_test(tc, test_prefix_matcher);
     suite_add_tcase(s, tc);
 
     return s;
@@ -0,0 +1,174 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/at-tokenizer.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+START_TEST(test_tok_fields)
+{
+    printf(":: test_tok_fields\n");
+
+    struct at_tok tok;
+    int a = 0, b = 0, c = 0;
+
+    at_tok_init(&tok, STR_LEN("+CIPRXGET: 2,0,128,-3"));
+    ck_assert(at_tok_prefix(&tok, "+CIPRXGET: 2,"));
+    ck_assert(at_tok_int(&tok, NULL));
+    ck_assert(at_tok_int(&tok, &a));
+    ck_assert(at_tok_int(&tok, &b));
+    ck_assert(at_tok_ok(&tok));
+    ck_assert_int_eq(a, 128);
+    ck_assert_int_eq(b, -3);
+    ck_assert_int_eq(at_tok_error_pos(&tok), -1);
+
+    /* Leading spaces and other separators. */
+    at_tok_init(&tok, STR_LEN("0, SEND OK"));
+    ck_assert(at_tok_int(&tok, &a));
+    ck_assert(at_tok_prefix(&tok, " SEND OK"));
+    ck_assert_int_eq(a, 0);
+
+    at_tok_init(&tok, STR_LEN("10.20.30.40"));
+    ck_assert(at_tok_int(&tok, &a) && at_tok_char(&tok, '.') && at_tok_int(&tok, &b));
+    ck_assert_int_eq(a, 10);
+    ck_assert_int_eq(b, 20);
+
+    /* Only the first line is tokenized. */
+    at_tok_init(&tok, STR_LEN("+CSQ: 17\n99"));
+    ck_assert(at_tok_prefix(&tok, "+CSQ: "));
+    ck_assert(at_tok_int(&tok, &a));
+    ck_assert(!at_tok_int(&tok, &c));
+    ck_assert_int_eq(a, 17);
+    ck_assert_int_eq(c, 0);
+}
+END_TEST
+
+START_TEST(test_tok_errors)
+{
+    printf(":: test_tok_errors\n");
+
+    struct at_tok tok;
+    int a = 7, b = 7;
+
+    /* Errors are sticky and leave outputs alone. */
+    at_tok_init(&tok, STR_LEN("+CREG: x,5"));
+    ck_assert(at_tok_prefix(&tok, "+CREG: "));
+    ck_assert(!at_tok_int(&tok, &a));
+    ck_assert(!at_tok_skip(&tok));
+    ck_assert(!at_tok_int(&tok, &b));
+    ck_assert(!at_tok_ok(&tok));
+    ck_assert_int_eq(a, 7);
+    ck_assert_int_eq(b, 7);
+    ck_assert_int_eq(at_tok_error_pos(&tok), 7);
+
+    at_tok_init(&tok, STR_LEN("+CRE"));
+    ck_assert(!at_tok_prefix(&tok, "+CREG: "));
+    ck_assert_int_eq(at_tok_error_pos(&tok), 0);
+
+    /* Out of range. */
+    at_tok_init(&tok, STR_LEN("2147483647,-2147483648,2147483648"));
+    ck_assert(at_tok_int(&tok, &a));
+    ck_assert(at_tok_int(&tok, &b));
+    ck_assert_int_eq(a, 2147483647);
+    ck_assert_int_eq(b, -2147483647-1);
+    ck_assert(!at_tok_int(&tok, &a));
+    ck_assert_int_eq(at_tok_error_pos(&tok), 23);
+
+    at_tok_init(&tok, STR_LEN("-2147483648"));
+    ck_assert(at_tok_int(&tok, &a));
+    ck_assert_int_eq(a, -2147483647-1);
+    at_tok_init(&tok, STR_LEN("-2147483649"));
+    ck_assert(!at_tok_int(&tok, &a));
+
+    /* Unterminated quote. */
+    at_tok_init(&tok, STR_LEN("\"abc"));
+    ck_assert(!at_tok_string(&tok, NULL, NULL));
+}
+END_TEST
+
+START_TEST(test_tok_values)
+{
+    printf(":: test_tok_values\n");
+
+    struct at_tok tok;
+    const char *str;
+    size_t len;
+    float f;
+
+    at_tok_init(&tok, STR_LEN("#AGPSRING: 200,59.3293,-18.0686,12"));
+    ck_assert(at_tok_prefix(&tok, "#AGPSRING: "));
+    ck_assert(at_tok_int(&tok, NULL));
+    ck_assert(at_tok_float(&tok, &f));
+    ck_assert(fabsf(f - 59.3293f) < 1e-4);
+    ck_assert(at_tok_float(&tok, &f));
+    ck_assert(fabsf(f + 18.0686f) < 1e-4);
+    ck_assert(at_tok_float(&tok, &f));
+    ck_assert(fabsf(f - 12) < 1e-4);
+
+    /* Quoted strings may contain commas; bare ones end at one. */
+    at_tok_init(&tok, STR_LEN("\"a,b\",bare,,\"\""));
+    ck_assert(at_tok_string(&tok, &str, &len));
+    ck_assert_int_eq(len, 3);
+    ck_assert(!memcmp(str, "a,b", 3));
+    ck_assert(at_tok_string(&tok, &str, &len));
+    ck_assert_int_eq(len, 4);
+    ck_assert(!memcmp(str, "bare", 4));
+    ck_assert(at_tok_string(&tok, &str, &len));
+    ck_assert_int_eq(len, 0);
+    ck_assert(at_tok_string(&tok, &str, &len));
+    ck_assert_int_eq(len, 0);
+    ck_assert(at_tok_ok(&tok));
+
+    /* Digit runs are truncated to fit. */
+    char buf[8];
+    at_tok_init(&tok, STR_LEN("89460012345678901234"));
+    ck_assert(at_tok_digits(&tok, buf, sizeof(buf)));
+    ck_assert_str_eq(buf, "8946001");
+
+    at_tok_init(&tok, STR_LEN("#FTPGETPKT: \"file.bin\",0,1"));
+    int eof = 0;
+    ck_assert(at_tok_prefix(&tok, "#FTPGETPKT: ") && at_tok_skip(&tok) &&
+              at_tok_int(&tok, NULL) && at_tok_int(&tok, &eof));
+    ck_assert_int_eq(eof, 1);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("tokenizer");
+    tcase_add_test(tc, test_tok_fields);
+    tcase_add_test(tc, test_tok_errors);
+    tcase_add_test(tc, test_tok_values);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
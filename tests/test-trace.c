@@ -0,0 +1,223 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include <attentive/at-trace.h>
+#include <attentive/parser.h>
+
+
+#define STR_LEN(s) s, strlen(s)
+
+static uint32_t ticks;
+
+static uint32_t tick_clock(void)
+{
+    return ticks++;
+}
+
+START_TEST(test_trace_init)
+{
+    printf(":: test_trace_init\n");
+
+    struct at_trace trace;
+    struct at_trace_record records[8];
+
+    errno = 0;
+    ck_assert_int_eq(at_trace_init(&trace, records, 6, NULL), -1);
+    ck_assert_int_eq(errno, EINVAL);
+    ck_assert_int_eq(at_trace_init(&trace, records, 0, NULL), -1);
+    ck_assert_int_eq(at_trace_init(&trace, records, (size_t) UINT32_MAX + 1, NULL), -1);
+
+    /* A trace without storage records nothing. */
+    ck_assert_int_eq(at_trace_init(&trace, NULL, 0, NULL), 0);
+    at_trace_record(&trace, AT_TRACE_COMMAND, 0, STR_LEN("AT"));
+    ck_assert_int_eq(at_trace_snapshot(&trace, records, 8), 0);
+
+    /* Recording into no trace at all is allowed, too. */
+    at_trace_record(NULL, AT_TRACE_COMMAND, 0, STR_LEN("AT"));
+
+    ck_assert_int_eq(at_trace_init(&trace, records, 8, NULL), 0);
+    ck_assert_int_eq(at_trace_snapshot(&trace, records, 8), 0);
+}
+END_TEST
+
+START_TEST(test_trace_record)
+{
+    printf(":: test_trace_record\n");
+
+    struct at_trace trace;
+    struct at_trace_record records[8], out[8];
+    ticks = 100;
+    ck_assert_int_eq(at_trace_init(&trace, records, 8, tick_clock), 0);
+
+    char longline[AT_TRACE_DATA_MAX + 10];
+    memset(longline, 'x', sizeof(longline));
+
+    at_trace_record(&trace, AT_TRACE_COMMAND, 0, STR_LEN("AT+CSQ"));
+    at_trace_record(&trace, AT_TRACE_LINE, AT_RESPONSE_FINAL_OK, STR_LEN("OK"));
+    at_trace_record(&trace, AT_TRACE_LINE, AT_RESPONSE_UNEXPECTED, longline, sizeof(longline));
+    at_trace_record(&trace, AT_TRACE_TIMEOUT, 0, NULL, 0);
+
+    ck_assert_int_eq(at_trace_snapshot(&trace, out, 8), 4);
+
+    ck_assert_int_eq(out[0].timestamp, 100);
+    ck_assert_int_eq(out[0].event, AT_TRACE_COMMAND);
+    ck_assert_int_eq(out[0].length, 6);
+    ck_assert(!memcmp(out[0].data, "AT+CSQ", 6));
+
+    ck_assert_int_eq(out[1].timestamp, 101);
+    ck_assert_int_eq(out[1].event, AT_TRACE_LINE);
+    ck_assert_int_eq(out[1].type, AT_RESPONSE_FINAL_OK);
+    ck_assert_int_eq(out[1].length, 2);
+
+    /* Long lines keep their length, but only the first bytes. */
+    ck_assert_int_eq(out[2].type, AT_RESPONSE_UNEXPECTED);
+    ck_assert_int_eq(out[2].length, sizeof(longline));
+    ck_assert(!memcmp(out[2].data, longline, AT_TRACE_DATA_MAX));
+
+    ck_assert_int_eq(out[3].event, AT_TRACE_TIMEOUT);
+    ck_assert_int_eq(out[3].length, 0);
+
+    /* A short snapshot gets the most recent records. */
+    ck_assert_int_eq(at_trace_snapshot(&trace, out, 2), 2);
+    ck_assert_int_eq(out[0].timestamp, 102);
+    ck_assert_int_eq(out[1].timestamp, 103);
+}
+END_TEST
+
+START_TEST(test_trace_wrap)
+{
+    printf(":: test_trace_wrap\n");
+
+    struct at_trace trace;
+    struct at_trace_record records[4], out[8];
+    ticks = 0;
+    ck_assert_int_eq(at_trace_init(&trace, records, 4, tick_clock), 0);
+
+    for (int i=0; i<10; i++)
+        at_trace_record(&trace, AT_TRACE_COMMAND, 0, STR_LEN("AT"));
+
+    /* Only the last four survive, oldest first. */
+    ck_assert_int_eq(at_trace_snapshot(&trace, out, 8), 4);
+    for (int i=0; i<4; i++)
+        ck_assert_int_eq(out[i].timestamp, 6 + i);
+}
+END_TEST
+
+START_TEST(test_trace_dump)
+{
+    printf(":: test_trace_dump\n");
+
+    struct at_trace trace;
+    struct at_trace_record records[4];
+    ticks = 7;
+    ck_assert_int_eq(at_trace_init(&trace, records, 4, tick_clock), 0);
+
+    at_trace_record(&trace, AT_TRACE_COMMAND, 0, STR_LEN("AT+CIPSEND=0,3"));
+    at_trace_record(&trace, AT_TRACE_RAW, 0, STR_LEN("a'\x01"));
+    at_trace_record(&trace, AT_TRACE_LINE, AT_RESPONSE_URC, STR_LEN("RING"));
+    at_trace_record(&trace, AT_TRACE_TIMEOUT, 0, NULL, 0);
+
+    char *text;
+    size_t size;
+    FILE *stream = open_memstream(&text, &size);
+    ck_assert(stream != NULL);
+    at_trace_dump(&trace, stream);
+    fclose(stream);
+
+    ck_assert_str_eq(text,
+        "         7 > 'AT+CIPSEND=0,3'\n"
+        "         8 > [3 bytes] 'a\\x27\\x01'\n"
+        "         9 < urc 'RING'\n"
+        "        10 ! timeout\n");
+    free(text);
+}
+END_TEST
+
+#define WRITER_RECORDS 200000
+
+static struct at_trace shared_trace;
+
+static void *trace_writer(void *arg)
+{
+    (void) arg;
+
+    char data[AT_TRACE_DATA_MAX];
+    for (int i=0; i<WRITER_RECORDS; i++) {
+        uint8_t value = i & 0x7f;
+        memset(data, value, sizeof(data));
+        at_trace_record(&shared_trace, AT_TRACE_LINE, 0, data, value % AT_TRACE_DATA_MAX + 1);
+    }
+    return NULL;
+}
+
+START_TEST(test_trace_threads)
+{
+    printf(":: test_trace_threads\n");
+
+    static struct at_trace_record records[16], out[16];
+    ck_assert_int_eq(at_trace_init(&shared_trace, records, 16, NULL), 0);
+
+    pthread_t writers[2];
+    for (int i=0; i<2; i++)
+        pthread_create(&writers[i], NULL, trace_writer, NULL);
+
+    /* Snapshots taken while the ring is hammered never return torn records. */
+    while (__atomic_load_n(&shared_trace.head, __ATOMIC_RELAXED) < 2*WRITER_RECORDS) {
+        size_t count = at_trace_snapshot(&shared_trace, out, 16);
+        for (size_t i=0; i<count; i++) {
+            uint8_t value = out[i].data[0];
+            ck_assert_int_eq(out[i].length, value % AT_TRACE_DATA_MAX + 1);
+            for (size_t j=0; j<out[i].length; j++)
+                ck_assert_int_eq((uint8_t) out[i].data[j], value);
+        }
+    }
+
+    for (int i=0; i<2; i++)
+        pthread_join(writers[i], NULL);
+
+    ck_assert_int_eq(shared_trace.head, 2*WRITER_RECORDS);
+    ck_assert_int_eq(at_trace_snapshot(&shared_trace, out, 16), 16);
+}
+END_TEST
+
+Suite *attentive_suite(void)
+{
+    Suite *s = suite_create("attentive");
+    TCase *tc;
+
+    tc = tcase_create("trace");
+    tcase_add_test(tc, test_trace_init);
+    tcase_add_test(tc, test_trace_record);
+    tcase_add_test(tc, test_trace_wrap);
+    tcase_add_test(tc, test_trace_dump);
+    tcase_add_test(tc, test_trace_threads);
+    suite_add_tcase(s, tc);
+
+    return s;
+}
+
+int main()
+{
+    int number_failed;
+    Suite *s = attentive_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -0,0 +1,587 @@
+/*
+ * Copyright © 2015 Zyax AB
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Response scanner generator. Reads a declarative scanner spec and writes a
+ * header with one C line scanner per spec entry.
+ *
+ * Spec format, one rule per line, '#' starts a comment:
+ *
+ *   scanner scanner_cipsend
+ *       "DATA ACCEPT:" int int      -> final_ok
+ *       int " SEND OK"              -> final_ok
+ *       "SEND OK" $                 -> final_ok
+ *
+ *   scanner scanner_ciprxget
+ *       "+CIPRXGET: 2," int int int -> rawdata $2
+ *
+ * Pattern elements are matched left to right from the start of the line:
+ *
+ *   "text"  literal text (escapes: \\ \" \r \n \t)
+ *   int     a decimal integer with an optional trailing comma, exactly as
+ *           at_tok_int() parses it; the Nth one is captured as $N
+ *   $       end of line
+ *
+ * Rules are tried in order and the first match wins; lines that match no
+ * rule are AT_RESPONSE_UNKNOWN. Actions are final, final_ok, intermediate,
+ * intermediate_discarded, urc, unexpected, "rawdata $N" and "hexdata $N".
+ * Data blocks are only announced for lengths that are positive and fit in
+ * the response type.
+ *
+ * Generated scanners switch on the first byte of the line, so only rules
+ * that can start with it are tried, and parse integers inline instead of
+ * going through the tokenizer.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MAX_SCANNERS  32
+#define MAX_RULES     32
+#define MAX_ELEMENTS  16
+#define MAX_LITERAL   64
+#define MAX_NAME      64
+#define MAX_LINE      512
+
+enum element_kind {
+    ELEMENT_LITERAL,
+    ELEMENT_INT,
+    ELEMENT_END,
+};
+
+struct element {
+    enum element_kind kind;
+    char text[MAX_LITERAL];
+    size_t len;
+};
+
+struct rule {
+    struct element elements[MAX_ELEMENTS];
+    int count;
+    const char *action;
+    int capture;        /**< Captured int for data actions, 1-based; 0 if none. */
+};
+
+struct scanner {
+    char name[MAX_NAME];
+    struct rule rules[MAX_RULES];
+    int count;
+};
+
+static const char *spec_path;
+static int spec_line;
+
+static struct scanner scanners[MAX_SCANNERS];
+static int nscanners;
+
+static void fail(const char *message)
+{
+    fprintf(stderr, "%s:%d: %s\n", spec_path, spec_line, message);
+    exit(EXIT_FAILURE);
+}
+
+static const char *skip_spaces(const char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return p;
+}
+
+static bool is_ident(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+/**
+ * Read a bare word into buf.
+ *
+ * @returns Pointer past the word.
+ */
+static const char *read_word(const char *p, char *buf, size_t size)
+{
+    size_t len = 0;
+    while (is_ident(p[len])) {
+        if (len + 1 >= size)
+            fail("word too long");
+        buf[len] = p[len];
+        len++;
+    }
+    buf[len] = '\0';
+    return p + len;
+}
+
+/**
+ * Read a quoted literal into an element.
+ *
+ * @returns Pointer past the closing quote.
+ */
+static const char *read_literal(const char *p, struct element *element)
+{
+    element->kind = ELEMENT_LITERAL;
+    element->len = 0;
+
+    for (p++; *p != '"'; p++) {
+        char c = *p;
+        if (c == '\0')
+            fail("unterminated literal");
+        if (c == '\\') {
+            switch (*++p) {
+                case '\\': c = '\\'; break;
+                case '"': c = '"'; break;
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                default: fail("unknown escape in literal");
+            }
+        }
+        if (element->len >= sizeof(element->text))
+            fail("literal too long");
+        element->text[element->len++] = c;
+    }
+
+    if (element->len == 0)
+        fail("empty literal");
+    return p + 1;
+}
+
+static const char *action_name(const char *word)
+{
+    static const struct {
+        const char *word;
+        const char *name;
+    } actions[] = {
+        { "final",                  "AT_RESPONSE_FINAL" },
+        { "final_ok",               "AT_RESPONSE_FINAL_OK" },
+        { "intermediate",           "AT_RESPONSE_INTERMEDIATE" },
+        { "intermediate_discarded", "AT_RESPONSE_INTERMEDIATE_DISCARDED" },
+        { "urc",                    "AT_RESPONSE_URC" },
+        { "unexpected",             "AT_RESPONSE_UNEXPECTED" },
+        { "rawdata",                "AT_RESPONSE_RAWDATA_FOLLOWS" },
+        { "hexdata",                "AT_RESPONSE_HEXDATA_FOLLOWS" },
+    };
+
+    for (size_t i=0; i<sizeof(actions)/sizeof(*actions); i++)
+        if (!strcmp(word, actions[i].word))
+            return actions[i].name;
+    return NULL;
+}
+
+static bool is_data_action(const char *action)
+{
+    return strstr(action, "_FOLLOWS") != NULL;
+}
+
+static void parse_rule(const char *p, struct rule *rule)
+{
+    int ints = 0;
+    memset(rule, 0, sizeof(*rule));
+
+    for (;;) {
+        p = skip_spaces(p);
+        if (*p == '\0')
+            fail("missing action");
+        if (p[0] == '-' && p[1] == '>')
+            break;
+        if (rule->count >= MAX_ELEMENTS)
+            fail("too many pattern elements");
+
+        struct element *element = &rule->elements[rule->count];
+        if (*p == '"') {
+            p = read_literal(p, element);
+        } else if (*p == '$') {
+            element->kind = ELEMENT_END;
+            p++;
+        } else {
+            char word[MAX_NAME];
+            p = read_word(p, word, sizeof(word));
+            if (strcmp(word, "int"))
+                fail("expected a literal, int or $");
+            element->kind = ELEMENT_INT;
+            ints++;
+        }
+
+        if (rule->count > 0 && rule->elements[rule->count-1].kind == ELEMENT_END)
+            fail("$ must be the last pattern element");
+        rule->count++;
+    }
+
+    if (rule->count == 0 || rule->elements[0].kind == ELEMENT_END)
+        fail("pattern must start with a literal or int");
+
+    char word[MAX_NAME];
+    p = read_word(skip_spaces(p + 2), word, sizeof(word));
+    rule->action = action_name(word);
+    if (!rule->action)
+        fail("unknown action");
+
+    p = skip_spaces(p);
+    if (is_data_action(rule->action)) {
+        if (*p != '$')
+            fail("data actions need a $N length capture");
+        rule->capture = atoi(p + 1);
+        if (rule->capture < 1 || rule->capture > ints)
+            fail("capture refers to a missing int");
+        p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        p = skip_spaces(p);
+    }
+
+    if (*p != '\0')
+        fail("trailing garbage after action");
+}
+
+/**
+ * Strip a comment and the line terminator, minding literals.
+ */
+static void strip_line(char *line)
+{
+    bool quoted = false;
+    for (char *p = line; *p; p++) {
+        if (quoted && *p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*p == '#' || *p == '\r' || *p == '\n')) {
+            *p = '\0';
+            break;
+        }
+    }
+}
+
+static void parse_spec(FILE *f)
+{
+    char line[MAX_LINE];
+    struct scanner *scanner = NULL;
+
+    while (fgets(line, sizeof(line), f)) {
+        spec_line++;
+        if (!strchr(line, '\n') && !feof(f))
+            fail("line too long");
+        strip_line(line);
+
+        const char *p = skip_spaces(line);
+        if (*p == '\0')
+            continue;
+
+        if (!strncmp(p, "scanner", 7) && (p[7] == ' ' || p[7] == '\t')) {
+            if (nscanners >= MAX_SCANNERS)
+                fail("too many scanners");
+            scanner = &scanners[nscanners++];
+            p = read_word(skip_spaces(p + 7), scanner->name, sizeof(scanner->name));
+            if (scanner->name[0] == '\0' || *skip_spaces(p) != '\0')
+                fail("expected a scanner name");
+            for (int i=0; i<nscanners-1; i++)
+                if (!strcmp(scanners[i].name, scanner->name))
+                    fail("duplicate scanner name");
+            continue;
+        }
+
+        if (!scanner)
+            fail("rule outside of a scanner");
+        if (scanner->count >= MAX_RULES)
+            fail("too many rules");
+        parse_rule(p, &scanner->rules[scanner->count++]);
+    }
+
+    if (ferror(f))
+        fail("read error");
+    if (nscanners == 0)
+        fail("no scanners defined");
+    for (int i=0; i<nscanners; i++) {
+        if (scanners[i].count == 0) {
+            fprintf(stderr, "%s: scanner %s has no rules\n", spec_path, scanners[i].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Bitmask of rules that can match a line starting with the given byte.
+ */
+static uint32_t rules_for_byte(const struct scanner *scanner, int c)
+{
+    uint32_t mask = 0;
+
+    for (int i=0; i<scanner->count; i++) {
+        const struct element *first = &scanner->rules[i].elements[0];
+        bool match;
+        if (first->kind == ELEMENT_LITERAL)
+            match = (uint8_t) first->text[0] == c;
+        else
+            match = c == ' ' || c == '+' || c == '-' || (c >= '0' && c <= '9');
+        if (match)
+            mask |= UINT32_C(1) << i;
+    }
+
+    return mask;
+}
+
+static void write_char(FILE *out, int c)
+{
+    if (c == '\'' || c == '\\')
+        fprintf(out, "'\\%c'", c);
+    else if (c >= 0x20 && c < 0x7f)
+        fprintf(out, "'%c'", c);
+    else
+        fprintf(out, "%d", c);
+}
+
+static void write_string(FILE *out, const char *text, size_t len)
+{
+    fputc('"', out);
+    for (size_t i=0; i<len; i++) {
+        uint8_t c = text[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c == '\r')
+            fputs("\\r", out);
+        else if (c == '\n')
+            fputs("\\n", out);
+        else if (c == '\t')
+            fputs("\\t", out);
+        else if (c < 0x20 || c >= 0x7f)
+            fprintf(out, "\\%03o", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_rule(FILE *out, const struct rule *rule)
+{
+    const char *indent = "                ";
+    bool first = true;
+    int ints = 0;
+
+    /* The switch has already matched the first byte of a leading literal. */
+    const struct element *lead = &rule->elements[0];
+    bool skip = lead->kind == ELEMENT_LITERAL;
+    fprintf(out, "            p = line%s;\n", skip ? " + 1" : "");
+    fprintf(out, "            if (");
+
+    for (int i=0; i<rule->count; i++) {
+        const struct element *element = &rule->elements[i];
+        const char *text = element->text;
+        size_t len = element->len;
+        if (i == 0 && skip) {
+            text++;
+            len--;
+            if (len == 0)
+                continue;
+        }
+
+        if (!first)
+            fprintf(out, " &&\n%s", indent);
+        first = false;
+
+        switch (element->kind) {
+            case ELEMENT_LITERAL:
+                fprintf(out, "scangen_lit(&p, end, ");
+                write_string(out, text, len);
+                fprintf(out, ", %zu)", len);
+                break;
+            case ELEMENT_INT:
+                ints++;
+                fprintf(out, "scangen_int(&p, end, %s)", ints == rule->capture ? "&value" : "NULL");
+                break;
+            case ELEMENT_END:
+                fprintf(out, "p == end");
+                break;
+        }
+    }
+
+    if (rule->capture) {
+        if (!first)
+            fprintf(out, " &&\n%s", indent);
+        first = false;
+        fprintf(out, "value > 0 && value <= INT_MAX >> 8");
+    }
+
+    /* A lone single-byte literal is fully matched by the switch. */
+    if (first)
+        fprintf(out, "true");
+
+    fprintf(out, ")\n");
+    if (rule->capture)
+        fprintf(out, "                return %s(value);\n", rule->action);
+    else
+        fprintf(out, "                return %s;\n", rule->action);
+}
+
+static void write_scanner(FILE *out, const struct scanner *scanner)
+{
+    bool captures = false;
+    for (int i=0; i<scanner->count; i++)
+        captures |= scanner->rules[i].capture != 0;
+
+    fprintf(out, "static enum at_response_type %s(const char *line, size_t len, void *arg)\n", scanner->name);
+    fprintf(out, "{\n");
+    fprintf(out, "    const char *end = line + len;\n");
+    fprintf(out, "    const char *p;\n");
+    if (captures)
+        fprintf(out, "    int value;\n");
+    fprintf(out, "\n");
+    fprintf(out, "    (void) arg;\n");
+    fprintf(out, "\n");
+    fprintf(out, "    if (len == 0)\n");
+    fprintf(out, "        return AT_RESPONSE_UNKNOWN;\n");
+    fprintf(out, "\n");
+    fprintf(out, "    switch ((unsigned char) line[0]) {\n");
+
+    /* Bytes with the same candidate rules share a case. */
+    uint32_t masks[256];
+    bool done[256];
+    for (int c=0; c<256; c++) {
+        masks[c] = rules_for_byte(scanner, c);
+        done[c] = false;
+    }
+
+    for (int c=0; c<256; c++) {
+        if (done[c] || !masks[c])
+            continue;
+
+        fprintf(out, "        ");
+        int column = 8;
+        for (int d=c; d<256; d++) {
+            if (masks[d] != masks[c])
+                continue;
+            done[d] = true;
+            if (column > 70) {
+                fprintf(out, "\n        ");
+                column = 8;
+            } else if (d != c) {
+                fputc(' ', out);
+                column++;
+            }
+            fprintf(out, "case ");
+            write_char(out, d);
+            fputc(':', out);
+            column += 9;
+        }
+        fprintf(out, "\n");
+
+        for (int i=0; i<scanner->count; i++)
+            if (masks[c] & (UINT32_C(1) << i))
+                write_rule(out, &scanner->rules[i]);
+        fprintf(out, "            break;\n");
+    }
+
+    fprintf(out, "    }\n");
+    fprintf(out, "\n");
+    fprintf(out, "    return AT_RESPONSE_UNKNOWN;\n");
+    fprintf(out, "}\n");
+}
+
+static const char helpers[] =
+    "#ifndef SCANGEN_HELPERS\n"
+    "#define SCANGEN_HELPERS\n"
+    "\n"
+    "static inline bool scangen_lit(const char **p, const char *end, const char *text, size_t len)\n"
+    "{\n"
+    "    if ((size_t) (end - *p) < len || memcmp(*p, text, len))\n"
+    "        return false;\n"
+    "    *p += len;\n"
+    "    return true;\n"
+    "}\n"
+    "\n"
+    "/* Same syntax as at_tok_int(), including the optional trailing comma. */\n"
+    "static inline bool scangen_int(const char **p, const char *end, int *value)\n"
+    "{\n"
+    "    const char *pos = *p;\n"
+    "    while (pos < end && *pos == ' ')\n"
+    "        pos++;\n"
+    "\n"
+    "    bool negative = false;\n"
+    "    if (pos < end && (*pos == '-' || *pos == '+'))\n"
+    "        negative = (*pos++ == '-');\n"
+    "\n"
+    "    if (pos == end || *pos < '0' || *pos > '9')\n"
+    "        return false;\n"
+    "\n"
+    "    unsigned long limit = negative ? (unsigned long) INT_MAX + 1 : INT_MAX;\n"
+    "    unsigned long result = 0;\n"
+    "    while (pos < end && *pos >= '0' && *pos <= '9') {\n"
+    "        result = result * 10 + (*pos++ - '0');\n"
+    "        if (result > limit)\n"
+    "            return false;\n"
+    "    }\n"
+    "\n"
+    "    if (pos < end && *pos == ',')\n"
+    "        pos++;\n"
+    "\n"
+    "    if (value)\n"
+    "        *value = negative ? -(int) (result - 1) - 1 : (int) result;\n"
+    "    *p = pos;\n"
+    "    return true;\n"
+    "}\n"
+    "\n"
+    "#endif\n";
+
+static void write_header(FILE *out)
+{
+    fprintf(out, "/* Generated by tools/scanner-gen from %s. Do not edit. */\n", spec_path);
+    fprintf(out, "\n");
+    fprintf(out, "#include <attentive/parser.h>\n");
+    fprintf(out, "\n");
+    fprintf(out, "#include <limits.h>\n");
+    fprintf(out, "#include <stdbool.h>\n");
+    fprintf(out, "#include <string.h>\n");
+    fprintf(out, "\n");
+    fputs(helpers, out);
+
+    for (int i=0; i<nscanners; i++) {
+        fprintf(out, "\n");
+        write_scanner(out, &scanners[i]);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <spec> [<output>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    spec_path = argv[1];
+    FILE *f = fopen(spec_path, "r");
+    if (!f) {
+        perror(spec_path);
+        return EXIT_FAILURE;
+    }
+    parse_spec(f);
+    fclose(f);
+
+    /* The spec is fully checked before the output is touched. */
+    FILE *out = stdout;
+    if (argc == 3) {
+        out = fopen(argv[2], "w");
+        if (!out) {
+            perror(argv[2]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    write_header(out);
+
+    if (fflush(out) != 0 || ferror(out) || (out != stdout && fclose(out) != 0)) {
+        perror(argc == 3 ? argv[2] : "stdout");
+        if (argc == 3)
+            remove(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* vim: set ts=4 sw=4 et: */